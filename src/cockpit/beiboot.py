@@ -445,6 +445,8 @@ async def run(args) -> None:
             return
         assert isinstance(capabilities, dict)  # convince mypy
         capabilities['explicit-superuser'] = True
+        # We understand binary frames regardless of what the remote bridge does
+        capabilities['binary-framing'] = True
 
         # only patch the packages line if we are in beiboot mode
         if bridge.packages:
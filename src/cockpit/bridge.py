@@ -157,7 +157,7 @@ class Bridge(Router, PackagesListener):
 
     def do_send_init(self) -> None:
         init_args: 'dict[str, JsonValue]' = {
-            'capabilities': {'explicit-superuser': True},
+            'capabilities': {'explicit-superuser': True, 'binary-framing': True},
             'command': 'init',
             'os-release': self.get_os_release(),
             'version': 1,
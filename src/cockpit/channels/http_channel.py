@@ -3,37 +3,193 @@
 # SPDX-License-Identifier: GPL-3.0-or-later
 
 
-import http.client
+import asyncio
+import json
 import logging
-import socket
+import re
 import ssl
+from typing import AsyncIterator, ClassVar, Dict, List, Optional, Tuple
 
 from ..channel import AsyncChannel, ChannelError
 from ..jsonutil import JsonObject, get_dict, get_int, get_object, get_str, typechecked
 
 logger = logging.getLogger(__name__)
 
+# Same rules as http.client
+ILLEGAL_PATH_CHAR = re.compile('[\x00-\x20\x7f]')
+LEGAL_HEADER_NAME = re.compile(r'[^:\s][^:\r\n]*')
+ILLEGAL_HEADER_VALUE = re.compile(r'\n(?![ \t])|\r(?![ \t\n])')
+# Unlike int(), no signs, underscores or whitespace
+CONTENT_LENGTH = re.compile(r'[0-9]+')
+CHUNK_SIZE = re.compile(rb'[0-9A-Fa-f]+')
 
-class HttpChannel(AsyncChannel):
-    payload = 'http-stream2'
+METHODS_EXPECTING_BODY = {'PATCH', 'POST', 'PUT'}
+# Requests that can be sent again when an idle connection turns out to be gone
+IDEMPOTENT_METHODS = {'DELETE', 'GET', 'HEAD', 'OPTIONS', 'PUT'}
+MAX_HEADERS = 100
 
-    @staticmethod
-    def get_headers(response: http.client.HTTPResponse, *, binary: bool) -> JsonObject:
-        # Never send these headers
-        remove = {'Connection', 'Transfer-Encoding'}
 
-        if not binary:
-            # Only send these headers for raw binary streams
-            remove.update({'Content-Length', 'Range'})
+class HttpError(Exception):
+    pass
 
-        return {key: value for key, value in response.getheaders() if key not in remove}
 
-    @staticmethod
-    def create_client(options: JsonObject) -> http.client.HTTPConnection:
+class HttpConnection:
+    """A HTTP/1.1 client connection, which carries one request at a time.
+
+    After a response body has been read in full, `keep_alive` says whether
+    the connection can be used for another request.
+    """
+    keep_alive: bool = False
+    received: bool = False
+    idle_handle: 'asyncio.TimerHandle | None' = None
+
+    # How to find the end of the response body
+    chunked: bool = False
+    remaining: Optional[int] = None
+
+    def __init__(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        self.loop = asyncio.get_running_loop()
+        self.reader = reader
+        self.writer = writer
+
+    def usable(self) -> bool:
+        return self.loop is asyncio.get_running_loop() and not self.reader.at_eof() and not self.writer.is_closing()
+
+    def close(self) -> None:
+        self.keep_alive = False
+        # An idle connection can outlive its event loop, there's nothing left to close then
+        if not self.loop.is_closed():
+            self.writer.close()
+
+    def write(self, data: bytes, *, chunked: bool = False) -> None:
+        if chunked:
+            self.writer.write(f'{len(data):x}\r\n'.encode('ascii') + data + b'\r\n')
+        else:
+            self.writer.write(data)
+
+    async def drain(self) -> None:
+        await self.writer.drain()
+
+    async def readline(self) -> bytes:
+        try:
+            line = await self.reader.readline()
+        except ValueError as exc:
+            raise HttpError('line too long') from exc
+        if not line.endswith(b'\n'):
+            raise HttpError('connection closed unexpectedly')
+        self.received = True
+        return line
+
+    async def read_headers(self) -> List[Tuple[str, str]]:
+        headers: List[Tuple[str, str]] = []
+        while True:
+            line = await self.readline()
+            if line in (b'\r\n', b'\n'):
+                return headers
+            if len(headers) >= MAX_HEADERS:
+                raise HttpError(f'got more than {MAX_HEADERS} headers')
+            name, sep, value = line.decode('iso-8859-1').partition(':')
+            if not sep:
+                raise HttpError(f'invalid header line: {line!r}')
+            headers.append((name.strip(), value.strip()))
+
+    async def read_response(self, method: str) -> Tuple[int, str, List[Tuple[str, str]]]:
+        while True:
+            line = await self.readline()
+            version, _, rest = line.decode('iso-8859-1').rstrip('\r\n').partition(' ')
+            status, _, reason = rest.partition(' ')
+            if not version.startswith('HTTP/1.') or len(status) != 3 or not status.isdigit():
+                raise HttpError(f'invalid status line: {line!r}')
+            headers = await self.read_headers()
+
+            # Skip over "100 Continue" and friends, we never asked for them
+            if not 100 <= int(status) < 200 or int(status) == 101:
+                break
+
+        # Only kept alive once the end of the body is known for sure
+        self.keep_alive = False
+        self.chunked = False
+        self.remaining = None
+
+        lower = {name.lower(): value for name, value in headers}
+        connection = {token.strip().lower() for token in lower.get('connection', '').split(',')}
+        keep_alive = version == 'HTTP/1.1' and 'close' not in connection
+
+        if method == 'HEAD' or int(status) in (204, 304):
+            self.remaining = 0
+        elif 'chunked' in lower.get('transfer-encoding', '').lower():
+            self.chunked = True
+        elif 'content-length' in lower:
+            lengths = {value for name, value in headers if name.lower() == 'content-length'}
+            if len(lengths) != 1 or not CONTENT_LENGTH.fullmatch(lower['content-length']):
+                raise HttpError(f'invalid Content-Length: {", ".join(lengths)}')
+            self.remaining = int(lower['content-length'])
+        else:
+            # The body ends when the server closes the connection
+            keep_alive = False
+
+        self.keep_alive = keep_alive
+        return int(status), reason, headers
+
+    async def read_exactly(self, size: int, block_size: int) -> AsyncIterator[bytes]:
+        while size > 0:
+            block = await self.reader.read(min(size, block_size))
+            if not block:
+                raise HttpError(f'connection closed with {size} bytes of the response body missing')
+            size -= len(block)
+            yield block
+
+    async def read_body(self, block_size: int) -> AsyncIterator[bytes]:
+        # Whatever follows a framing error can't be told apart from the next response
+        keep_alive = self.keep_alive
+        self.keep_alive = False
+
+        if self.chunked:
+            while True:
+                line = await self.readline()
+                size_field = line.split(b';')[0].strip()
+                if not CHUNK_SIZE.fullmatch(size_field):
+                    raise HttpError(f'invalid chunk size: {line!r}')
+                size = int(size_field, 16)
+                if size == 0:
+                    await self.read_headers()  # trailers
+                    break
+                async for block in self.read_exactly(size, block_size):
+                    yield block
+                if await self.readline() not in (b'\r\n', b'\n'):
+                    raise HttpError('chunk is longer than its size')
+        elif self.remaining is not None:
+            async for block in self.read_exactly(self.remaining, block_size):
+                yield block
+        else:
+            while True:
+                block = await self.reader.read(block_size)
+                if not block:
+                    break
+                yield block
+
+        self.keep_alive = keep_alive
+
+
+class HttpEndpoint:
+    """The server to send a request to, from the options of the channel.
+
+    Idle keep-alive connections are only kept for channels with a
+    "connection" option, and shared between channels with the same `key`:
+    the same "connection" option and the same server.  Some servers tie
+    authentication to the connection, so unrelated requests don't share.
+    """
+    IDLE_TIMEOUT = 15
+    MAX_IDLE = 4
+
+    idle: ClassVar[Dict[Tuple[str, ...], List[HttpConnection]]] = {}
+
+    def __init__(self, options: JsonObject) -> None:
         opt_address = get_str(options, 'address', 'localhost')
         opt_tls = get_dict(options, 'tls', None)
         opt_unix = get_str(options, 'unix', None)
         opt_port = get_int(options, 'port', None)
+        opt_connection = get_str(options, 'connection', None)
 
         if opt_tls is not None and opt_unix is not None:
             raise ChannelError('protocol-error', message='TLS on Unix socket is not supported')
@@ -42,44 +198,149 @@ class HttpChannel(AsyncChannel):
         if opt_port is not None and opt_unix is not None:
             raise ChannelError('protocol-error', message='cannot specify both "port" and "unix" options')
 
+        self.context: 'ssl.SSLContext | None' = None
         if opt_tls is not None:
             authority = get_dict(opt_tls, 'authority', None)
             if authority is not None:
                 data = get_str(authority, 'data', None)
                 if data is not None:
-                    context = ssl.create_default_context(cadata=data)
+                    self.context = ssl.create_default_context(cadata=data)
                 else:
-                    context = ssl.create_default_context(cafile=get_str(authority, 'file'))
+                    self.context = ssl.create_default_context(cafile=get_str(authority, 'file'))
             else:
-                context = ssl.create_default_context()
+                self.context = ssl.create_default_context()
 
             if 'validate' in opt_tls and not opt_tls['validate']:
-                context.check_hostname = False
-                context.verify_mode = ssl.VerifyMode.CERT_NONE
+                self.context.check_hostname = False
+                self.context.verify_mode = ssl.VerifyMode.CERT_NONE
+
+        self.address = opt_address
+        self.port = opt_port
+        self.unix = opt_unix
+        self.key: 'Tuple[str, ...] | None' = None
+        if opt_connection is not None:
+            self.key = (opt_connection, opt_unix or '', opt_address, str(opt_port),
+                        json.dumps(opt_tls, sort_keys=True) if opt_tls is not None else '')
 
-            return http.client.HTTPSConnection(opt_address, port=opt_port, context=context)
+        # Like http.client, leave out the default port
+        host = f'[{opt_address}]' if ':' in opt_address else opt_address
+        default_port = 443 if self.context is not None else 80
+        self.host = host if opt_port in (None, default_port) else f'{host}:{opt_port}'
 
+    async def connect(self) -> HttpConnection:
+        if self.unix is not None:
+            reader, writer = await asyncio.open_unix_connection(self.unix)
         else:
-            return http.client.HTTPConnection(opt_address, port=opt_port)
+            reader, writer = await asyncio.open_connection(self.address, self.port, ssl=self.context)
+        return HttpConnection(reader, writer)
 
-    @staticmethod
-    def connect(connection: http.client.HTTPConnection, opt_unix: 'str | None') -> None:
-        # Blocks.  Runs in a thread.
-        if opt_unix:
-            # create the connection's socket so that it won't call .connect() internally (which only supports TCP)
-            connection.sock = socket.socket(socket.AF_UNIX)
-            connection.sock.connect(opt_unix)
+    def take_idle(self) -> 'HttpConnection | None':
+        if self.key is None:
+            return None
+
+        connections = self.idle.get(self.key, [])
+        while connections:
+            connection = connections.pop()
+            assert connection.idle_handle is not None
+            connection.idle_handle.cancel()
+            if connection.usable():
+                break
+            connection.close()
         else:
-            # explicitly call connect(), so that we can do proper error handling
-            connection.connect()
+            connection = None
+
+        if not connections:
+            self.idle.pop(self.key, None)
+        return connection
+
+    def put_idle(self, connection: HttpConnection) -> None:
+        if self.key is None:
+            connection.close()
+            return
+
+        connections = self.idle.setdefault(self.key, [])
+        if len(connections) >= self.MAX_IDLE:
+            connection.close()
+            return
+
+        connection.received = False
+        connection.idle_handle = connection.loop.call_later(self.IDLE_TIMEOUT, self.expire_idle, connection)
+        connections.append(connection)
+
+    def expire_idle(self, connection: HttpConnection) -> None:
+        assert self.key is not None
+        connections = self.idle.get(self.key, [])
+        if connection in connections:
+            connections.remove(connection)
+            if not connections:
+                del self.idle[self.key]
+        connection.close()
+
+
+class HttpChannel(AsyncChannel):
+    payload = 'http-stream2'
+
+    # Request bodies up to this size are sent with a Content-Length, larger ones are streamed chunked
+    BODY_BUFFER_SIZE = 4 * AsyncChannel.BLOCK_SIZE
 
     @staticmethod
-    def request(
-        connection: http.client.HTTPConnection, method: str, path: str, headers: 'dict[str, str]', body: bytes
-    ) -> http.client.HTTPResponse:
-        # Blocks.  Runs in a thread.
-        connection.request(method, path, headers=headers or {}, body=body)
-        return connection.getresponse()
+    def get_headers(headers: List[Tuple[str, str]], *, binary: bool) -> JsonObject:
+        # Never send these headers
+        remove = {'Connection', 'Transfer-Encoding'}
+
+        if not binary:
+            # Only send these headers for raw binary streams
+            remove.update({'Content-Length', 'Range'})
+
+        return {key: value for key, value in headers if key not in remove}
+
+    @staticmethod
+    def build_head(method: str, path: str, headers: 'dict[str, str]', endpoint: HttpEndpoint) -> List[str]:
+        if ILLEGAL_PATH_CHAR.search(method) or ILLEGAL_PATH_CHAR.search(path):
+            raise ChannelError('protocol-error', message=f'invalid request: {method} {path}')
+
+        names = {name.lower() for name in headers}
+        lines = [f'{method} {path} HTTP/1.1']
+        if 'host' not in names:
+            lines.append(f'Host: {endpoint.host}')
+        if 'accept-encoding' not in names:
+            lines.append('Accept-Encoding: identity')
+
+        for name, value in headers.items():
+            if not LEGAL_HEADER_NAME.fullmatch(name) or ILLEGAL_HEADER_VALUE.search(value):
+                raise ChannelError('protocol-error', message=f'invalid header: {name}')
+            lines.append(f'{name}: {value}')
+
+        return lines
+
+    async def send_request(self, connection: HttpConnection, head: List[str],
+                           body: List[bytes], complete: bool, chunked: bool) -> None:
+        connection.write('\r\n'.join([*head, '', '']).encode('iso-8859-1'))
+        for block in body:
+            connection.write(block, chunked=chunked)
+        await connection.drain()
+
+        if not complete:
+            while True:
+                data = await self.read()
+                if data is None:
+                    break
+                # an empty chunk would end the body
+                if data:
+                    connection.write(data, chunked=chunked)
+                    await connection.drain()
+
+        if chunked:
+            connection.write(b'0\r\n\r\n')
+            await connection.drain()
+
+    async def connect(self, endpoint: HttpEndpoint) -> HttpConnection:
+        try:
+            return await endpoint.connect()
+        except ssl.SSLCertVerificationError as exc:
+            raise ChannelError('unknown-hostkey', message=str(exc)) from exc
+        except (OSError, IOError) as exc:
+            raise ChannelError('not-found', message=str(exc)) from exc
 
     async def run(self, options: JsonObject) -> None:
         logger.debug('open %s', options)
@@ -88,55 +349,78 @@ class HttpChannel(AsyncChannel):
         path = get_str(options, 'path')
         headers = get_object(options, 'headers', lambda d: {k: typechecked(v, str) for k, v in d.items()}, None)
 
-        if 'connection' in options:
-            raise ChannelError('protocol-error', message='connection sharing is not implemented on this bridge')
-
-        connection = self.create_client(options)
+        endpoint = HttpEndpoint(options)
+        head = self.build_head(method, path, headers or {}, endpoint)
 
         self.ready()
 
-        body = b''
-        while True:
+        body: List[bytes] = []
+        size = 0
+        complete = False
+        while size < self.BODY_BUFFER_SIZE:
             data = await self.read()
             if data is None:
+                complete = True
                 break
-            body += data
+            body.append(data)
+            size += len(data)
 
-        # Connect in a thread and handle errors
-        try:
-            await self.in_thread(self.connect, connection, get_str(options, 'unix', None))
-        except ssl.SSLCertVerificationError as exc:
-            raise ChannelError('unknown-hostkey', message=str(exc)) from exc
-        except (OSError, IOError) as exc:
-            raise ChannelError('not-found', message=str(exc)) from exc
+        lower = {name.lower(): value for name, value in (headers or {}).items()}
+        chunked = False
+        if 'content-length' in lower or 'transfer-encoding' in lower:
+            pass  # the caller knows what it is doing
+        elif complete:
+            if size or method in METHODS_EXPECTING_BODY:
+                head.append(f'Content-Length: {size}')
+        else:
+            head.append('Transfer-Encoding: chunked')
+            chunked = True
 
-        # Submit request in a thread and handle errors
+        # An idle connection may have been closed by the server in the meantime.  If nothing came
+        # back on it, send the request again on a new connection, unless the body is gone already.
+        # The server might have acted on the request before dropping the connection, so only
+        # requests which are safe to repeat use an idle connection at all.
+        connection = endpoint.take_idle() if method in IDEMPOTENT_METHODS else None
+        finished = False
         try:
-            response = await self.in_thread(self.request, connection, method, path, headers or {}, body)
-        except (http.client.HTTPException, OSError) as exc:
-            raise ChannelError('terminated', message=str(exc)) from exc
+            if connection is not None:
+                try:
+                    await self.send_request(connection, head, body, complete, chunked)
+                    status, reason, response_headers = await connection.read_response(method)
+                except (HttpError, OSError) as exc:
+                    if connection.received or not complete:
+                        raise
+                    logger.debug('idle connection failed, retrying on a new one: %s', exc)
+                    connection.close()
+                    connection = None
 
-        self.send_control(command='response',
-                          status=response.status,
-                          reason=response.reason,
-                          headers=self.get_headers(response, binary=self.is_binary))
+            if connection is None:
+                connection = await self.connect(endpoint)
+                await self.send_request(connection, head, body, complete, chunked)
+                status, reason, response_headers = await connection.read_response(method)
 
-        # Receive the body and finish up
-        try:
-            while True:
-                block = await self.in_thread(response.read1, self.BLOCK_SIZE)
-                if not block:
-                    break
+            self.send_control(command='response',
+                              status=status,
+                              reason=reason,
+                              headers=self.get_headers(response_headers, binary=self.is_binary))
+
+            # Receive the body and finish up
+            async for block in connection.read_body(self.BLOCK_SIZE):
                 await self.write(block)
 
             logger.debug('reading response done')
-            # this returns immediately and does not read anything more, but updates the http.client's
-            # internal state machine to "response done"
-            block = response.read()
-            assert block == b''
-
-            await self.in_thread(connection.close)
-        except (http.client.HTTPException, OSError) as exc:
+            finished = True
+        except (HttpError, OSError) as exc:
             raise ChannelError('terminated', message=str(exc)) from exc
+        finally:
+            # Also when the channel got closed in the middle of the request
+            if connection is not None and not (finished and connection.keep_alive):
+                connection.close()
+
+        assert connection is not None
+        if connection.keep_alive and 'close' not in lower.get('connection', '').lower():
+            endpoint.put_idle(connection)
+        else:
+            connection.close()
 
         self.done()
@@ -9,10 +9,10 @@ import logging
 import sys
 import time
 from collections import defaultdict
-from typing import Dict, List, NamedTuple, Optional, Set, Tuple, Type, Union
+from typing import ClassVar, Collection, Dict, List, NamedTuple, Optional, Set, Tuple, Type, Union, cast
 
 from ..channel import AsyncChannel, ChannelError
-from ..jsonutil import JsonList, JsonObject, get_int
+from ..jsonutil import JsonList, JsonObject, get_bool, get_int, get_str_or_none
 from ..samples import SAMPLERS, SampleDescription, Sampler, Samples
 
 logger = logging.getLogger(__name__)
@@ -23,12 +23,96 @@ class MetricInfo(NamedTuple):
     desc: SampleDescription
 
 
+Value = Union[float, bool, None]
+DataPoint = List[Union[Value, List[Value]]]
+
+
+def same_value(a: object, b: object) -> bool:
+    # False == 0 and 1 == 1.0 in Python, but not on the wire
+    return type(a) is type(b) and a == b
+
+
+class SampleSchedule:
+    """Samples the sources for all internal metrics channels with the same interval.
+
+    Each source is read once per tick, however many channels want it, and
+    the samples are handed to every subscribed channel's queue.  A sampler
+    that fails puts its exception in the queues of the channels using it
+    instead.
+    """
+    schedules: ClassVar[Dict[int, 'SampleSchedule']] = {}
+
+    interval: int
+    samplers: Dict[Type[Sampler], Sampler]
+    subscribers: 'Dict[asyncio.Queue[Samples | Exception], Collection[Type[Sampler]]]'
+    task: 'asyncio.Task[None] | None' = None
+
+    def __init__(self, interval: int) -> None:
+        self.interval = interval
+        self.samplers = {}
+        self.subscribers = {}
+
+    @classmethod
+    def subscribe(cls, interval: int, sampler_classes: Collection[Type[Sampler]],
+                  queue: 'asyncio.Queue[Samples | Exception]') -> 'SampleSchedule':
+        schedule = cls.schedules.get(interval)
+        if schedule is None:
+            schedule = cls.schedules[interval] = SampleSchedule(interval)
+
+        schedule.subscribers[queue] = sampler_classes
+        for sampler_class in sampler_classes:
+            if sampler_class not in schedule.samplers:
+                schedule.samplers[sampler_class] = sampler_class()
+
+        if schedule.task is None:
+            schedule.task = asyncio.create_task(schedule.run())
+        return schedule
+
+    def unsubscribe(self, queue: 'asyncio.Queue[Samples | Exception]') -> None:
+        del self.subscribers[queue]
+
+        if not self.subscribers:
+            assert self.task is not None
+            self.task.cancel()
+            del self.schedules[self.interval]
+            return
+
+        # Stop reading sources that nobody wants anymore
+        wanted = {sampler_class for classes in self.subscribers.values() for sampler_class in classes}
+        for sampler_class in set(self.samplers) - wanted:
+            del self.samplers[sampler_class]
+
+    def sample(self, sampler_classes: Collection[Type[Sampler]]) -> Samples:
+        samples: Samples = defaultdict(dict)
+        for sampler_class in sampler_classes:
+            self.samplers[sampler_class].sample(samples)
+        return samples
+
+    async def run(self) -> None:
+        # Subscribers take their first sample themselves
+        while True:
+            await asyncio.sleep(self.interval / 1000)
+
+            samples: Samples = defaultdict(dict)
+            failures: Dict[Type[Sampler], Exception] = {}
+            for sampler_class, sampler in self.samplers.items():
+                try:
+                    sampler.sample(samples)
+                except Exception as exc:
+                    failures[sampler_class] = exc
+
+            # Only the channels that use a failing sampler get its exception
+            for queue, sampler_classes in self.subscribers.items():
+                failure = next((failures[cls] for cls in sampler_classes if cls in failures), None)
+                queue.put_nowait(samples if failure is None else failure)
+
+
 class InternalMetricsChannel(AsyncChannel):
     payload = 'metrics1'
     restrictions = [('source', 'internal')]
 
     metrics: List[MetricInfo]
-    samplers: Set[Sampler]
+    sampler_classes: Set[Type[Sampler]]
     samplers_cache: Optional[Dict[str, Tuple[Type[Sampler], SampleDescription]]] = None
 
     interval: int = 1000
@@ -36,6 +120,17 @@ class InternalMetricsChannel(AsyncChannel):
     last_timestamp: float = 0
     next_timestamp: float = 0
 
+    # Opt-in compression of data messages, relative to the last sent point
+    compress: bool = False
+    keyframe_interval: int = 60
+    last_sent: Optional[DataPoint] = None
+    since_keyframe: int = 0
+
+    # Opt-in aggregation of several samples into one point
+    aggregate: Optional[str] = None
+    aggregate_samples: int = 1
+    window: List[DataPoint]
+
     @classmethod
     def ensure_samplers(cls) -> None:
         if cls.samplers_cache is None:
@@ -50,6 +145,19 @@ class InternalMetricsChannel(AsyncChannel):
 
         self.interval = interval
 
+        self.compress = get_bool(options, 'compress', False)
+
+        self.aggregate = get_str_or_none(options, 'aggregate', None)
+        if self.aggregate not in (None, 'min', 'max', 'avg'):
+            raise ChannelError('protocol-error', message=f'invalid "aggregate" value: {self.aggregate}')
+
+        aggregate_samples = get_int(options, 'aggregate-samples', 1)
+        if aggregate_samples <= 0 or interval * aggregate_samples > sys.maxsize:
+            raise ChannelError('protocol-error',
+                               message=f'invalid "aggregate-samples" value: {aggregate_samples}')
+
+        self.aggregate_samples = aggregate_samples if self.aggregate is not None else 1
+
         metrics = options.get('metrics')
         if not isinstance(metrics, list) or len(metrics) == 0:
             logger.error('invalid "metrics" value: %s', metrics)
@@ -75,7 +183,7 @@ class InternalMetricsChannel(AsyncChannel):
             sampler_classes.add(sampler)
             self.metrics.append(MetricInfo(derive=derive, desc=desc))
 
-        self.samplers = {cls() for cls in sampler_classes}
+        self.sampler_classes = sampler_classes
 
     def send_meta(self, samples: Samples, timestamp: float) -> None:
         metrics: JsonList = []
@@ -96,15 +204,11 @@ class InternalMetricsChannel(AsyncChannel):
                 })
 
         now = int(time.time()) * 1000
-        self.send_json(source='internal', interval=self.interval, timestamp=timestamp * 1000,
-                       now=now, metrics=metrics)
+        self.send_json(source='internal', interval=self.interval * self.aggregate_samples,
+                       timestamp=timestamp * 1000, now=now, metrics=metrics)
         self.need_meta = False
-
-    def sample(self) -> Samples:
-        samples: Samples = defaultdict(dict)
-        for sampler in self.samplers:
-            sampler.sample(samples)
-        return samples
+        # The client starts over after a meta message, send the next point in full
+        self.last_sent = None
 
     def calculate_sample_rate(self, value: float, old_value: Optional[float]) -> Union[float, bool]:
         if old_value is not None:
@@ -112,10 +216,62 @@ class InternalMetricsChannel(AsyncChannel):
         else:
             return False
 
+    def aggregate_values(self, values: List[Value]) -> Value:
+        numbers = [v for v in values if type(v) in (int, float)]
+        if not numbers:
+            return values[-1]
+        elif self.aggregate == 'min':
+            return min(numbers)
+        elif self.aggregate == 'max':
+            return max(numbers)
+        else:
+            return sum(numbers) / len(numbers)
+
+    def aggregate_window(self) -> DataPoint:
+        # All points in the window have the same instances, see send_updates()
+        result: DataPoint = []
+        for i, value in enumerate(self.window[-1]):
+            column = [point[i] for point in self.window]
+            if isinstance(value, list):
+                rows = cast(List[List[Value]], column)
+                result.append([self.aggregate_values([row[j] for row in rows]) for j in range(len(value))])
+            else:
+                result.append(self.aggregate_values(cast(List[Value], column)))
+        self.window = []
+        return result
+
+    def compress_point(self, data: DataPoint) -> JsonList:
+        # null means "unchanged" on the wire, so unavailable values are sent as false
+        if self.last_sent is None or self.since_keyframe >= self.keyframe_interval:
+            self.since_keyframe = 0
+            return [[False if v is None else v for v in value] if isinstance(value, list)
+                    else False if value is None else value
+                    for value in data]
+
+        self.since_keyframe += 1
+        result: JsonList = []
+        for value, last in zip(data, self.last_sent):
+            if isinstance(value, list):
+                assert isinstance(last, list)
+                instances: JsonList = [None if same_value(v, old) else False if v is None else v
+                                       for v, old in zip(value, last)]
+                while instances and instances[-1] is None:
+                    instances.pop()
+                result.append(instances)
+            elif same_value(value, last):
+                result.append(None)
+            else:
+                result.append(False if value is None else value)
+
+        while result and result[-1] is None:
+            result.pop()
+        return result
+
     def send_updates(self, samples: Samples, last_samples: Samples) -> None:
-        data: List[Union[float, List[Optional[Union[float, bool]]]]] = []
+        data: DataPoint = []
         timestamp = time.time()
         self.next_timestamp = timestamp
+        instances_changed = False
 
         for metricinfo in self.metrics:
             value = samples[metricinfo.desc.name]
@@ -128,9 +284,10 @@ class InternalMetricsChannel(AsyncChannel):
                 # If we have less or more keys the data changed, send a meta message.
                 if value.keys() != old_value.keys():
                     self.need_meta = True
+                    instances_changed = True
 
                 if metricinfo.derive == 'rate':
-                    instances: List[Optional[Union[float, bool]]] = []
+                    instances: List[Value] = []
                     for key, val in value.items():
                         instances.append(self.calculate_sample_rate(val, old_value.get(key)))
 
@@ -147,24 +304,52 @@ class InternalMetricsChannel(AsyncChannel):
                 else:
                     data.append(value)
 
+        self.last_timestamp = self.next_timestamp
+
+        if self.aggregate is not None:
+            # Only points with the same instances can be aggregated, start over when they change
+            if instances_changed:
+                self.window = []
+            self.window.append(data)
+            if len(self.window) < self.aggregate_samples:
+                return
+            data = self.aggregate_window()
+
         if self.need_meta:
             self.send_meta(samples, timestamp)
 
-        self.last_timestamp = self.next_timestamp
-        self.send_text(json.dumps([data]))
+        if self.compress:
+            self.send_text(json.dumps([self.compress_point(data)]))
+            self.last_sent = data
+        else:
+            self.send_text(json.dumps([data]))
 
     async def run(self, options: JsonObject) -> None:
         self.metrics = []
-        self.samplers = set()
+        self.sampler_classes = set()
+        self.window = []
 
         InternalMetricsChannel.ensure_samplers()
 
         self.parse_options(options)
         self.ready()
 
-        last_samples: Samples = defaultdict(dict)
-        while True:
-            samples = self.sample()
-            self.send_updates(samples, last_samples)
-            last_samples = samples
-            await asyncio.sleep(self.interval / 1000)
+        queue: 'asyncio.Queue[Samples | Exception]' = asyncio.Queue()
+        schedule = SampleSchedule.subscribe(self.interval, self.sampler_classes, queue)
+        try:
+            last_samples: Samples = defaultdict(dict)
+            samples = schedule.sample(self.sampler_classes)
+            while True:
+                self.send_updates(samples, last_samples)
+                last_samples = samples
+
+                while True:
+                    update = await queue.get()
+                    if isinstance(update, Exception):
+                        raise update
+                    # We joined the schedule just before this tick, wait for the next one
+                    if time.time() - self.last_timestamp >= self.interval / 2000:
+                        break
+                samples = update
+        finally:
+            schedule.unsubscribe(queue)
@@ -3,13 +3,15 @@
 # SPDX-License-Identifier: GPL-3.0-or-later
 
 
+import io
 import logging
-from typing import Optional
+import secrets
+from typing import BinaryIO, List, Optional, Tuple
 
-from ..channel import AsyncChannel
+from ..channel import AsyncChannel, Channel
 from ..data import read_cockpit_data_file
 from ..jsonutil import JsonObject, get_dict, get_str
-from ..packages import Packages
+from ..packages import Packages, parse_byte_ranges
 
 logger = logging.getLogger(__name__)
 
@@ -28,6 +30,43 @@ class PackagesChannel(AsyncChannel):
         self.done()
         self.close()
 
+    async def send_ranges(self, data: BinaryIO, length: int, ranges: 'List[Tuple[int, int]]',
+                          headers: JsonObject) -> None:
+        with data:
+            if not ranges:
+                self.send_json(status=416, reason='Range Not Satisfiable',
+                               headers={**headers, 'Content-Range': f'bytes */{length}'})
+                self.done()
+                return
+
+            boundary = None
+            if len(ranges) == 1:
+                start, end = ranges[0]
+                headers = {**headers, 'Content-Range': f'bytes {start}-{end}/{length}'}
+            else:
+                boundary = secrets.token_hex(8)
+                part_type = headers['Content-Type']
+                headers = {**headers, 'Content-Type': f'multipart/byteranges; boundary={boundary}'}
+            self.send_json(status=206, reason='Partial Content', headers=headers)
+
+            for start, end in ranges:
+                if boundary is not None:
+                    await self.write(f'\r\n--{boundary}\r\nContent-Type: {part_type}\r\n'
+                                     f'Content-Range: bytes {start}-{end}/{length}\r\n\r\n'.encode())
+                data.seek(start)
+                remaining = end - start + 1
+                while remaining > 0:
+                    block = await self.in_thread(data.read, min(remaining, Channel.BLOCK_SIZE))
+                    if block == b'':
+                        break
+                    await self.write(block)
+                    remaining -= len(block)
+
+            if boundary is not None:
+                await self.write(f'\r\n--{boundary}--\r\n'.encode())
+
+            self.done()
+
     async def run(self, options: JsonObject) -> None:
         packages: Packages = self.router.packages  # type: ignore[attr-defined]  # yes, this is evil
 
@@ -75,6 +114,17 @@ class PackagesChannel(AsyncChannel):
 
                 out_headers['Content-Security-Policy'] = policy
 
+            # Byte ranges refer to the data as stored, so skip them for compressed documents
+            ranges = None
+            length = 0
+            if document.content_encoding is None:
+                out_headers['Accept-Ranges'] = 'bytes'
+                range_header = headers.get('Range')
+                if isinstance(range_header, str):
+                    length = document.data.seek(0, io.SEEK_END)
+                    document.data.seek(0)
+                    ranges = parse_byte_ranges(range_header, length)
+
         except ValueError as exc:
             self.http_error(400, str(exc))
 
@@ -85,5 +135,8 @@ class PackagesChannel(AsyncChannel):
             self.http_error(500, f'Internal error: {exc!s}')
 
         else:
-            self.send_json(status=200, reason='OK', headers=out_headers)
-            await self.sendfile(document.data)
+            if ranges is not None:
+                await self.send_ranges(document.data, length, ranges, out_headers)
+            else:
+                self.send_json(status=200, reason='OK', headers=out_headers)
+                await self.sendfile(document.data)
@@ -105,6 +105,48 @@ def parse_accept_language(accept_language: str) -> Sequence[str]:
     return tuple(results)
 
 
+MAX_BYTE_RANGES = 16
+
+
+def parse_byte_ranges(header: str, length: int) -> 'Optional[List[Tuple[int, int]]]':
+    """Parse the Range header for a body of the given length.
+
+    Returns None if the header should be ignored, otherwise the list of
+    satisfiable (start, end) ranges, with inclusive ends.  The list is empty
+    if none of the ranges can be satisfied.
+
+    https://datatracker.ietf.org/doc/html/rfc9110#section-14.2
+    """
+
+    unit, _, specs = header.partition('=')
+    if unit.strip().lower() != 'bytes':
+        return None
+
+    entries = specs.split(',')
+    if len(entries) > MAX_BYTE_RANGES:
+        return None
+
+    ranges = []
+    for entry in entries:
+        first, dash, last = entry.strip().partition('-')
+        if not dash or not (first or last) or not (first + last).isdigit():
+            return None
+
+        if not first:
+            # suffix range: the last N bytes
+            if int(last) == 0 or length == 0:
+                continue
+            ranges.append((max(length - int(last), 0), length - 1))
+        else:
+            if last and int(last) < int(first):
+                return None
+            if int(first) >= length:
+                continue
+            ranges.append((int(first), min(int(last), length - 1) if last else length - 1))
+
+    return ranges
+
+
 def sortify_version(version: str) -> str:
     """Convert a version string to a form that can be compared"""
     # 0-pad each numeric component.  Only supports numeric versions like 1.2.3.
@@ -8,7 +8,18 @@ import json
 import logging
 import traceback
 
-from .jsonutil import JsonError, JsonObject, JsonValue, create_object, get_int, get_str, get_str_or_none, typechecked
+from .jsonutil import (
+    JsonError,
+    JsonObject,
+    JsonValue,
+    create_object,
+    get_bool,
+    get_dict,
+    get_int,
+    get_str,
+    get_str_or_none,
+    typechecked,
+)
 
 logger = logging.getLogger(__name__)
 
@@ -54,6 +65,8 @@ class CockpitProtocol(asyncio.Protocol):
     """
     transport: 'asyncio.Transport | None' = None
     buffer = b''
+    # Whether we send binary frames.  We accept both kinds on input.
+    binary_framing: bool = False
     _closed: bool = False
     _communication_done: 'asyncio.Future[None] | None' = None
 
@@ -106,20 +119,33 @@ class CockpitProtocol(asyncio.Protocol):
         work can be done because of a given number of bytes missing.
         """
 
-        try:
-            newline = data.index(b'\n')
-        except ValueError as exc:
-            if len(data) < 10:
-                # Let's try reading more
-                return len(data) - 10
-            raise CockpitProtocolError("size line is too long") from exc
+        if data[:1] == b'\0':
+            # Binary framing: a zero byte, then a 32-bit big endian length
+            if len(data) < 5:
+                return len(data) - 5
 
-        try:
-            length = int(data[:newline])
-        except ValueError as exc:
-            raise CockpitProtocolError("frame size is not an integer") from exc
+            length = int.from_bytes(data[1:5], 'big')
+            if length == 0:
+                raise CockpitProtocolError("frame size is zero")
+
+            start = 5
+
+        else:
+            try:
+                newline = data.index(b'\n')
+            except ValueError as exc:
+                if len(data) < 10:
+                    # Let's try reading more
+                    return len(data) - 10
+                raise CockpitProtocolError("size line is too long") from exc
+
+            try:
+                length = int(data[:newline])
+            except ValueError as exc:
+                raise CockpitProtocolError("frame size is not an integer") from exc
+
+            start = newline + 1
 
-        start = newline + 1
         end = start + length
 
         if end > len(data):
@@ -160,7 +186,10 @@ class CockpitProtocol(asyncio.Protocol):
         """Send a given payload (bytes) on channel (string)"""
         # Channel is certainly ascii (as enforced by .encode() below)
         frame_length = len(channel + '\n') + len(payload)
-        header = f'{frame_length}\n{channel}\n'.encode('ascii')
+        if self.binary_framing:
+            header = b'\0' + frame_length.to_bytes(4, 'big') + f'{channel}\n'.encode('ascii')
+        else:
+            header = f'{frame_length}\n{channel}\n'.encode('ascii')
         if self.transport is not None:
             logger.debug('writing to transport %s', self.transport)
             self.transport.write(header + payload)
@@ -208,6 +237,9 @@ class CockpitProtocolServer(CockpitProtocol):
             if get_int(message, 'version') != 1:
                 raise CockpitProtocolError('incorrect version number')
             self.init_host = get_str(message, 'host')
+            # cockpit-ws only says this if we offered it in our own init
+            capabilities = get_dict(message, 'capabilities', {})
+            self.binary_framing = get_bool(capabilities, 'binary-framing', False)
             self.do_init(message)
         elif command == 'kill':
             self.do_kill(get_str_or_none(message, 'host', None), get_str_or_none(message, 'group', None), message)
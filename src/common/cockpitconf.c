@@ -39,6 +39,9 @@ typedef struct Entry {
 static bool cockpit_conf_loaded = false;
 static Entry *cockpit_conf = NULL;
 
+static bool cockpit_conf_snapshotted = false;
+static CockpitConfSnapshot cockpit_conf_snap;
+
 const char *cockpit_config_file = "cockpit.conf";
 
 /*
@@ -268,6 +271,22 @@ cockpit_conf_cleanup (void)
 
   cockpit_conf = NULL;
   cockpit_conf_loaded = false;
+
+  /* The snapshot points into the entries */
+  memset (&cockpit_conf_snap, 0, sizeof (cockpit_conf_snap));
+  cockpit_conf_snapshotted = false;
+}
+
+/*
+ * Reads the configuration files again, for example on SIGHUP. Any
+ * strings previously returned, including those in the snapshot, are
+ * no longer valid afterwards.
+ */
+void
+cockpit_conf_reload (void)
+{
+  cockpit_conf_cleanup ();
+  cockpit_conf_init ();
 }
 
 const char * const *
@@ -374,3 +393,44 @@ cockpit_conf_uint (const char *section,
 
   return val;
 }
+
+/*
+ * The settings looked up while serving requests. This avoids searching
+ * the entries and parsing their values every time. The snapshot stays
+ * valid until cockpit_conf_cleanup() or cockpit_conf_reload().
+ */
+const CockpitConfSnapshot *
+cockpit_conf_snapshot (void)
+{
+  CockpitConfSnapshot *snap = &cockpit_conf_snap;
+
+  if (cockpit_conf_snapshotted)
+    return snap;
+
+  snap->origins = cockpit_conf_strv ("WebService", "Origins", ' ');
+  snap->shell = cockpit_conf_string ("WebService", "Shell");
+  snap->login_title = cockpit_conf_string ("WebService", "LoginTitle");
+  snap->allow_multihost = cockpit_conf_bool ("WebService", "AllowMultiHost", ALLOW_MULTIHOST_DEFAULT);
+  snap->require_host = cockpit_conf_bool ("WebService", "RequireHost", false);
+  snap->for_cockpit_client = cockpit_conf_bool ("WebService", "X-For-CockpitClient", false);
+  snap->websocket_compression = cockpit_conf_bool ("WebService", "WebSocketCompression", false);
+  snap->websocket_compression_window_bits = cockpit_conf_uint ("WebService", "WebSocketCompressionWindowBits",
+                                                               15, 15, 9);
+  snap->websocket_compression_context_takeover = cockpit_conf_bool ("WebService",
+                                                                    "WebSocketCompressionContextTakeover",
+                                                                    true);
+  /* Bounds for the measured channel flow control window, at least one ping apart */
+  snap->flow_window_min = cockpit_conf_uint ("WebService", "FlowWindowMin", 256 * 1024, INT32_MAX, 16 * 1024);
+  snap->flow_window_max = cockpit_conf_uint ("WebService", "FlowWindowMax", 16 * 1024 * 1024, INT32_MAX, 16 * 1024);
+  if (snap->flow_window_max < snap->flow_window_min)
+    snap->flow_window_max = snap->flow_window_min;
+
+  snap->banner = cockpit_conf_string ("Session", "Banner");
+
+  snap->oauth_url = cockpit_conf_string ("OAuth", "URL");
+  snap->oauth_error_param = cockpit_conf_string ("OAuth", "ErrorParam");
+  snap->oauth_token_param = cockpit_conf_string ("OAuth", "TokenParam");
+
+  cockpit_conf_snapshotted = true;
+  return snap;
+}
@@ -32,6 +32,35 @@ unsigned       cockpit_conf_uint             (const char *section,
 
 const char * const * cockpit_conf_get_dirs   (void);
 
+/* Settings read while serving requests, parsed once per load */
+typedef struct {
+  /* [WebService] */
+  const char * const *origins;
+  const char *shell;
+  const char *login_title;
+  bool allow_multihost;
+  bool require_host;
+  bool for_cockpit_client;
+  bool websocket_compression;
+  unsigned websocket_compression_window_bits;
+  bool websocket_compression_context_takeover;
+  unsigned flow_window_min;
+  unsigned flow_window_max;
+
+  /* [Session] */
+  const char *banner;
+
+  /* [OAuth] */
+  const char *oauth_url;
+  const char *oauth_error_param;
+  const char *oauth_token_param;
+} CockpitConfSnapshot;
+
+const CockpitConfSnapshot *
+               cockpit_conf_snapshot         (void);
+
+void           cockpit_conf_reload           (void);
+
 void           cockpit_conf_cleanup          (void);
 
 void           cockpit_conf_init             (void);
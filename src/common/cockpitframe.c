@@ -10,12 +10,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/uio.h>
+
 #define MAX_FRAME_SIZE_BYTES 8
+#define MAX_FRAME_SIZE 99999999
 
 /**
  * cockpit_frame_parse:
@@ -27,6 +31,10 @@
  * of the @input buffer. These are used by Cockpit transport framing
  * over a stream based protocol.
  *
+ * Both the text framing and the binary framing are accepted. A binary
+ * frame starts with a zero byte, which can never start a text frame,
+ * followed by the length as a 32-bit big endian integer.
+ *
  * Returns: The length, zero if more data is needed, or -1 if an error.
  */
 ssize_t
@@ -39,6 +47,21 @@ cockpit_frame_parse (unsigned char *input,
 
   assert (input != NULL || length == 0);
 
+  if (length > 0 && input[0] == COCKPIT_FRAME_BINARY_MARKER)
+    {
+      if (length < COCKPIT_FRAME_BINARY_HEADER)
+        return 0;
+
+      size = ((size_t)input[1] << 24) | ((size_t)input[2] << 16) |
+             ((size_t)input[3] << 8) | (size_t)input[4];
+      if (size == 0 || size > MAX_FRAME_SIZE)
+        return -1;
+
+      if (consumed)
+        *consumed = COCKPIT_FRAME_BINARY_HEADER;
+      return size;
+    }
+
   size = 0;
   for (i = 0; i < length; i++)
     {
@@ -95,35 +118,94 @@ cockpit_fd_write_all (int fd,
   return written;
 }
 
+/**
+ * cockpit_frame_header:
+ * @header: a buffer of at least %COCKPIT_FRAME_HEADER_MAX bytes
+ * @length: the length of the frame
+ * @binary: whether to use binary framing
+ *
+ * Formats the length prefix for a frame of @length bytes into @header.
+ * Only use @binary framing once the other side has agreed to it.
+ *
+ * Returns: The number of bytes written to @header.
+ */
+size_t
+cockpit_frame_header (unsigned char *header,
+                      size_t length,
+                      bool binary)
+{
+  size_t i, n;
+
+  assert (length > 0);
+
+  if (binary)
+    {
+      assert (length <= UINT32_MAX);
+      header[0] = COCKPIT_FRAME_BINARY_MARKER;
+      header[1] = (length >> 24) & 0xff;
+      header[2] = (length >> 16) & 0xff;
+      header[3] = (length >> 8) & 0xff;
+      header[4] = length & 0xff;
+      return COCKPIT_FRAME_BINARY_HEADER;
+    }
+
+  /* Digits come out backwards, so reverse them afterwards */
+  for (n = 0; length > 0; length /= 10)
+    header[n++] = '0' + (length % 10);
+  for (i = 0; i < n / 2; i++)
+    {
+      unsigned char c = header[i];
+      header[i] = header[n - i - 1];
+      header[n - i - 1] = c;
+    }
+  header[n++] = '\n';
+  return n;
+}
+
 ssize_t
 cockpit_frame_write (int fd,
                      unsigned char *input,
                      size_t length)
 {
-  char *prefix = NULL;
-  ssize_t ret = -1;
-  int errn = 0;
+  unsigned char prefix[COCKPIT_FRAME_HEADER_MAX];
+  struct iovec iov[2];
+  struct iovec *vec = iov;
+  int count = 2;
+  ssize_t res;
 
   assert (length > 0);
   assert (input != NULL);
 
-  if (asprintf (&prefix, "%u\n", (unsigned int)length) < 0)
+  /* Prefix and payload go out together, in a single write when possible */
+  iov[0].iov_base = prefix;
+  iov[0].iov_len = cockpit_frame_header (prefix, length, false);
+  iov[1].iov_base = input;
+  iov[1].iov_len = length;
+
+  while (count > 0)
     {
-      errn = ENOMEM;
-      goto out;
+      res = writev (fd, vec, count);
+      if (res < 0)
+        {
+          if (errno != EAGAIN && errno != EINTR)
+            return -1;
+          continue;
+        }
+
+      while (count > 0 && (size_t)res >= vec->iov_len)
+        {
+          res -= vec->iov_len;
+          vec++;
+          count--;
+        }
+      if (count > 0)
+        {
+          vec->iov_base = (unsigned char *)vec->iov_base + res;
+          vec->iov_len -= res;
+        }
     }
 
-  ret = cockpit_fd_write_all (fd, (unsigned char *)prefix, strlen (prefix));
-  if (ret > 0)
-    ret = cockpit_fd_write_all (fd, input, length);
-  if (ret < 0)
-    errn = errno;
-
-out:
-  free (prefix);
-  if (ret < 0)
-    errno = errn;
-  return ret;
+  return length;
 }
 
 /* read_exactly:
@@ -247,12 +329,18 @@ cockpit_frame_read (int fd,
     {
       /* cockpit_frame_parse() asked to read more data.  As explained
        * above, it's safe to read the rest of the buffer now (6 bytes).
+       * A binary header is shorter than that, and its frame may be as
+       * small as a single byte, so only read the rest of its header.
        * This should always result in a defined (non-zero) result.
        */
-      if (!read_exactly (fd, headerbuf + n_read, sizeof headerbuf - n_read, NULL))
+      size_t n_header = sizeof headerbuf;
+      if (headerbuf[0] == COCKPIT_FRAME_BINARY_MARKER)
+        n_header = COCKPIT_FRAME_BINARY_HEADER;
+
+      if (!read_exactly (fd, headerbuf + n_read, n_header - n_read, NULL))
         return -1;
 
-      n_read = sizeof headerbuf;
+      n_read = n_header;
       size = cockpit_frame_parse (headerbuf, n_read, &n_consumed);
       assert (size != 0);
     }
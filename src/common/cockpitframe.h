@@ -6,12 +6,21 @@
 #ifndef __COCKPIT_FRAME_H__
 #define __COCKPIT_FRAME_H__
 
+#include <stdbool.h>
 #include <sys/types.h>
 
+#define COCKPIT_FRAME_BINARY_MARKER   0x00
+#define COCKPIT_FRAME_BINARY_HEADER   5
+#define COCKPIT_FRAME_HEADER_MAX      21
+
 ssize_t            cockpit_frame_parse       (unsigned char *input,
                                               size_t length,
                                               size_t *consumed);
 
+size_t             cockpit_frame_header      (unsigned char *header,
+                                              size_t length,
+                                              bool binary);
+
 ssize_t            cockpit_frame_read        (int fd,
                                               unsigned char **output);
 
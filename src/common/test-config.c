@@ -116,6 +116,41 @@ test_get_strvs (void)
   cockpit_conf_cleanup ();
 }
 
+static void
+test_snapshot (void)
+{
+  const CockpitConfSnapshot *conf;
+
+  cockpit_config_file = SRCDIR "/src/common/mock-config/cockpit/cockpit.conf";
+
+  conf = cockpit_conf_snapshot ();
+  g_assert_cmpstr (conf->shell, ==, "/second/test.html");
+  g_assert_cmpstr (conf->origins[0], ==, "https://another-place.com");
+  g_assert_cmpstr (conf->origins[1], ==, "https://another-place.com:9090");
+  g_assert_null (conf->origins[2]);
+  g_assert_null (conf->login_title);
+  g_assert_cmpint (conf->allow_multihost, ==, ALLOW_MULTIHOST_DEFAULT);
+  g_assert_false (conf->websocket_compression);
+  g_assert_cmpuint (conf->websocket_compression_window_bits, ==, 15);
+  g_assert_true (conf->websocket_compression_context_takeover);
+  g_assert_cmpuint (conf->flow_window_min, ==, 256 * 1024);
+  g_assert_cmpuint (conf->flow_window_max, ==, 16 * 1024 * 1024);
+
+  /* Same values until reloaded */
+  g_assert_true (cockpit_conf_snapshot () == conf);
+  g_assert_true (cockpit_conf_strv ("WebService", "Origins", ' ') == conf->origins);
+
+  cockpit_config_file = SRCDIR "/src/common/mock-config/cockpit/cockpit-alt.conf";
+  g_assert_cmpstr (cockpit_conf_snapshot ()->shell, ==, "/second/test.html");
+
+  cockpit_conf_reload ();
+  conf = cockpit_conf_snapshot ();
+  g_assert_null (conf->shell);
+  g_assert_null (conf->origins);
+
+  cockpit_conf_cleanup ();
+}
+
 static void
 test_load_dir (void)
 {
@@ -154,6 +189,7 @@ main (int argc,
   g_test_add_func ("/conf/test-uint", test_get_uint);
   g_test_add_func ("/conf/test-strings", test_get_strings);
   g_test_add_func ("/conf/test-strvs", test_get_strvs);
+  g_test_add_func ("/conf/snapshot", test_snapshot);
   g_test_add_func ("/conf/fail_load", test_fail_load);
   g_test_add_func ("/conf/load_dir", test_load_dir);
   return g_test_run ();
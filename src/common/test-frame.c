@@ -119,6 +119,77 @@ test_valid (Fixture *pipe, const TestCase *tc)
     }
 }
 
+static void
+test_valid_binary (Fixture *pipe, const TestCase *tc)
+{
+  unsigned char header[COCKPIT_FRAME_HEADER_MAX];
+
+  for (gint i = 1; i < 1000; i++)
+    {
+      gsize n = cockpit_frame_header (header, i, TRUE);
+      g_assert_cmpuint (n, ==, COCKPIT_FRAME_BINARY_HEADER);
+      fwrite (header, 1, n, pipe->write_fp);
+      fprintf (pipe->write_fp, "%*sTHEEND", i, "");
+      fflush (pipe->write_fp);
+
+      g_autofree unsigned char *output = NULL;
+      ssize_t size = cockpit_frame_read (pipe->read_fd, &output);
+
+      g_assert_cmpint (size, ==, i);
+      for (gint j = 0; j < size; j++)
+        g_assert (output[j] == ' ');
+      g_assert (output[size] == '\0');
+
+      char buffer[7];
+      size = read (pipe->read_fd, buffer, sizeof buffer);
+      g_assert_cmpint (size, ==, 6);
+      g_assert (memcmp (buffer, "THEEND", 6) == 0);
+    }
+}
+
+static void
+test_header (void)
+{
+  unsigned char header[COCKPIT_FRAME_HEADER_MAX];
+  gsize lengths[] = { 1, 9, 10, 99, 100, 65536, 99999999 };
+
+  for (guint i = 0; i < G_N_ELEMENTS (lengths); i++)
+    {
+      g_autofree gchar *expected = g_strdup_printf ("%" G_GSIZE_FORMAT "\n", lengths[i]);
+      gsize n = cockpit_frame_header (header, lengths[i], FALSE);
+      g_assert_cmpmem (header, n, expected, strlen (expected));
+
+      size_t consumed = 0;
+      g_assert_cmpint (cockpit_frame_parse (header, n, &consumed), ==, lengths[i]);
+      g_assert_cmpuint (consumed, ==, n);
+
+      n = cockpit_frame_header (header, lengths[i], TRUE);
+      g_assert_cmpint (cockpit_frame_parse (header, n - 1, &consumed), ==, 0);
+      g_assert_cmpint (cockpit_frame_parse (header, n, &consumed), ==, lengths[i]);
+      g_assert_cmpuint (consumed, ==, COCKPIT_FRAME_BINARY_HEADER);
+    }
+}
+
+static void
+test_write (Fixture *pipe, const TestCase *tc)
+{
+  g_assert_cmpint (cockpit_frame_write (fileno (pipe->write_fp), (unsigned char *)"abc", 3), ==, 3);
+
+  char buffer[16];
+  ssize_t size = read (pipe->read_fd, buffer, sizeof buffer);
+  g_assert_cmpmem (buffer, size, "3\nabc", 5);
+}
+
+static void
+test_fail_binary (Fixture *pipe, const TestCase *tc)
+{
+  /* a binary header with a zero length, followed by some data */
+  static const unsigned char data[] = { 0, 0, 0, 0, 0, 'a', 'b', 'c' };
+
+  fwrite (data, 1, sizeof data, pipe->write_fp);
+  fflush (pipe->write_fp);
+}
+
 static void
 test_fail_badfd (Fixture *fixture, const TestCase *tc)
 {
@@ -157,6 +228,9 @@ main (int argc,
                                             (GTestFixtureFunc) fixture_teardown)
 
   PIPE_TEST("/frame/read-frame/valid", test_valid);
+  PIPE_TEST("/frame/read-frame/valid-binary", test_valid_binary);
+  PIPE_TEST("/frame/write-frame", test_write);
+  g_test_add_func ("/frame/header", test_header);
 
   PIPE_TEST("/frame/read-frame/fail/badfd", test_fail_badfd,
             .expect_errno=EBADF);
@@ -187,6 +261,8 @@ main (int argc,
             .input="03\nabc", .expect_errno=EBADMSG);
   PIPE_TEST("/frame/read-frame/fail/empty-header", nil,
             .input="\nabc", .expect_errno=EBADMSG);
+  PIPE_TEST("/frame/read-frame/fail/binary-empty", test_fail_binary,
+            .expect_errno=EBADMSG);
 
   return g_test_run ();
 }
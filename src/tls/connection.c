@@ -12,6 +12,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <poll.h>
@@ -20,16 +21,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+#include <gnutls/socket.h>
+#endif
 
 #include <common/cockpitfdpassing.h>
 #include <common/cockpitjsonprint.h>
@@ -42,6 +48,11 @@
 #include "socket-io.h"
 #include "utils.h"
 
+#ifndef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+/* GnuTLS < 3.7.3 has no kTLS support; Connection.ktls always stays 0 */
+enum { GNUTLS_KTLS_RECV = 1 << 0, GNUTLS_KTLS_SEND = 1 << 1 };
+#endif
+
 /* cockpit-tls TCP server state (singleton) */
 static struct {
   gnutls_certificate_request_t request_mode;
@@ -59,13 +70,40 @@ typedef struct
   char buffer[16u << 10]; /* 16KiB */
   unsigned start, end;
   bool eof, shut_rd, shut_wr;
+  bool tls_send_again;
+
+  /* When splicing, the data lives in a pipe instead of in buffer[], and
+   * start/end only count the bytes that went in and out of it.  The pipe
+   * takes one slot per skb, so it can fill up long before BUFFER_SIZE
+   * bytes are in it; pipe_full stops reading until some of it drained.
+   */
+  bool splicing;
+  bool pipe_full;
+  int pipe[2];
 #ifdef DEBUG
   const char *name;
 #endif
 } Buffer;
 
-/* a single TCP connection between the client (browser) and cockpit-tls */
+typedef struct _Connection Connection;
+typedef struct _Worker Worker;
+
+/* an fd of a Connection which is registered in the epoll set of a Worker */
 typedef struct {
+  Connection *connection;
+  uint32_t events;
+} Watch;
+
+typedef enum {
+  CONNECTION_PEEK,        /* waiting for the first byte from the client */
+  CONNECTION_HANDSHAKE,   /* TLS handshake in progress */
+  CONNECTION_ACTIVATE,    /* waiting for https-factory to start our wsinstance */
+  CONNECTION_PROXY,       /* shoveling data between client and wsinstance */
+  CONNECTION_CLOSED,      /* waiting to be freed at the end of the event batch */
+} ConnectionState;
+
+/* a single TCP connection between the client (browser) and cockpit-tls */
+struct _Connection {
   int client_fd;
   int ws_fd;
 
@@ -77,7 +115,68 @@ typedef struct {
   char *client_cert_filename;
   char *wsinstance;
   int metadata_fd;
-} Connection;
+
+  /* gnutls_transport_ktls_enable_flags_t: directions handled by the kernel */
+  unsigned ktls;
+
+  /* only used in worker mode */
+  Worker *worker;
+  Connection *prev, *next;
+  ConnectionState state;
+  uint64_t deadline;
+  int factory_fd;
+  Watch client_watch;
+  Watch ws_watch;
+  Watch factory_watch;
+};
+
+/* event-driven mode: a fixed set of threads, each multiplexing many connections */
+struct _Worker {
+  pthread_t thread;
+  int epollfd;
+  int wakeup_fd;
+
+  /* protected by mutex */
+  pthread_mutex_t mutex;
+  int *new_fds;
+  size_t n_new_fds;
+  bool quit;
+
+  /* only used from the worker thread */
+  Connection *pending;    /* not yet proxying; subject to a deadline */
+  Connection *proxying;
+  Connection *closed;
+};
+
+static struct {
+  Worker *workers;
+  unsigned n_workers;
+  unsigned next_worker;
+  void (* closed_callback) (void);
+} workers;
+
+/* Session tickets let returning clients (like the many parallel
+ * connections of one browser) skip the asymmetric crypto of a full
+ * handshake.  All connections share one ticket encryption key, which
+ * is replaced periodically; GnuTLS additionally rotates the keys it
+ * derives from it.
+ */
+static struct {
+  pthread_mutex_t mutex;
+  gnutls_datum_t key;
+  uint64_t key_created;
+  unsigned full_handshakes;
+  unsigned resumed_handshakes;
+} session_tickets = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define TICKET_KEY_LIFETIME_MS (24 * 60 * 60 * 1000ull)
+
+/* wait this long for the first byte, and for the TLS handshake */
+#define SETUP_TIMEOUT_MS 30000
+/* wait this long for the https-factory to start a wsinstance */
+#define ACTIVATION_TIMEOUT_MS 30000
 
 #define BUFFER_SIZE (sizeof ((Buffer *) 0)->buffer)
 #define BUFFER_MASK (BUFFER_SIZE - 1)
@@ -86,6 +185,27 @@ static_assert (!(BUFFER_SIZE & BUFFER_MASK), "buffer size not a power of 2");
 static_assert ((typeof (((Buffer *) 0)->start)) BUFFER_SIZE, "buffer is too big");
 
 
+static uint64_t
+now_msec (void)
+{
+  struct timespec now;
+  int r;
+
+  r = clock_gettime (CLOCK_MONOTONIC, &now);
+  assert (r == 0);
+
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+set_nonblocking (int fd)
+{
+  int flags = fcntl (fd, F_GETFL);
+
+  if (flags == -1 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    err (EXIT_FAILURE, "fcntl() failed");
+}
+
 static inline bool
 buffer_full (Buffer *self)
 {
@@ -101,7 +221,7 @@ buffer_empty (Buffer *self)
 static inline bool
 buffer_can_read (Buffer *self)
 {
-  return !self->shut_rd && !buffer_full (self);
+  return !self->shut_rd && !buffer_full (self) && !self->pipe_full;
 }
 
 static inline bool
@@ -301,12 +421,21 @@ buffer_write_to_tls (Buffer           *self,
 
   if (get_iovecs (&iov, 1, self->buffer, self->start, self->end))
     {
+      /* After GNUTLS_E_AGAIN (only possible on non-blocking sockets),
+       * gnutls wants to be called again with the same parameters, or
+       * with NULL/0, which flushes the data it already has.
+       */
       do
-        s = gnutls_record_send (tls, iov.iov_base, iov.iov_len);
+        if (self->tls_send_again)
+          s = gnutls_record_send (tls, NULL, 0);
+        else
+          s = gnutls_record_send (tls, iov.iov_base, iov.iov_len);
       while (s == GNUTLS_E_INTERRUPTED);
 
       debug (BUFFER, "  gnutls_record_send returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
 
+      self->tls_send_again = (s == GNUTLS_E_AGAIN);
+
       if (s < 0)
         {
           if (s != GNUTLS_E_AGAIN)
@@ -365,52 +494,220 @@ buffer_read_from_tls (Buffer           *self,
 }
 
 static bool
-request_dynamic_wsinstance (const char *fingerprint)
+buffer_start_splicing (Buffer *self)
 {
-  bool status = false;
-  char reply[20];
+  assert (buffer_empty (self));
+  assert (!self->splicing);
+
+  if (pipe2 (self->pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      warn ("pipe2() failed, not splicing");
+      return false;
+    }
+
+  debug (BUFFER, "buffer_start_splicing (%s)", self->name);
+
+  self->splicing = true;
+  return true;
+}
+
+static void
+buffer_stop_splicing (Buffer *self)
+{
+  if (self->splicing)
+    {
+      close (self->pipe[0]);
+      close (self->pipe[1]);
+      self->splicing = false;
+      self->pipe_full = false;
+    }
+}
+
+/* kTLS refuses to splice() records other than application data */
+static void
+buffer_read_tls_control (Buffer           *self,
+                         gnutls_session_t  tls)
+{
+  char data[BUFFER_SIZE];
+  ssize_t s;
+
+  do
+    s = gnutls_record_recv (tls, data, BUFFER_SIZE - (self->end - self->start));
+  while (s == GNUTLS_E_INTERRUPTED);
+
+  debug (BUFFER, "  gnutls_record_recv (control) returns %zi %s", s, (s < 0) ? gnutls_strerror (-s) : "");
+
+  if (s <= 0)
+    {
+      if (s != GNUTLS_E_AGAIN)
+        buffer_epipe (self);
+    }
+  else if (write (self->pipe[1], data, s) == s) /* there's always room for that */
+    self->end += s;
+  else
+    buffer_epipe (self);
+}
+
+static void
+buffer_splice_from_fd (Buffer           *self,
+                       int               fd,
+                       gnutls_session_t  tls)
+{
+  ssize_t s;
+
+  debug (BUFFER, "buffer_splice_from_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  if (buffer_needs_shut_rd (self))
+    {
+      shutdown (fd, SHUT_RD);
+      buffer_shut_rd (self);
+      return;
+    }
+
+  do
+    s = splice (fd, NULL, self->pipe[1], NULL, BUFFER_SIZE - (self->end - self->start),
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  while (s == -1 && errno == EINTR);
+
+  debug (BUFFER, "  splice returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+  if (s == -1)
+    {
+      if (errno == EINVAL && tls)
+        buffer_read_tls_control (self, tls);
+      else if (errno != EAGAIN)
+        buffer_eof (self);
+      else if (!buffer_empty (self))
+        /* We only get here for a readable socket, so with data in the pipe
+         * this means that it's full.  If the socket was empty after all,
+         * we'll just poll for it again once the writer made progress.
+         */
+        self->pipe_full = true;
+    }
+  else if (s == 0)
+    buffer_eof (self);
+  else
+    self->end += s;
+
+  assert (buffer_valid (self));
+}
+
+static void
+buffer_splice_to_fd (Buffer           *self,
+                     int               fd,
+                     gnutls_session_t  tls)
+{
+  ssize_t s;
+
+  debug (BUFFER, "buffer_splice_to_fd (%s/0x%x/0x%x, %i)", self->name, self->start, self->end, fd);
+
+  if (!buffer_empty (self))
+    {
+      do
+        s = splice (self->pipe[0], NULL, fd, NULL, self->end - self->start,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      while (s == -1 && errno == EINTR);
+
+      debug (BUFFER, "  splice returns %zi %s", s, (s == -1) ? strerror (errno) : "");
+
+      if (s == -1)
+        {
+          if (errno != EAGAIN)
+            buffer_epipe (self);
+        }
+      else
+        {
+          self->start += s;
+          self->pipe_full = false;
+        }
+    }
+
+  if (buffer_needs_shut_wr (self))
+    {
+      /* with kTLS, gnutls sends the close_notify alert through the kernel */
+      if (tls)
+        gnutls_bye (tls, GNUTLS_SHUT_WR);
+      else
+        shutdown (fd, SHUT_WR);
+      buffer_shut_wr (self);
+    }
+
+  assert (buffer_valid (self));
+}
 
+/* returns a socket to https-factory, after having sent the fingerprint, or -1 */
+static int
+request_dynamic_wsinstance_start (const char *fingerprint)
+{
   debug (CONNECTION, "requesting dynamic wsinstance for %s:\n", fingerprint);
 
   int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (fd == -1)
     {
       warn ("socket() failed");
-      goto out;
+      return -1;
     }
 
   debug (CONNECTION, "  -> connecting to https-factory.sock");
   if (af_unix_connectat (fd, parameters.wsinstance_sockdir, "https-factory.sock") != 0)
     {
       warn ("connect(https-factory.sock) failed");
-      goto out;
+      close (fd);
+      return -1;
     }
 
   /* send the fingerprint */
   debug (CONNECTION, "  -> success; sending fingerprint...");
   if (!send_all (fd, fingerprint, strlen (fingerprint), 5 * 1000000))
-    goto out;
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* consumes fd */
+static bool
+request_dynamic_wsinstance_finish (int fd,
+                                   int timeout)
+{
+  bool status = false;
+  char reply[20];
 
   debug (CONNECTION, "  -> success; waiting for reply...");
 
   /* wait for the systemd job status reply */
-  if (!recv_alnum (fd, reply, sizeof reply, 30 * 1000000))
-    goto out;
-
-  debug (CONNECTION, "  -> got reply '%s'...", reply);
-  status = strcmp (reply, "done") == 0;
+  if (recv_alnum (fd, reply, sizeof reply, timeout))
+    {
+      debug (CONNECTION, "  -> got reply '%s'...", reply);
+      status = strcmp (reply, "done") == 0;
+    }
 
-out:
   debug (CONNECTION, "  -> %s.", status ? "success" : "fail");
 
-  if (fd != -1)
-    close (fd);
+  close (fd);
 
   return status;
 }
 
 static bool
-connection_connect_to_dynamic_wsinstance (Connection *self)
+request_dynamic_wsinstance (const char *fingerprint)
+{
+  int fd = request_dynamic_wsinstance_start (fingerprint);
+
+  if (fd == -1)
+    {
+      debug (CONNECTION, "  -> fail.");
+      return false;
+    }
+
+  return request_dynamic_wsinstance_finish (fd, 30 * 1000000);
+}
+
+static bool
+connection_connect_to_dynamic_wsinstance_socket (Connection *self,
+                                                 bool        first_attempt)
 {
   char sockname[80];
   int r;
@@ -422,13 +719,27 @@ connection_connect_to_dynamic_wsinstance (Connection *self)
 
   debug (CONNECTION, "Connecting to dynamic https instance %s...", sockname);
 
-  /* fast path: the socket already exists, so we can just connect to it */
   if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) == 0)
-    return true;
+    {
+      debug (CONNECTION, "  -> success!");
+      return true;
+    }
 
-  if (errno != ENOENT && errno != ECONNREFUSED)
+  if (!first_attempt)
+    warn ("connect(%s) failed on the second attempt", sockname);
+  else if (errno != ENOENT && errno != ECONNREFUSED)
     warn ("connect(%s) failed on the first attempt", sockname);
 
+  return false;
+}
+
+static bool
+connection_connect_to_dynamic_wsinstance (Connection *self)
+{
+  /* fast path: the socket already exists, so we can just connect to it */
+  if (connection_connect_to_dynamic_wsinstance_socket (self, true))
+    return true;
+
   debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
   /* otherwise, ask for the instance to be started */
   if (!request_dynamic_wsinstance (self->wsinstance))
@@ -436,15 +747,7 @@ connection_connect_to_dynamic_wsinstance (Connection *self)
 
   /* ... and try one more time. */
   debug (CONNECTION, "  -> trying again");
-  if (af_unix_connectat (self->ws_fd, parameters.wsinstance_sockdir, sockname) != 0)
-    {
-      warn ("connect(%s) failed on the second attempt", sockname);
-      return false;
-    }
-
-  /* otherwise, we're now connected */
-  debug (CONNECTION, "  -> success!");
-  return true;
+  return connection_connect_to_dynamic_wsinstance_socket (self, false);
 }
 
 static bool
@@ -488,6 +791,19 @@ connection_is_to_localhost (Connection *self)
     }
 }
 
+static bool
+connection_create_ws_socket (Connection *self)
+{
+  self->ws_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (self->ws_fd == -1)
+    {
+      warn ("failed to create cockpit-ws client socket");
+      return false;
+    }
+
+  return true;
+}
+
 static bool
 connection_connect_to_wsinstance (Connection *self)
 {
@@ -504,12 +820,8 @@ connection_connect_to_wsinstance (Connection *self)
       return true;
     }
 
-  self->ws_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-  if (self->ws_fd == -1)
-    {
-      warn ("failed to create cockpit-ws client socket");
-      return false;
-    }
+  if (!connection_create_ws_socket (self))
+    return false;
 
   if (self->tls == NULL)
     {
@@ -526,41 +838,116 @@ connection_connect_to_wsinstance (Connection *self)
     return connection_connect_to_dynamic_wsinstance (self);
 }
 
-/**
- * connection_handshake: Handle first event on client fd
- *
- * Check the very first byte of a new connection to tell apart TLS from plain
- * HTTP. Initialize TLS.
- */
-static bool
-connection_handshake (Connection *self)
+static void
+session_tickets_enable (gnutls_session_t tls)
 {
-  char b;
+  uint64_t now = now_msec ();
   int ret;
 
-  assert (self->ws_fd == -1);
+  pthread_mutex_lock (&session_tickets.mutex);
 
-  /* Wait for up to 30 seconds to receive the first byte before shutting
-   * down the connection.
-   */
-  struct pollfd pfd = { .fd = self->client_fd, .events = POLLIN };
-  do
-    ret = poll (&pfd, 1, 30000); /* timeout is wrong on syscall restart, but it's fine */
-  while (ret == -1 && errno == EINTR);
+  if (session_tickets.key.data == NULL || now - session_tickets.key_created >= TICKET_KEY_LIFETIME_MS)
+    {
+      debug (CONNECTION, "generating new session ticket key");
 
-  if (ret < 0)
-    err (EXIT_FAILURE, "poll() failed on client connection");
+      if (session_tickets.key.data)
+        {
+          gnutls_memset (session_tickets.key.data, 0, session_tickets.key.size);
+          gnutls_free (session_tickets.key.data);
+          session_tickets.key.data = NULL;
+        }
 
-  if (ret == 0)
+      ret = gnutls_session_ticket_key_generate (&session_tickets.key);
+      if (ret != GNUTLS_E_SUCCESS)
+        {
+          warnx ("gnutls_session_ticket_key_generate failed: %s", gnutls_strerror (ret));
+          session_tickets.key.data = NULL;
+        }
+
+      session_tickets.key_created = now;
+    }
+
+  /* gnutls copies the key into the session */
+  if (session_tickets.key.data)
     {
-      debug (CONNECTION, "client sent no data in 30 seconds, dropping connection.");
-      return false;
+      ret = gnutls_session_ticket_enable_server (tls, &session_tickets.key);
+      if (ret != GNUTLS_E_SUCCESS)
+        warnx ("gnutls_session_ticket_enable_server failed: %s", gnutls_strerror (ret));
+    }
+
+  pthread_mutex_unlock (&session_tickets.mutex);
+}
+
+static void
+session_tickets_count_handshake (bool resumed)
+{
+  pthread_mutex_lock (&session_tickets.mutex);
+
+  if (resumed)
+    session_tickets.resumed_handshakes++;
+  else
+    session_tickets.full_handshakes++;
+
+  debug (CONNECTION, "%s handshake; %u full, %u resumed so far", resumed ? "resumed" : "full",
+         session_tickets.full_handshakes, session_tickets.resumed_handshakes);
+
+  pthread_mutex_unlock (&session_tickets.mutex);
+}
+
+static void
+session_tickets_cleanup (void)
+{
+  pthread_mutex_lock (&session_tickets.mutex);
+
+  if (session_tickets.key.data)
+    {
+      gnutls_memset (session_tickets.key.data, 0, session_tickets.key.size);
+      gnutls_free (session_tickets.key.data);
+      session_tickets.key.data = NULL;
     }
 
+  session_tickets.full_handshakes = 0;
+  session_tickets.resumed_handshakes = 0;
+
+  pthread_mutex_unlock (&session_tickets.mutex);
+}
+
+/**
+ * connection_get_handshake_counts: Get TLS handshake statistics
+ *
+ * @out_full: Number of handshakes that did the full key exchange
+ * @out_resumed: Number of handshakes that resumed a previous session
+ *               from a session ticket
+ */
+void
+connection_get_handshake_counts (unsigned *out_full,
+                                 unsigned *out_resumed)
+{
+  pthread_mutex_lock (&session_tickets.mutex);
+  *out_full = session_tickets.full_handshakes;
+  *out_resumed = session_tickets.resumed_handshakes;
+  pthread_mutex_unlock (&session_tickets.mutex);
+}
+
+/**
+ * connection_peek: Check the first byte of a new connection
+ *
+ * Tell apart TLS from plain HTTP.  The caller must have waited for the
+ * client fd to become readable.
+ */
+static bool
+connection_peek (Connection *self,
+                 bool       *is_tls)
+{
+  char b;
+  int ret;
+
   /* peek the first byte and see if it's a TLS connection (starting with 22).
      We can assume that there is some data to read, as this is called in response
-     to an epoll event. */
-  ret = recv (self->client_fd, &b, 1, MSG_PEEK);
+     to a poll event. */
+  do
+    ret = recv (self->client_fd, &b, 1, MSG_PEEK);
+  while (ret == -1 && errno == EINTR);
 
   if (ret < 0)
     {
@@ -574,44 +961,153 @@ connection_handshake (Connection *self)
       return false;
     }
 
-  if (b == 22)
+  *is_tls = (b == 22);
+
+  return true;
+}
+
+static const gnutls_datum_t alpn_http_1_1 = { (unsigned char *) "http/1.1", 8 };
+
+/**
+ * connection_tls_init: Create the TLS session for a connection
+ */
+static bool
+connection_tls_init (Connection *self,
+                     bool        nonblocking)
+{
+  int ret;
+
+  debug (CONNECTION, "first byte is 22, initializing TLS");
+
+  if (parameters.credentials == NULL)
     {
-      debug (CONNECTION, "first byte is %i, initializing TLS", (int) b);
+      warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
+      return false;
+    }
 
-      if (parameters.credentials == NULL)
-        {
-          warnx ("got TLS connection, but our server does not have a certificate/key; refusing");
-          return false;
-        }
+  ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL | (nonblocking ? GNUTLS_NONBLOCK : 0));
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      ret = gnutls_init (&self->tls, GNUTLS_SERVER | GNUTLS_NO_SIGNAL);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_init failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  ret = gnutls_set_default_priority (self->tls);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      ret = gnutls_set_default_priority (self->tls);
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_set_default_priority failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
+                                credentials_get (parameters.credentials));
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
+      return false;
+    }
 
-      ret = gnutls_credentials_set (self->tls, GNUTLS_CRD_CERTIFICATE,
-                                    credentials_get (parameters.credentials));
-      if (ret != GNUTLS_E_SUCCESS)
-        {
-          warnx ("gnutls_credentials_set failed: %s", gnutls_strerror (ret));
-          return false;
-        }
+  gnutls_session_set_verify_function (self->tls, client_certificate_verify);
+  gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
+  session_tickets_enable (self->tls);
+
+  /* We don't look into the stream, and cockpit-ws only speaks HTTP/1.1;
+   * say so during the handshake, in case the client prefers h2 */
+  ret = gnutls_alpn_set_protocols (self->tls, &alpn_http_1_1, 1, GNUTLS_ALPN_SERVER_PRECEDENCE);
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_alpn_set_protocols failed: %s", gnutls_strerror (ret));
+      return false;
+    }
+
+  /* in non-blocking mode, the caller has to enforce the timeout itself */
+  if (!nonblocking)
+    gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+  gnutls_transport_set_int (self->tls, self->client_fd);
+
+  debug (CONNECTION, "TLS is initialised; doing handshake");
+
+  return true;
+}
+
+/**
+ * connection_tls_accept: Finish up after a successful TLS handshake
+ *
+ * Determines the wsinstance from the client certificate.
+ */
+static bool
+connection_tls_accept (Connection *self)
+{
+  bool resumed = gnutls_session_is_resumed (self->tls);
+  gnutls_datum_t alpn;
+
+  debug (CONNECTION, "TLS handshake completed");
+
+  if (gnutls_alpn_get_selected_protocol (self->tls, &alpn) == GNUTLS_E_SUCCESS)
+    {
+      debug (CONNECTION, "negotiated ALPN protocol %.*s", (int) alpn.size, alpn.data);
+    }
+
+  session_tickets_count_handshake (resumed);
+
+  /* The verify function doesn't run for resumed sessions, but the
+   * client certificate from the original handshake is still there;
+   * make sure it didn't expire in the meantime.
+   */
+  if (resumed && client_certificate_verify (self->tls) != GNUTLS_E_SUCCESS)
+    return false;
 
-      gnutls_session_set_verify_function (self->tls, client_certificate_verify);
-      gnutls_certificate_server_set_request (self->tls, parameters.request_mode);
-      gnutls_handshake_set_timeout (self->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
-      gnutls_transport_set_int (self->tls, self->client_fd);
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+  /* gnutls enables kTLS on its own when configured to (ktls = true in
+   * the system-wide config) and the kernel has the tls ULP; otherwise
+   * this is 0, and we stay in userspace.
+   */
+  self->ktls = gnutls_transport_is_ktls_enabled (self->tls);
+  debug (CONNECTION, "kTLS status: 0x%x", self->ktls);
+#endif
 
-      debug (CONNECTION, "TLS is initialised; doing handshake");
+  return client_certificate_accept (self->tls, parameters.cert_session_dir,
+                                    &self->wsinstance, &self->client_cert_filename);
+}
+
+/**
+ * connection_handshake: Handle first event on client fd
+ *
+ * Check the very first byte of a new connection to tell apart TLS from plain
+ * HTTP. Initialize TLS.
+ */
+static bool
+connection_handshake (Connection *self)
+{
+  bool is_tls;
+  int ret;
+
+  assert (self->ws_fd == -1);
+
+  /* Wait for up to 30 seconds to receive the first byte before shutting
+   * down the connection.
+   */
+  struct pollfd pfd = { .fd = self->client_fd, .events = POLLIN };
+  do
+    ret = poll (&pfd, 1, SETUP_TIMEOUT_MS); /* timeout is wrong on syscall restart, but it's fine */
+  while (ret == -1 && errno == EINTR);
+
+  if (ret < 0)
+    err (EXIT_FAILURE, "poll() failed on client connection");
+
+  if (ret == 0)
+    {
+      debug (CONNECTION, "client sent no data in 30 seconds, dropping connection.");
+      return false;
+    }
+
+  if (!connection_peek (self, &is_tls))
+    return false;
+
+  if (is_tls)
+    {
+      if (!connection_tls_init (self, false))
+        return false;
 
       do
         ret = gnutls_handshake (self->tls);
@@ -623,20 +1119,139 @@ connection_handshake (Connection *self)
           return false;
         }
 
-      debug (CONNECTION, "TLS handshake completed");
-
-      if (!client_certificate_accept (self->tls, parameters.cert_session_dir,
-                                      &self->wsinstance, &self->client_cert_filename))
+      if (!connection_tls_accept (self))
         return false;
     }
 
   return true;
 }
 
+static bool
+connection_alive (Connection *self)
+{
+  return buffer_alive (&self->client_to_ws_buffer) || buffer_alive (&self->ws_to_client_buffer);
+}
+
+static void
+connection_get_revents (Connection *self,
+                        short      *client_revents,
+                        short      *ws_revents)
+{
+  *client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
+  *ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
+
+  if (self->tls && buffer_can_read (&self->client_to_ws_buffer))
+    *client_revents |= POLLIN * (gnutls_record_check_pending (self->tls) != 0);
+}
+
+/* Plain HTTP connections and kTLS directions can be spliced */
+static bool
+connection_can_splice (Connection *self,
+                       unsigned    ktls_direction)
+{
+  return self->tls == NULL || (self->ktls & ktls_direction);
+}
+
+/* If the kernel does the crypto (or there is none), move the data with
+ * splice() instead of copying it through userspace.  The first write to
+ * the ws needs to carry the metadata fd, so that direction only
+ * switches after that.
+ */
+static void
+connection_update_splicing (Connection *self)
+{
+  Buffer *client_to_ws = &self->client_to_ws_buffer;
+  Buffer *ws_to_client = &self->ws_to_client_buffer;
+
+  if (connection_can_splice (self, GNUTLS_KTLS_SEND) && !ws_to_client->splicing &&
+      buffer_empty (ws_to_client) && !ws_to_client->eof)
+    buffer_start_splicing (ws_to_client);
+
+  if (connection_can_splice (self, GNUTLS_KTLS_RECV) && !client_to_ws->splicing &&
+      self->metadata_fd == -1 && buffer_empty (client_to_ws) && !client_to_ws->eof &&
+      (self->tls == NULL || gnutls_record_check_pending (self->tls) == 0))
+    buffer_start_splicing (client_to_ws);
+}
+
+/* do the I/O for the given (real or synthesized) poll events */
+static void
+connection_shovel (Connection *self,
+                   short       client_revents,
+                   short       ws_revents)
+{
+  Buffer *client_to_ws = &self->client_to_ws_buffer;
+  Buffer *ws_to_client = &self->ws_to_client_buffer;
+
+  if (self->tls)
+    {
+      if (client_revents & POLLIN)
+        {
+          if (client_to_ws->splicing)
+            buffer_splice_from_fd (client_to_ws, self->client_fd, self->tls);
+          else
+            buffer_read_from_tls (client_to_ws, self->tls);
+        }
+
+      if (client_revents & POLLOUT)
+        {
+          if (ws_to_client->splicing)
+            buffer_splice_to_fd (ws_to_client, self->client_fd, self->tls);
+          else
+            buffer_write_to_tls (ws_to_client, self->tls);
+        }
+    }
+  else
+    {
+      if (client_revents & POLLIN)
+        {
+          if (client_to_ws->splicing)
+            buffer_splice_from_fd (client_to_ws, self->client_fd, NULL);
+          else
+            buffer_read_from_fd (client_to_ws, self->client_fd);
+        }
+
+      if (client_revents & POLLOUT)
+        {
+          if (ws_to_client->splicing)
+            buffer_splice_to_fd (ws_to_client, self->client_fd, NULL);
+          else
+            buffer_write_to_fd (ws_to_client, self->client_fd, NULL);
+        }
+    }
+
+  if (ws_revents & POLLIN)
+    {
+      if (ws_to_client->splicing)
+        buffer_splice_from_fd (ws_to_client, self->ws_fd, NULL);
+      else
+        buffer_read_from_fd (ws_to_client, self->ws_fd);
+    }
+
+  if (ws_revents & POLLOUT)
+    {
+      if (client_to_ws->splicing)
+        buffer_splice_to_fd (client_to_ws, self->ws_fd, NULL);
+      else
+        buffer_write_to_fd (client_to_ws, self->ws_fd, &self->metadata_fd);
+    }
+
+  if (self->tls == NULL || self->ktls)
+    connection_update_splicing (self);
+}
+
 static void
 connection_thread_loop (Connection *self)
 {
-  while (buffer_alive (&self->client_to_ws_buffer) || buffer_alive (&self->ws_to_client_buffer))
+  if (self->tls == NULL || self->ktls)
+    {
+      /* splice() can block on the socket side, and we need to keep
+       * shoveling into both directions; gnutls copes with EAGAIN. */
+      set_nonblocking (self->client_fd);
+      set_nonblocking (self->ws_fd);
+      connection_update_splicing (self);
+    }
+
+  while (connection_alive (self))
     {
       short client_events, ws_events;
       short client_revents, ws_revents;
@@ -644,11 +1259,7 @@ connection_thread_loop (Connection *self)
 
       client_events = calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
       ws_events = calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
-      client_revents = calculate_revents (&self->client_to_ws_buffer, &self->ws_to_client_buffer);
-      ws_revents = calculate_revents (&self->ws_to_client_buffer, &self->client_to_ws_buffer);
-
-      if (self->tls && buffer_can_read (&self->client_to_ws_buffer))
-        client_revents |= POLLIN * (gnutls_record_check_pending (self->tls) != 0);
+      connection_get_revents (self, &client_revents, &ws_revents);
 
       debug (POLL, "poll | client %d/x%x/x%x | ws %d/x%x/x%x |",
              self->client_fd, client_events, client_revents,
@@ -677,28 +1288,7 @@ connection_thread_loop (Connection *self)
       debug (POLL, "poll result %i | client %d/x%x | ws %d/x%x |", n_ready,
              self->client_fd, client_revents, self->ws_fd, ws_revents);
 
-      if (self->tls)
-        {
-          if (client_revents & POLLIN)
-            buffer_read_from_tls (&self->client_to_ws_buffer, self->tls);
-
-          if (client_revents & POLLOUT)
-            buffer_write_to_tls (&self->ws_to_client_buffer, self->tls);
-        }
-      else
-        {
-          if (client_revents & POLLIN)
-            buffer_read_from_fd (&self->client_to_ws_buffer, self->client_fd);
-
-          if (client_revents & POLLOUT)
-            buffer_write_to_fd (&self->ws_to_client_buffer, self->client_fd, NULL);
-        }
-
-      if (ws_revents & POLLIN)
-        buffer_read_from_fd (&self->ws_to_client_buffer, self->ws_fd);
-
-      if (ws_revents & POLLOUT)
-        buffer_write_to_fd (&self->client_to_ws_buffer, self->ws_fd, &self->metadata_fd);
+      connection_shovel (self, client_revents, ws_revents);
     }
 }
 
@@ -783,19 +1373,55 @@ connection_create_metadata (Connection *self)
   return true;
 }
 
-void
-connection_thread_main (int fd)
+static void
+connection_init (Connection *self,
+                 int         fd)
 {
-  Connection self = { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1 };
+  *self = (Connection) { .client_fd = fd, .ws_fd = -1, .metadata_fd = -1, .factory_fd = -1 };
 
-  assert (!buffer_can_write (&self.client_to_ws_buffer));
-  assert (!buffer_can_write (&self.ws_to_client_buffer));
-  assert (!self.tls);
+  assert (!buffer_can_write (&self->client_to_ws_buffer));
+  assert (!buffer_can_write (&self->ws_to_client_buffer));
+  assert (!self->tls);
 
 #ifdef DEBUG
-  self.client_to_ws_buffer.name = "client-to-ws";
-  self.ws_to_client_buffer.name = "ws-to-client";
+  self->client_to_ws_buffer.name = "client-to-ws";
+  self->ws_to_client_buffer.name = "ws-to-client";
 #endif
+}
+
+static void
+connection_destroy (Connection *self)
+{
+  free (self->wsinstance);
+
+  if (self->client_cert_filename)
+    client_certificate_unlink_and_free (parameters.cert_session_dir, self->client_cert_filename);
+
+  if (self->tls)
+    gnutls_deinit (self->tls);
+
+  if (self->client_fd != -1)
+    close (self->client_fd);
+
+  if (self->ws_fd != -1)
+    close (self->ws_fd);
+
+  if (self->metadata_fd != -1)
+    close (self->metadata_fd);
+
+  if (self->factory_fd != -1)
+    close (self->factory_fd);
+
+  buffer_stop_splicing (&self->client_to_ws_buffer);
+  buffer_stop_splicing (&self->ws_to_client_buffer);
+}
+
+void
+connection_thread_main (int fd)
+{
+  Connection self;
+
+  connection_init (&self, fd);
 
   debug (CONNECTION, "New thread for fd %i", fd);
 
@@ -806,22 +1432,550 @@ connection_thread_main (int fd)
 
   debug (CONNECTION, "Thread for fd %i is going to exit now", fd);
 
-  free (self.wsinstance);
+  connection_destroy (&self);
+}
 
-  if (self.client_cert_filename)
-    client_certificate_unlink_and_free (parameters.cert_session_dir, self.client_cert_filename);
+/***********************************
+ *
+ * Event-driven worker mode
+ *
+ ***********************************/
 
-  if (self.tls)
-    gnutls_deinit (self.tls);
+static void
+connection_list_add (Connection **list,
+                     Connection  *self)
+{
+  assert (self->prev == NULL && self->next == NULL);
+
+  self->next = *list;
+  if (self->next)
+    self->next->prev = self;
+  *list = self;
+}
 
-  if (self.client_fd != -1)
-    close (self.client_fd);
+static void
+connection_list_remove (Connection **list,
+                        Connection  *self)
+{
+  if (self->prev)
+    self->prev->next = self->next;
+  else
+    *list = self->next;
 
-  if (self.ws_fd != -1)
-    close (self.ws_fd);
+  if (self->next)
+    self->next->prev = self->prev;
+
+  self->prev = self->next = NULL;
+}
+
+static Connection **
+connection_get_list (Connection *self)
+{
+  switch (self->state)
+    {
+    case CONNECTION_PROXY:
+      return &self->worker->proxying;
+    case CONNECTION_CLOSED:
+      return &self->worker->closed;
+    default:
+      return &self->worker->pending;
+    }
+}
 
-  if (self.metadata_fd != -1)
-    close (self.metadata_fd);
+static void
+connection_set_state (Connection      *self,
+                      ConnectionState  state)
+{
+  connection_list_remove (connection_get_list (self), self);
+  self->state = state;
+  connection_list_add (connection_get_list (self), self);
+}
+
+/* (re-)register @fd in the epoll set of the worker, with @events; 0 to remove it */
+static void
+connection_watch (Connection *self,
+                  Watch      *watch,
+                  int         fd,
+                  uint32_t    events)
+{
+  struct epoll_event ev = { .events = events, .data.ptr = watch };
+  int op;
+
+  if (events == watch->events)
+    return;
+
+  if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else if (watch->events == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  debug (POLL, "epoll_ctl (%d, %d, x%x)", op, fd, events);
+
+  if (epoll_ctl (self->worker->epollfd, op, fd, &ev) != 0)
+    err (EXIT_FAILURE, "epoll_ctl() failed");
+
+  watch->events = events;
+}
+
+static void
+connection_worker_close (Connection *self)
+{
+  debug (CONNECTION, "Connection for fd %i is going to be closed now", self->client_fd);
+
+  connection_watch (self, &self->client_watch, self->client_fd, 0);
+  connection_watch (self, &self->ws_watch, self->ws_fd, 0);
+  connection_watch (self, &self->factory_watch, self->factory_fd, 0);
+
+  /* There might be more events for us in the current batch, so the
+   * actual free() is deferred until the worker is done with it.
+   */
+  connection_set_state (self, CONNECTION_CLOSED);
+}
+
+static void
+connection_worker_proxy (Connection *self,
+                         short       client_revents,
+                         short       ws_revents)
+{
+  /* Process the real events, plus the synthesized ones (shutdown,
+   * pending data inside of gnutls) until we need to wait again.
+   */
+  do
+    {
+      connection_shovel (self, client_revents, ws_revents);
+
+      if (!connection_alive (self))
+        {
+          connection_worker_close (self);
+          return;
+        }
+
+      connection_get_revents (self, &client_revents, &ws_revents);
+    }
+  while (client_revents | ws_revents);
+
+  connection_watch (self, &self->client_watch, self->client_fd,
+                    calculate_events (&self->client_to_ws_buffer, &self->ws_to_client_buffer));
+  connection_watch (self, &self->ws_watch, self->ws_fd,
+                    calculate_events (&self->ws_to_client_buffer, &self->client_to_ws_buffer));
+}
+
+static void
+connection_worker_start_proxy (Connection *self)
+{
+  set_nonblocking (self->ws_fd);
+  connection_update_splicing (self);
+  connection_set_state (self, CONNECTION_PROXY);
+  connection_worker_proxy (self, 0, 0);
+}
+
+static void
+connection_worker_connect (Connection *self)
+{
+  if (!connection_create_metadata (self))
+    goto fail;
+
+  if (self->tls == NULL)
+    {
+      /* plain http never needs to wait for activation */
+      if (!connection_connect_to_wsinstance (self))
+        goto fail;
+    }
+  else
+    {
+      if (!connection_create_ws_socket (self))
+        goto fail;
+
+      if (!connection_connect_to_dynamic_wsinstance_socket (self, true))
+        {
+          /* Don't block the worker while systemd is starting the instance */
+          debug (CONNECTION, "  -> failed (%m).  Requesting activation.");
+          self->factory_fd = request_dynamic_wsinstance_start (self->wsinstance);
+          if (self->factory_fd == -1)
+            goto fail;
+
+          connection_watch (self, &self->client_watch, self->client_fd, 0);
+          connection_watch (self, &self->factory_watch, self->factory_fd, EPOLLIN);
+          self->deadline = now_msec () + ACTIVATION_TIMEOUT_MS;
+          connection_set_state (self, CONNECTION_ACTIVATE);
+          return;
+        }
+    }
+
+  connection_worker_start_proxy (self);
+  return;
+
+fail:
+  connection_worker_close (self);
+}
+
+static void
+connection_worker_handshake (Connection *self)
+{
+  int ret;
+
+  do
+    ret = gnutls_handshake (self->tls);
+  while (ret == GNUTLS_E_INTERRUPTED);
+
+  if (ret == GNUTLS_E_AGAIN)
+    {
+      /* 0: wants to read, 1: wants to write */
+      connection_watch (self, &self->client_watch, self->client_fd,
+                        gnutls_record_get_direction (self->tls) ? EPOLLOUT : EPOLLIN);
+      return;
+    }
+
+  if (ret != GNUTLS_E_SUCCESS)
+    {
+      warnx ("gnutls_handshake failed: %s", gnutls_strerror (ret));
+      connection_worker_close (self);
+      return;
+    }
+
+  if (!connection_tls_accept (self))
+    {
+      connection_worker_close (self);
+      return;
+    }
+
+  connection_worker_connect (self);
+}
+
+static void
+connection_worker_activated (Connection *self)
+{
+  connection_watch (self, &self->factory_watch, self->factory_fd, 0);
+
+  /* The factory sends its reply and EOF together, so this won't wait */
+  bool activated = request_dynamic_wsinstance_finish (self->factory_fd, 1000000);
+  self->factory_fd = -1;
+
+  debug (CONNECTION, "  -> trying again");
+  if (activated && connection_connect_to_dynamic_wsinstance_socket (self, false))
+    connection_worker_start_proxy (self);
+  else
+    connection_worker_close (self);
+}
+
+static void
+connection_worker_peek (Connection *self)
+{
+  bool is_tls;
+
+  if (!connection_peek (self, &is_tls))
+    {
+      connection_worker_close (self);
+      return;
+    }
+
+  if (!is_tls)
+    {
+      connection_worker_connect (self);
+      return;
+    }
+
+  if (!connection_tls_init (self, true))
+    {
+      connection_worker_close (self);
+      return;
+    }
+
+  self->deadline = now_msec () + SETUP_TIMEOUT_MS;
+  connection_set_state (self, CONNECTION_HANDSHAKE);
+  connection_worker_handshake (self);
+}
+
+static void
+connection_worker_dispatch (Watch    *watch,
+                            uint32_t  events)
+{
+  Connection *self = watch->connection;
+  short revents = 0;
+
+  /* errors and hangups are reported regardless of what we asked for;
+   * let the read or write calls find out what happened. */
+  if (events & (EPOLLERR | EPOLLHUP))
+    events |= watch->events;
+
+  revents |= (events & EPOLLIN) ? POLLIN : 0;
+  revents |= (events & EPOLLOUT) ? POLLOUT : 0;
+
+  switch (self->state)
+    {
+    case CONNECTION_PEEK:
+      connection_worker_peek (self);
+      break;
+
+    case CONNECTION_HANDSHAKE:
+      connection_worker_handshake (self);
+      break;
+
+    case CONNECTION_ACTIVATE:
+      assert (watch == &self->factory_watch);
+      connection_worker_activated (self);
+      break;
+
+    case CONNECTION_PROXY:
+      if (watch == &self->client_watch)
+        connection_worker_proxy (self, revents, 0);
+      else
+        connection_worker_proxy (self, 0, revents);
+      break;
+
+    case CONNECTION_CLOSED:
+      /* closed by an earlier event in the same batch */
+      break;
+    }
+}
+
+static void
+worker_add_connection (Worker *worker,
+                       int     fd)
+{
+  Connection *self = callocx (1, sizeof (Connection));
+
+  connection_init (self, fd);
+  self->worker = worker;
+  self->client_watch.connection = self;
+  self->ws_watch.connection = self;
+  self->factory_watch.connection = self;
+
+  debug (CONNECTION, "New connection for fd %i on worker %p", fd, worker);
+
+  set_nonblocking (fd);
+  self->state = CONNECTION_PEEK;
+  self->deadline = now_msec () + SETUP_TIMEOUT_MS;
+  connection_list_add (&worker->pending, self);
+  connection_watch (self, &self->client_watch, fd, EPOLLIN);
+}
+
+static void
+worker_accept_new (Worker *worker)
+{
+  uint64_t value;
+  int *fds;
+  size_t n_fds;
+
+  if (read (worker->wakeup_fd, &value, sizeof value) < 0 && errno != EAGAIN)
+    err (EXIT_FAILURE, "read(eventfd) failed");
+
+  pthread_mutex_lock (&worker->mutex);
+  fds = worker->new_fds;
+  n_fds = worker->n_new_fds;
+  worker->new_fds = NULL;
+  worker->n_new_fds = 0;
+  pthread_mutex_unlock (&worker->mutex);
+
+  for (size_t i = 0; i < n_fds; i++)
+    worker_add_connection (worker, fds[i]);
+
+  free (fds);
+}
+
+/* milliseconds until the next setup deadline, or -1 */
+static int
+worker_get_timeout (Worker *worker)
+{
+  uint64_t now = now_msec ();
+  int timeout = -1;
+
+  for (Connection *c = worker->pending; c; c = c->next)
+    {
+      int remaining = 0;
+
+      if (c->deadline > now)
+        remaining = (c->deadline - now < INT_MAX) ? (int) (c->deadline - now) : INT_MAX;
+
+      if (timeout == -1 || remaining < timeout)
+        timeout = remaining;
+    }
+
+  return timeout;
+}
+
+static void
+worker_expire_pending (Worker *worker)
+{
+  uint64_t now = now_msec ();
+  Connection *next;
+
+  for (Connection *c = worker->pending; c; c = next)
+    {
+      next = c->next;
+
+      if (c->deadline <= now)
+        {
+          debug (CONNECTION, "client fd %i failed to set up in time, dropping connection.", c->client_fd);
+          connection_worker_close (c);
+        }
+    }
+}
+
+static void
+worker_free_closed (Worker *worker)
+{
+  while (worker->closed)
+    {
+      Connection *self = worker->closed;
+
+      connection_list_remove (&worker->closed, self);
+      connection_destroy (self);
+      free (self);
+
+      workers.closed_callback ();
+    }
+}
+
+static void *
+worker_thread_main (void *data)
+{
+  Worker *worker = data;
+  struct epoll_event events[64];
+  bool quit = false;
+
+  while (!quit)
+    {
+      int n_ready = epoll_wait (worker->epollfd, events, N_ELEMENTS (events), worker_get_timeout (worker));
+
+      if (n_ready == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          err (EXIT_FAILURE, "epoll_wait() failed");
+        }
+
+      for (int i = 0; i < n_ready; i++)
+        {
+          if (events[i].data.ptr == NULL)
+            worker_accept_new (worker);
+          else
+            connection_worker_dispatch (events[i].data.ptr, events[i].events);
+        }
+
+      worker_expire_pending (worker);
+      worker_free_closed (worker);
+
+      pthread_mutex_lock (&worker->mutex);
+      quit = worker->quit;
+      pthread_mutex_unlock (&worker->mutex);
+    }
+
+  /* The server only shuts down once all connections are gone */
+  assert (worker->pending == NULL);
+  assert (worker->proxying == NULL);
+
+  return NULL;
+}
+
+static void
+worker_wakeup (Worker *worker)
+{
+  uint64_t one = 1;
+
+  if (write (worker->wakeup_fd, &one, sizeof one) != sizeof one)
+    err (EXIT_FAILURE, "write(eventfd) failed");
+}
+
+/**
+ * connection_workers_init: Switch to event-driven mode
+ *
+ * Instead of one thread per connection, start @n_workers threads which
+ * each multiplex many connections with non-blocking I/O.  New
+ * connections must then be given to connection_workers_add() instead of
+ * connection_thread_main().
+ *
+ * @n_workers: Number of worker threads; usually the number of CPUs
+ * @closed_callback: Called (from a worker thread) whenever a connection
+ *                   has been closed
+ */
+void
+connection_workers_init (unsigned n_workers,
+                         void (* closed_callback) (void))
+{
+  assert (workers.n_workers == 0);
+  assert (n_workers > 0);
+
+  workers.workers = callocx (n_workers, sizeof (Worker));
+  workers.n_workers = n_workers;
+  workers.next_worker = 0;
+  workers.closed_callback = closed_callback;
+
+  for (unsigned i = 0; i < n_workers; i++)
+    {
+      Worker *worker = &workers.workers[i];
+      struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+      worker->epollfd = epoll_create1 (EPOLL_CLOEXEC);
+      if (worker->epollfd == -1)
+        err (EXIT_FAILURE, "Failed to create epoll fd");
+
+      worker->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (worker->wakeup_fd == -1)
+        err (EXIT_FAILURE, "Failed to create eventfd");
+
+      if (epoll_ctl (worker->epollfd, EPOLL_CTL_ADD, worker->wakeup_fd, &ev) != 0)
+        err (EXIT_FAILURE, "Failed to epoll eventfd");
+
+      pthread_mutex_init (&worker->mutex, NULL);
+
+      int r = pthread_create (&worker->thread, NULL, worker_thread_main, worker);
+      if (r != 0)
+        {
+          errno = r;
+          err (EXIT_FAILURE, "pthread_create() failed");
+        }
+    }
+
+  debug (CONNECTION, "Started %u connection workers", n_workers);
+}
+
+/**
+ * connection_workers_add: Handle a new connection in event-driven mode
+ *
+ * The connection gets assigned to one of the workers, in round-robin
+ * fashion.  Takes ownership of @fd.
+ */
+void
+connection_workers_add (int fd)
+{
+  assert (workers.n_workers > 0);
+
+  Worker *worker = &workers.workers[workers.next_worker++ % workers.n_workers];
+
+  pthread_mutex_lock (&worker->mutex);
+  worker->new_fds = reallocarrayx (worker->new_fds, worker->n_new_fds + 1, sizeof (int));
+  worker->new_fds[worker->n_new_fds++] = fd;
+  pthread_mutex_unlock (&worker->mutex);
+
+  worker_wakeup (worker);
+}
+
+static void
+connection_workers_cleanup (void)
+{
+  for (unsigned i = 0; i < workers.n_workers; i++)
+    {
+      Worker *worker = &workers.workers[i];
+
+      pthread_mutex_lock (&worker->mutex);
+      worker->quit = true;
+      pthread_mutex_unlock (&worker->mutex);
+
+      worker_wakeup (worker);
+      pthread_join (worker->thread, NULL);
+
+      assert (worker->n_new_fds == 0);
+      free (worker->new_fds);
+      pthread_mutex_destroy (&worker->mutex);
+      close (worker->wakeup_fd);
+      close (worker->epollfd);
+    }
+
+  free (workers.workers);
+  memset (&workers, 0, sizeof workers);
 }
 
 /**
@@ -888,6 +2042,9 @@ connection_cleanup (void)
   assert (parameters.wsinstance_sockdir != -1);
   assert (parameters.cert_session_dir != -1);
 
+  connection_workers_cleanup ();
+  session_tickets_cleanup ();
+
   if (parameters.credentials)
     {
       credentials_unref (parameters.credentials);
@@ -23,6 +23,19 @@ connection_crypto_init (int cert_dirfd,
 void
 connection_cleanup (void);
 
+/* statistics */
+void
+connection_get_handshake_counts (unsigned *out_full,
+                                 unsigned *out_resumed);
+
 /* handle a new connection */
 void
 connection_thread_main (int fd);
+
+/* event-driven mode */
+void
+connection_workers_init (unsigned n_workers,
+                         void (* closed_callback) (void));
+
+void
+connection_workers_add (int fd);
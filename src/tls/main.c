@@ -11,6 +11,8 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
 #include <unistd.h>
 
 #include <common/cockpitconf.h>
@@ -24,10 +26,12 @@ struct arguments {
   uint16_t port;
   bool no_tls;
   int idle_timeout;
+  int workers;
 };
 
 #define OPT_NO_TLS 1000
 #define OPT_IDLE_TIMEOUT 1001
+#define OPT_WORKERS 1002
 
 static int
 arg_parse_int (char *arg, struct argp_state *state, int min, int max, const char *error_msg)
@@ -57,6 +61,12 @@ parse_opt (int key, char *arg, struct argp_state *state)
       case OPT_IDLE_TIMEOUT:
         arguments->idle_timeout = arg_parse_int (arg, state, 0, INT_MAX, "Invalid idle timeout");
         break;
+      case OPT_WORKERS:
+        if (strcmp (arg, "auto") == 0)
+          arguments->workers = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+        else
+          arguments->workers = arg_parse_int (arg, state, 0, 1024, "Invalid number of workers");
+        break;
       default:
         return ARGP_ERR_UNKNOWN;
     }
@@ -67,6 +77,7 @@ static struct argp_option options[] = {
   {"no-tls", OPT_NO_TLS, 0, 0,  "Don't use TLS" },
   {"port", 'p', "PORT", 0, "Local port to bind to (9090 if unset)" },
   {"idle-timeout", OPT_IDLE_TIMEOUT, "SECONDS", 0, "Time after which to exit if there are no connections; 0 to run forever (default: 90)" },
+  {"workers", OPT_WORKERS, "N", 0, "Multiplex connections onto N event-driven threads, or 'auto' for one per CPU; 0 for one thread per connection (default: 0)" },
   { 0 }
 };
 
@@ -87,6 +98,7 @@ main (int argc, char **argv)
   arguments.no_tls = false;
   arguments.port = 9090;
   arguments.idle_timeout = 90;
+  arguments.workers = 0;
 
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
@@ -95,6 +107,7 @@ main (int argc, char **argv)
     errx (EXIT_FAILURE, "$RUNTIME_DIRECTORY environment variable must be set to a private directory");
 
   server_init ("/run/cockpit/wsinstance", runtimedir, arguments.idle_timeout, arguments.port);
+  server_set_workers (arguments.workers);
 
   if (!arguments.no_tls)
     {
@@ -33,6 +33,7 @@ static struct {
   int first_listener;
   int last_listener;
   int epollfd;
+  unsigned n_workers;
 
   /* rw, protected by mutex */
   pthread_mutex_t connection_mutex;
@@ -72,6 +73,24 @@ check_sd_listen_pid (void)
   return true;
 }
 
+static void
+server_connection_closed (void)
+{
+  pthread_mutex_lock (&server.connection_mutex);
+
+  server.connection_count--;
+
+  debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
+
+  if (server.connection_count == 0 && server.idle_timerfd != -1)
+    {
+      debug (CONNECTION, "  -> setting idle timeout");
+      timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
+    }
+
+  pthread_mutex_unlock (&server.connection_mutex);
+}
+
 static void *
 server_connection_thread_start_routine (void *data)
 {
@@ -80,21 +99,7 @@ server_connection_thread_start_routine (void *data)
   connection_thread_main (fd);
 
   /* teardown */
-  {
-    pthread_mutex_lock (&server.connection_mutex);
-
-    server.connection_count--;
-
-    debug (CONNECTION, "Server.connection_count decreased to %i", server.connection_count);
-
-    if (server.connection_count == 0 && server.idle_timerfd != -1)
-      {
-        debug (CONNECTION, "  -> setting idle timeout");
-        timerfd_settime (server.idle_timerfd, 0, &server.idle_timeout, NULL);
-      }
-
-    pthread_mutex_unlock (&server.connection_mutex);
-  }
+  server_connection_closed ();
 
   return NULL;
 }
@@ -141,6 +146,12 @@ handle_accept (int listen_fd)
     pthread_mutex_unlock (&server.connection_mutex);
   }
 
+  if (server.n_workers > 0)
+    {
+      connection_workers_add (fd);
+      return;
+    }
+
   pthread_attr_init (&attr);
   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
 
@@ -270,6 +281,32 @@ server_init (const char *wsinstance_sockdir,
     }
 }
 
+/**
+ * server_set_workers: Handle connections in event-driven worker threads
+ *
+ * By default, every connection gets its own thread.  After calling this,
+ * all connections are instead multiplexed onto @n_workers threads using
+ * non-blocking I/O, so that the number of threads and stacks no longer
+ * grows with the number of connections.
+ *
+ * This must be called after server_init(), before handling any events.
+ *
+ * @n_workers: Number of worker threads, usually one per CPU
+ */
+void
+server_set_workers (unsigned n_workers)
+{
+  assert (server.initialized);
+  assert (server.n_workers == 0);
+  assert (server.connection_count == 0);
+
+  if (n_workers == 0)
+    return;
+
+  connection_workers_init (n_workers, server_connection_closed);
+  server.n_workers = n_workers;
+}
+
 int
 server_get_listener (void)
 {
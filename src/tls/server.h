@@ -16,6 +16,9 @@ server_init (const char *wsinstance_sockdir,
              int idle_timeout,
              uint16_t port);
 
+void
+server_set_workers (unsigned n_workers);
+
 void
 server_run (void);
 
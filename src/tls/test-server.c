@@ -12,8 +12,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <glib.h>
@@ -61,6 +64,7 @@ typedef struct {
   const char *client_fingerprint;
   const char *priority;
   int expected_pk_algo;
+  unsigned workers;
 } TestFixture;
 
 static const TestFixture fixture_separate_crt_key = {
@@ -117,6 +121,26 @@ static const TestFixture fixture_multiple_certs_rsa = {
   .expected_pk_algo = GNUTLS_PK_RSA,
 };
 
+static const TestFixture fixture_workers = {
+  .workers = 2,
+};
+
+static const TestFixture fixture_workers_tls = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .workers = 1,
+};
+
+static const TestFixture fixture_workers_client_cert = {
+  .certfile = CERTFILE,
+  .keyfile = KEYFILE,
+  .cert_request_mode = GNUTLS_CERT_REQUEST,
+  .client_crt = CLIENT_CERTFILE,
+  .client_key = CLIENT_KEYFILE,
+  .client_fingerprint = CLIENT_CERT_FINGERPRINT,
+  .workers = 2,
+};
+
 /* for forking test cases, where server's SIGCHLD handling gets in the way */
 static void
 block_sigchld (void)
@@ -470,6 +494,7 @@ setup (TestCase *tc, gconstpointer data)
 
   /* Let the kernel assign a port */
   server_init (tc->ws_socket_dir, tc->runtime_dir, fixture ? fixture->idle_timeout : 0, 0);
+  server_set_workers (fixture ? fixture->workers : 0);
 
   if (fixture && fixture->certfile)
     {
@@ -671,6 +696,66 @@ test_no_tls_many_parallel (TestCase *tc, gconstpointer data)
   }
 }
 
+static gint64
+get_cpu_time_usec (void)
+{
+  struct rusage usage;
+
+  g_assert_no_errno (getrusage (RUSAGE_SELF, &usage));
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void
+test_no_tls_stalled_ws (TestCase *tc, gconstpointer data)
+{
+  /* Replace the ws with a listener that never reads anything */
+  g_autofree gchar *http_sock = g_build_filename (tc->ws_socket_dir, "http.sock", NULL);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  g_assert_cmpuint (strlen (http_sock), <, sizeof addr.sun_path);
+  strcpy (addr.sun_path, http_sock);
+  g_assert_no_errno (unlink (http_sock));
+  int listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_assert_no_errno (listener);
+  g_assert_no_errno (bind (listener, (struct sockaddr *) &addr, sizeof addr));
+  g_assert_no_errno (listen (listener, 1));
+
+  int fd = do_connect (tc);
+  g_assert_cmpint (fd, >, 0);
+  int one = 1;
+  g_assert_no_errno (setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one));
+  send_request (fd, "x");
+
+  struct pollfd pfd = { .fd = listener, .events = POLLIN };
+  for (int retry = 0; retry < 100 && poll (&pfd, 1, 0) == 0; ++retry)
+    server_poll_event (100);
+  int ws_fd = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+  g_assert_no_errno (ws_fd);
+
+  /* Many small segments fill the pipe slot by slot, long before the
+   * byte count reaches the buffer size, once the ws socket is full */
+  g_assert_no_errno (fcntl (fd, F_SETFL, O_NONBLOCK));
+  for (int i = 0; i < 2000 && write (fd, "x", 1) == 1; ++i)
+    {
+      server_poll_event (0);
+      g_usleep (500);
+    }
+
+  /* With the ws side stalled, the connection must wait, not spin */
+  gint64 cpu_start = get_cpu_time_usec ();
+  gint64 end = g_get_monotonic_time () + G_USEC_PER_SEC;
+  while (g_get_monotonic_time () < end)
+    server_poll_event (100);
+  g_assert_cmpint (get_cpu_time_usec () - cpu_start, <, G_USEC_PER_SEC / 2);
+
+  close (ws_fd);
+  close (listener);
+  close (fd);
+  for (int retries = 0; retries < 50 && server_num_connections () > 0; ++retries)
+    server_poll_event (100);
+  g_assert_cmpuint (server_num_connections (), ==, 0);
+}
+
 static void
 test_no_tls_redirect (TestCase *tc, gconstpointer data)
 {
@@ -923,6 +1008,135 @@ test_tls_client_cert_parallel (TestCase *tc, gconstpointer data)
   g_assert_cmpint (status, ==, 0);
 }
 
+static void
+test_tls_resumption (TestCase *tc, gconstpointer data)
+{
+  const TestFixture *fixture = data;
+  unsigned full, resumed;
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+
+  /* do the connections in a subprocess, as gnutls_handshake is synchronous */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      const char request[] = "GET / HTTP/1.0\r\nHost: localhost\r\n\r\n";
+      gnutls_certificate_credentials_t xcred;
+      gnutls_datum_t session_data = { NULL, 0 };
+
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      if (fixture->client_crt)
+        g_assert_cmpint (gnutls_certificate_set_x509_key_file (xcred,
+                                                               fixture->client_crt,
+                                                               fixture->client_key,
+                                                               GNUTLS_X509_FMT_PEM),
+                         ==, GNUTLS_E_SUCCESS);
+
+      for (int i = 0; i < 3; i++)
+        {
+          gnutls_session_t session;
+          char buf[4096];
+          ssize_t len;
+          int fd = do_connect (tc);
+
+          g_assert_cmpint (fd, >, 0);
+          g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+          gnutls_transport_set_int (session, fd);
+          g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+          g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+          gnutls_handshake_set_timeout (session, 5000);
+          if (session_data.data)
+            g_assert_cmpint (gnutls_session_set_data (session, session_data.data, session_data.size), ==, GNUTLS_E_SUCCESS);
+
+          g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+          g_assert_cmpint (gnutls_session_is_resumed (session), ==, i > 0);
+
+          /* with TLS 1.3, this also receives the session ticket */
+          g_assert_cmpint (gnutls_record_send (session, request, sizeof request), ==, sizeof request);
+          len = gnutls_record_recv (session, buf, sizeof buf - 1);
+          g_assert_cmpint (len, >=, 100);
+          buf[len] = '\0';
+          if (strstr (buf, "200 OK"))
+            cockpit_assert_strmatch (buf, "HTTP/1.1 200 OK*");
+          else
+            cockpit_assert_strmatch (buf, "HTTP/1.1 404 Not Found*");
+
+          gnutls_free (session_data.data);
+          g_assert_cmpint (gnutls_session_get_data2 (session, &session_data), ==, GNUTLS_E_SUCCESS);
+
+          g_assert_cmpint (gnutls_bye (session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+          gnutls_deinit (session);
+          close (fd);
+        }
+
+      gnutls_free (session_data.data);
+      gnutls_certificate_free_credentials (xcred);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (200);
+  g_assert_cmpint (status, ==, 0);
+
+  connection_get_handshake_counts (&full, &resumed);
+  g_assert_cmpuint (full, ==, 1);
+  g_assert_cmpuint (resumed, ==, 2);
+}
+
+static void
+test_tls_alpn (TestCase *tc, gconstpointer data)
+{
+  pid_t pid;
+  int status = -1;
+
+  block_sigchld ();
+
+  /* do the connection in a subprocess, as gnutls_handshake is synchronous */
+  pid = fork ();
+  if (pid < 0)
+    g_error ("failed to fork: %m");
+  if (pid == 0)
+    {
+      const gnutls_datum_t protocols[] = {
+        { (unsigned char *) "h2", 2 },
+        { (unsigned char *) "http/1.1", 8 },
+      };
+      gnutls_certificate_credentials_t xcred;
+      gnutls_session_t session;
+      gnutls_datum_t selected;
+      int fd = do_connect (tc);
+
+      g_assert_cmpint (fd, >, 0);
+      g_assert_cmpint (gnutls_certificate_allocate_credentials (&xcred), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_init (&session, GNUTLS_CLIENT), ==, GNUTLS_E_SUCCESS);
+      gnutls_transport_set_int (session, fd);
+      g_assert_cmpint (gnutls_set_default_priority (session), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, xcred), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpint (gnutls_alpn_set_protocols (session, protocols, G_N_ELEMENTS (protocols), 0), ==, GNUTLS_E_SUCCESS);
+      gnutls_handshake_set_timeout (session, 5000);
+      g_assert_cmpint (gnutls_handshake (session), ==, GNUTLS_E_SUCCESS);
+
+      /* h2 is preferred by the client, but we only speak HTTP/1.1 */
+      g_assert_cmpint (gnutls_alpn_get_selected_protocol (session, &selected), ==, GNUTLS_E_SUCCESS);
+      g_assert_cmpuint (selected.size, ==, 8);
+      g_assert (memcmp (selected.data, "http/1.1", 8) == 0);
+
+      g_assert_cmpint (gnutls_bye (session, GNUTLS_SHUT_RDWR), ==, GNUTLS_E_SUCCESS);
+      gnutls_deinit (session);
+      gnutls_certificate_free_credentials (xcred);
+      close (fd);
+      exit (0);
+    }
+
+  for (int retry = 0; retry < 100 && waitpid (pid, &status, WNOHANG) <= 0; ++retry)
+    server_poll_event (200);
+  g_assert_cmpint (status, ==, 0);
+}
+
 static void
 test_mixed_protocols (TestCase *tc, gconstpointer data)
 {
@@ -970,6 +1184,8 @@ main (int argc, char *argv[])
               setup, test_no_tls_many_serial, teardown);
   g_test_add ("/server/no-tls/many-parallel", TestCase, NULL,
               setup, test_no_tls_many_parallel, teardown);
+  g_test_add ("/server/no-tls/stalled-ws", TestCase, NULL,
+              setup, test_no_tls_stalled_ws, teardown);
   g_test_add ("/server/no-tls/redirect", TestCase, NULL,
               setup, test_no_tls_redirect, teardown);
   g_test_add ("/server/tls/no-client-cert", TestCase, &fixture_separate_crt_key,
@@ -992,6 +1208,12 @@ main (int argc, char *argv[])
               setup, test_tls_redirect_header_safety, teardown);
   g_test_add ("/server/tls/blocked-handshake", TestCase, &fixture_separate_crt_key,
               setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/tls/resumption", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_resumption, teardown);
+  g_test_add ("/server/tls/resumption/client-cert", TestCase, &fixture_separate_crt_key_client_cert,
+              setup, test_tls_resumption, teardown);
+  g_test_add ("/server/tls/alpn", TestCase, &fixture_separate_crt_key,
+              setup, test_tls_alpn, teardown);
   g_test_add ("/server/mixed-protocols", TestCase, &fixture_separate_crt_key,
               setup, test_mixed_protocols, teardown);
   g_test_add ("/server/tls/multiple-certs/ecdsa", TestCase, &fixture_multiple_certs_ecdsa,
@@ -1003,5 +1225,28 @@ main (int argc, char *argv[])
   g_test_add ("/server/ipv4/connection", TestCase, NULL,
               setup, test_ipv4_connection, teardown);
 
+  /* event-driven worker mode */
+  g_test_add ("/server/workers/no-tls/single-request", TestCase, &fixture_workers,
+              setup, test_no_tls_single, teardown);
+  g_test_add ("/server/workers/no-tls/many-serial", TestCase, &fixture_workers,
+              setup, test_no_tls_many_serial, teardown);
+  g_test_add ("/server/workers/no-tls/stalled-ws", TestCase, &fixture_workers,
+              setup, test_no_tls_stalled_ws, teardown);
+  g_test_add ("/server/workers/tls/no-client-cert", TestCase, &fixture_workers_tls,
+              setup, test_tls_no_client_cert, teardown);
+  g_test_add ("/server/workers/tls/client-cert", TestCase, &fixture_workers_client_cert,
+              setup, test_tls_client_cert, teardown);
+  g_test_add ("/server/workers/tls/client-cert-parallel", TestCase, &fixture_workers_client_cert,
+              setup, test_tls_client_cert_parallel, teardown);
+  /* a single worker must not get stuck in one client's handshake */
+  g_test_add ("/server/workers/tls/blocked-handshake", TestCase, &fixture_workers_tls,
+              setup, test_tls_blocked_handshake, teardown);
+  g_test_add ("/server/workers/mixed-protocols", TestCase, &fixture_workers_tls,
+              setup, test_mixed_protocols, teardown);
+  g_test_add ("/server/workers/tls/resumption", TestCase, &fixture_workers_tls,
+              setup, test_tls_resumption, teardown);
+  g_test_add ("/server/workers/tls/alpn", TestCase, &fixture_workers_tls,
+              setup, test_tls_alpn, teardown);
+
   return g_test_run ();
 }
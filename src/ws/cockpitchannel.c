@@ -13,6 +13,8 @@
 
 #include "cockpitchannel.h"
 
+#include "common/cockpitconf.h"
+
 #include "cockpitflow.h"
 #include "cockpitjson.h"
 #include "cockpitunicode.h"
@@ -55,14 +57,32 @@
  *  - It can optionally control another flow, by emitting a "pressure" signal
  *    when its peer receiving data does not respond to "ping" messages within
  *    a given window.
+ *
+ * The window is sized from what the "pong" replies tell us about the peer:
+ * the shortest round trip seen recently, and the fastest rate at which it
+ * acknowledged data. Twice their product keeps the peer busy without
+ * queueing much more than that. It stays between the FlowWindowMin and
+ * FlowWindowMax cockpit.conf settings.
  */
 
 /* Every 16K Send a ping */
 #define  CHANNEL_FLOW_PING        (16L * 1024L)
 
-/* Allow up to 1MB of data to be sent without ack */
+/* Allow up to 2MB of data to be sent without ack, until we've measured the peer */
 #define  CHANNEL_FLOW_WINDOW       (2L * 1024L * 1024L)
 
+/* How many pings we remember the send time of, and rate samples we keep */
+#define  CHANNEL_FLOW_PINGS        64
+#define  CHANNEL_FLOW_RATES        8
+
+/* A round trip measurement is forgotten after this long */
+#define  CHANNEL_FLOW_RTT_EXPIRY   (10 * G_USEC_PER_SEC)
+
+typedef struct {
+    gint64 sequence;
+    gint64 when;
+} CockpitChannelPing;
+
 typedef struct {
     gulong recv_sig;
     gulong close_sig;
@@ -104,6 +124,21 @@ typedef struct {
     /* The number of bytes sent, and current flow control window */
     gint64 out_sequence;
     gint64 out_window;
+    gboolean out_pressure;
+
+    /* How the window is sized, and what we measured to size it */
+    gint64 flow_window;
+    gint64 flow_window_min;
+    gint64 flow_window_max;
+    CockpitChannelPing pings[CHANNEL_FLOW_PINGS];
+    guint pings_head;
+    guint pings_len;
+    gint64 min_rtt;
+    gint64 min_rtt_when;
+    gint64 rates[CHANNEL_FLOW_RATES];
+    guint rates_next;
+    gint64 acked_sequence;
+    gint64 acked_when;
 
     /* Another object giving back-pressure on received data */
     gboolean flow_control;
@@ -144,9 +179,78 @@ static void
 cockpit_channel_init (CockpitChannel *self)
 {
   CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  const CockpitConfSnapshot *conf = cockpit_conf_snapshot ();
+
+  priv->flow_window_min = conf->flow_window_min;
+  priv->flow_window_max = conf->flow_window_max;
+  priv->flow_window = CLAMP (CHANNEL_FLOW_WINDOW, priv->flow_window_min, priv->flow_window_max);
 
   priv->out_sequence = 0;
-  priv->out_window = CHANNEL_FLOW_WINDOW;
+  priv->out_window = priv->flow_window;
+}
+
+static void
+flow_remember_ping (CockpitChannelPrivate *priv,
+                    gint64 sequence)
+{
+  CockpitChannelPing *ping;
+
+  /* Once full, further pings just don't get measured */
+  if (priv->pings_len == CHANNEL_FLOW_PINGS)
+    return;
+
+  ping = &priv->pings[(priv->pings_head + priv->pings_len) % CHANNEL_FLOW_PINGS];
+  ping->sequence = sequence;
+  ping->when = g_get_monotonic_time ();
+  priv->pings_len++;
+}
+
+static void
+flow_measure_pong (CockpitChannelPrivate *priv,
+                   gint64 sequence)
+{
+  CockpitChannelPing *ping = NULL;
+  gint64 now = g_get_monotonic_time ();
+  gint64 rate = 0;
+  gint64 window;
+  guint i;
+
+  /* Pongs come back in order, so anything older has been answered too */
+  while (priv->pings_len > 0 && priv->pings[priv->pings_head].sequence <= sequence)
+    {
+      ping = &priv->pings[priv->pings_head];
+      priv->pings_head = (priv->pings_head + 1) % CHANNEL_FLOW_PINGS;
+      priv->pings_len--;
+    }
+
+  if (!ping || ping->sequence != sequence)
+    return;
+
+  /* The smallest round trip has the least of our own queueing in it */
+  if (priv->min_rtt == 0 || now - ping->when < priv->min_rtt ||
+      now - priv->min_rtt_when > CHANNEL_FLOW_RTT_EXPIRY)
+    {
+      priv->min_rtt = MAX (now - ping->when, 1);
+      priv->min_rtt_when = now;
+    }
+
+  /* The rate at which the peer acknowledged data since the last pong */
+  if (priv->acked_when > 0 && now > priv->acked_when && sequence > priv->acked_sequence)
+    {
+      priv->rates[priv->rates_next] = (sequence - priv->acked_sequence) * G_USEC_PER_SEC / (now - priv->acked_when);
+      priv->rates_next = (priv->rates_next + 1) % CHANNEL_FLOW_RATES;
+    }
+  priv->acked_sequence = sequence;
+  priv->acked_when = now;
+
+  /* A slow moment of the sender says nothing about the peer, so take the best */
+  for (i = 0; i < CHANNEL_FLOW_RATES; i++)
+    rate = MAX (rate, priv->rates[i]);
+  if (rate == 0)
+    return;
+
+  window = 2 * (rate * priv->min_rtt / G_USEC_PER_SEC);
+  priv->flow_window = CLAMP (window, priv->flow_window_min, priv->flow_window_max);
 }
 
 static void
@@ -225,20 +329,23 @@ process_pong (CockpitChannel *self,
     }
 
   g_debug ("%s: received pong with sequence: %" G_GINT64_FORMAT, priv->id, sequence);
-  if (sequence > priv->out_window + (CHANNEL_FLOW_WINDOW * 10))
+  if (sequence > priv->out_window + (priv->flow_window_max * 10))
     {
       g_message ("%s: received a flow control ack with a suspiciously large sequence: %" G_GINT64_FORMAT,
                  priv->id, sequence);
     }
 
-  if (sequence >= priv->out_window)
+  flow_measure_pong (priv, sequence);
+
+  if (sequence + priv->flow_window > priv->out_window)
     {
       /* Up to this point has been confirmed received */
-      priv->out_window = sequence + CHANNEL_FLOW_WINDOW;
+      priv->out_window = sequence + priv->flow_window;
 
       /* If our sent bytes are within the window, no longer under pressure */
-      if (priv->out_sequence <= priv->out_window)
+      if (priv->out_pressure && priv->out_sequence <= priv->out_window)
         {
+          priv->out_pressure = FALSE;
           g_debug ("%s: got acknowledge of enough data, relieving back pressure", priv->id);
           cockpit_flow_emit_pressure (COCKPIT_FLOW (self), FALSE);
         }
@@ -360,6 +467,7 @@ cockpit_channel_actual_send (CockpitChannel *self,
         {
           ping = json_object_new ();
           json_object_set_int_member (ping, "sequence", out_sequence);
+          flow_remember_ping (priv, out_sequence);
           cockpit_channel_control (self, "ping", ping);
           g_debug ("%s: sending ping with sequence: %" G_GINT64_FORMAT, priv->id, out_sequence);
           json_object_unref (ping);
@@ -371,6 +479,7 @@ cockpit_channel_actual_send (CockpitChannel *self,
         {
           g_debug ("%s: sent too much data without acknowledgement, emitting back pressure until %"
                    G_GINT64_FORMAT, priv->id, priv->out_window);
+          priv->out_pressure = TRUE;
           cockpit_flow_emit_pressure (COCKPIT_FLOW (self), TRUE);
         }
     }
@@ -658,6 +767,13 @@ cockpit_channel_real_close (CockpitChannel *self,
 
   priv->sent_close = TRUE;
 
+  if (priv->flow_control && priv->acked_when > 0)
+    {
+      g_debug ("%s: flow control window %" G_GINT64_FORMAT " bytes, round trip %" G_GINT64_FORMAT
+               " us, acknowledged %" G_GINT64_FORMAT " bytes", priv->id, priv->flow_window,
+               priv->min_rtt, priv->acked_sequence);
+    }
+
   if (!priv->transport_closed)
     {
       flush_buffer (self);
@@ -889,7 +1005,10 @@ cockpit_channel_send (CockpitChannel *self,
   const guint8 *data;
   gsize length;
   GBytes *send_data = payload;
+  GBytes *repaired = NULL;
   GByteArray *combined;
+  gsize valid;
+  gsize tail;
 
   if (priv->buffer_timeout)
     g_source_remove(priv->buffer_timeout);
@@ -909,16 +1028,26 @@ cockpit_channel_send (CockpitChannel *self,
 
   if (!trust_is_utf8 && !priv->binary_ok)
     {
-      if (cockpit_unicode_has_incomplete_ending (send_data))
+      /* What one walk finds is all that's needed, here or when it's sent */
+      data = g_bytes_get_data (send_data, &length);
+      valid = cockpit_unicode_scan ((const gchar *)data, length, &tail);
+      if (tail > 0)
         {
           priv->out_buffer = g_bytes_ref (send_data);
           priv->buffer_timeout = g_timeout_add (500, flush_buffer, self);
         }
+      else
+        {
+          repaired = cockpit_unicode_repair (send_data, valid, tail);
+          trust_is_utf8 = TRUE;
+        }
     }
 
   if (!priv->buffer_timeout)
-    cockpit_channel_actual_send (self, send_data, trust_is_utf8);
+    cockpit_channel_actual_send (self, repaired ? repaired : send_data, trust_is_utf8);
 
+  if (repaired)
+    g_bytes_unref (repaired);
   if (send_data != payload)
     g_bytes_unref (send_data);
 }
@@ -976,6 +1105,43 @@ cockpit_channel_close_options (CockpitChannel *self)
   return priv->close_options;
 }
 
+/**
+ * cockpit_channel_get_flow_statistics:
+ * @self: a channel
+ * @window: (out) (allow-none): the current flow control window in bytes
+ * @min_rtt: (out) (allow-none): shortest recent ping round trip in microseconds
+ * @rate: (out) (allow-none): fastest recent acknowledge rate in bytes per second
+ *
+ * Get what flow control measured about the peer of this channel. The
+ * measurements are zero until enough "pong" replies have come back.
+ *
+ * Returns: %TRUE if the channel does flow control
+ */
+gboolean
+cockpit_channel_get_flow_statistics (CockpitChannel *self,
+                                     gint64 *window,
+                                     gint64 *min_rtt,
+                                     gint64 *rate)
+{
+  CockpitChannelPrivate *priv = cockpit_channel_get_instance_private (self);
+  guint i;
+
+  g_return_val_if_fail (COCKPIT_IS_CHANNEL (self), FALSE);
+
+  if (window)
+    *window = priv->flow_window;
+  if (min_rtt)
+    *min_rtt = priv->min_rtt;
+  if (rate)
+    {
+      *rate = 0;
+      for (i = 0; i < CHANNEL_FLOW_RATES; i++)
+        *rate = MAX (*rate, priv->rates[i]);
+    }
+
+  return priv->flow_control;
+}
+
 /**
  * cockpit_channel_get_id:
  * @self a channel
@@ -71,6 +71,11 @@ JsonObject *        cockpit_channel_get_options       (CockpitChannel *self);
 
 JsonObject *        cockpit_channel_close_options     (CockpitChannel *self);
 
+gboolean            cockpit_channel_get_flow_statistics (CockpitChannel *self,
+                                                         gint64 *window,
+                                                         gint64 *min_rtt,
+                                                         gint64 *rate);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_CHANNEL_H__ */
@@ -63,18 +63,19 @@ cockpit_channel_inject_update_checksum (CockpitChannelInject *inject,
   g_hash_table_remove (headers, COCKPIT_CHECKSUM_HEADER);
 }
 
-static void
-cockpit_channel_inject_perform (CockpitChannelInject *inject,
-                                CockpitWebResponse *response,
-                                CockpitTransport *transport)
+static const gchar inject_marker[] = "<head>";
+
+/* Returns the tags to put after <head>, or NULL if there are none */
+static GBytes *
+cockpit_channel_inject_build (CockpitChannelInject *inject,
+                              CockpitWebResponse *response)
 {
-  static const gchar *marker = "<head>";
   g_autofree gchar *prefixed_application = NULL;
 
   const gchar *url_root = cockpit_web_response_get_url_root (response);
 
   if (!url_root && !inject->base_path)
-    return;
+    return NULL;
 
   g_autoptr(GString) str = g_string_new ("");
   CockpitCreds *creds = cockpit_web_service_get_creds (inject->service);
@@ -91,8 +92,7 @@ cockpit_channel_inject_perform (CockpitChannelInject *inject,
     }
 
   {
-    const gboolean allow_multihost = cockpit_conf_bool ("WebService", "AllowMultiHost",
-                                                        ALLOW_MULTIHOST_DEFAULT);
+    const gboolean allow_multihost = cockpit_conf_snapshot ()->allow_multihost;
     g_string_append_printf (str, "\n    <meta name=\"allow-multihost\" content=\"%s\">",
                             allow_multihost ? "yes" : "no");
   }
@@ -113,9 +113,121 @@ cockpit_channel_inject_perform (CockpitChannelInject *inject,
         }
     }
 
-  g_autoptr(GBytes) content = g_string_free_to_bytes (g_steal_pointer(&str));
-  g_autoptr(CockpitWebFilter) filter = cockpit_web_inject_new (marker, content, 1);
-  cockpit_web_response_add_filter (response, filter);
+  return g_string_free_to_bytes (g_steal_pointer (&str));
+}
+
+static void
+cockpit_channel_inject_perform (CockpitChannelInject *inject,
+                                CockpitWebResponse *response,
+                                CockpitTransport *transport)
+{
+  g_autoptr(GBytes) content = cockpit_channel_inject_build (inject, response);
+
+  if (content)
+    {
+      g_autoptr(CockpitWebFilter) filter = cockpit_web_inject_new (inject_marker, content, 1);
+      cockpit_web_response_add_filter (response, filter);
+    }
+}
+
+/*
+ * Package resources addressed by checksum never change, so keep the
+ * ones the bridge sends us in memory, and serve them from here next
+ * time. This is shared by all sessions of this cockpit-ws, but the
+ * checksums are whatever a bridge announces, so entries are only ever
+ * served to the same user for the same host.
+ */
+
+#define RESOURCE_CACHE_MAX_SIZE  (32 * 1024 * 1024)
+#define RESOURCE_CACHE_MAX_ENTRY (RESOURCE_CACHE_MAX_SIZE / 16)
+
+typedef struct {
+  gchar *key;
+  GHashTable *headers;
+  GBytes *body;
+  gssize inject_at;
+  GList *link;
+} ResourceCacheEntry;
+
+static GHashTable *resource_cache;
+static GQueue resource_cache_lru = G_QUEUE_INIT;
+static gsize resource_cache_size;
+
+static void
+resource_cache_entry_free (gpointer data)
+{
+  ResourceCacheEntry *entry = data;
+
+  g_free (entry->key);
+  g_hash_table_unref (entry->headers);
+  g_bytes_unref (entry->body);
+  g_free (entry);
+}
+
+static ResourceCacheEntry *
+resource_cache_lookup (const gchar *key)
+{
+  ResourceCacheEntry *entry;
+
+  if (!resource_cache)
+    return NULL;
+
+  entry = g_hash_table_lookup (resource_cache, key);
+  if (entry)
+    {
+      /* Most recently used at the head */
+      g_queue_unlink (&resource_cache_lru, entry->link);
+      g_queue_push_head_link (&resource_cache_lru, entry->link);
+    }
+
+  return entry;
+}
+
+static void
+resource_cache_insert (gchar *key,
+                       GHashTable *headers,
+                       GBytes *body)
+{
+  ResourceCacheEntry *entry;
+  gsize size = g_bytes_get_size (body);
+
+  if (!resource_cache)
+    resource_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, resource_cache_entry_free);
+
+  /* Another request for the same resource may have beaten us to it */
+  if (g_hash_table_contains (resource_cache, key))
+    {
+      g_free (key);
+      return;
+    }
+
+  while (resource_cache_size + size > RESOURCE_CACHE_MAX_SIZE)
+    {
+      entry = g_queue_pop_tail (&resource_cache_lru);
+      g_assert (entry != NULL);
+      resource_cache_size -= g_bytes_get_size (entry->body);
+      g_hash_table_remove (resource_cache, entry->key);
+    }
+
+  entry = g_new0 (ResourceCacheEntry, 1);
+  entry->key = key;
+  entry->headers = g_hash_table_ref (headers);
+  entry->body = g_bytes_ref (body);
+
+  /* Find where injected tags go once, rather than on every response */
+  entry->inject_at = -1;
+  if (!g_hash_table_contains (headers, "Content-Encoding"))
+    {
+      const gchar *data = g_bytes_get_data (body, NULL);
+      const gchar *pos = memmem (data, size, inject_marker, strlen (inject_marker));
+      if (pos)
+        entry->inject_at = (pos - data) + strlen (inject_marker);
+    }
+  g_queue_push_head (&resource_cache_lru, entry);
+  entry->link = resource_cache_lru.head;
+  resource_cache_size += size;
+
+  g_hash_table_insert (resource_cache, entry->key, entry);
 }
 
 #define COCKPIT_TYPE_CHANNEL_RESPONSE  (cockpit_channel_response_get_type ())
@@ -135,6 +247,11 @@ typedef struct {
 
   /* Set when injecting data into response */
   CockpitChannelInject *inject;
+
+  /* Set when the response should go into the resource cache */
+  gchar *cache_key;
+  GHashTable *cache_headers;
+  GByteArray *cache_body;
 } CockpitChannelResponse;
 
 typedef struct {
@@ -159,6 +276,11 @@ cockpit_channel_response_finalize (GObject *object)
   g_object_unref (self->response);
   g_hash_table_unref (self->headers);
   cockpit_channel_inject_free (self->inject);
+  g_free (self->cache_key);
+  if (self->cache_headers)
+    g_hash_table_unref (self->cache_headers);
+  if (self->cache_body)
+    g_byte_array_unref (self->cache_body);
 
   G_OBJECT_CLASS (cockpit_channel_response_parent_class)->finalize (object);
 }
@@ -323,6 +445,14 @@ parse_httpstream_response (CockpitChannelResponse *self,
   return TRUE;
 }
 
+static void
+copy_header (gpointer key,
+             gpointer value,
+             gpointer user_data)
+{
+  g_hash_table_insert (user_data, g_strdup (key), g_strdup (value));
+}
+
 static void
 process_httpstream1_recv (CockpitChannelResponse *self,
                           GBytes *payload)
@@ -348,6 +478,14 @@ process_httpstream1_recv (CockpitChannelResponse *self,
     {
       if (!ensure_headers (self, status, reason, length))
         g_return_if_reached ();
+
+      /* Only whole, successful responses are cached */
+      if (self->cache_key && status == 200 && length <= RESOURCE_CACHE_MAX_ENTRY)
+        {
+          self->cache_headers = cockpit_web_server_new_table ();
+          g_hash_table_foreach (self->headers, copy_header, self->cache_headers);
+          self->cache_body = g_byte_array_sized_new (MAX (length, 0));
+        }
     }
   else
     {
@@ -373,6 +511,19 @@ cockpit_channel_response_recv (CockpitChannel *channel,
 
   ensure_headers (self, 200, "OK", -1);
   cockpit_web_response_queue (self->response, payload);
+
+  if (self->cache_body)
+    {
+      if (self->cache_body->len + g_bytes_get_size (payload) > RESOURCE_CACHE_MAX_ENTRY)
+        {
+          g_clear_pointer (&self->cache_body, g_byte_array_unref);
+        }
+      else
+        {
+          g_byte_array_append (self->cache_body, g_bytes_get_data (payload, NULL),
+                               g_bytes_get_size (payload));
+        }
+    }
 }
 
 static gboolean
@@ -415,6 +566,12 @@ cockpit_channel_response_control (CockpitChannel *channel,
     {
       ensure_headers (self, 200, "OK", 0);
       cockpit_web_response_complete (self->response);
+
+      if (self->cache_body)
+        {
+          g_autoptr(GBytes) body = g_byte_array_free_to_bytes (g_steal_pointer (&self->cache_body));
+          resource_cache_insert (g_steal_pointer (&self->cache_key), self->cache_headers, body);
+        }
       return TRUE;
     }
 
@@ -562,6 +719,45 @@ parse_host_and_etag (CockpitWebService *service,
   return TRUE;
 }
 
+static void
+serve_from_resource_cache (CockpitWebService *service,
+                           CockpitWebResponse *response,
+                           const gchar *host,
+                           ResourceCacheEntry *entry)
+{
+  CockpitChannelInject *inject;
+  g_autoptr(GBytes) content = NULL;
+  gsize length;
+
+  length = g_bytes_get_size (entry->body);
+  if (entry->inject_at >= 0)
+    {
+      inject = cockpit_channel_inject_new (service, NULL, host);
+      content = cockpit_channel_inject_build (inject, response);
+      cockpit_channel_inject_free (inject);
+    }
+
+  /* Splice in the injected tags at the known offset, no need to filter */
+  if (content)
+    {
+      g_autoptr(GBytes) before = g_bytes_new_from_bytes (entry->body, 0, entry->inject_at);
+      g_autoptr(GBytes) after = g_bytes_new_from_bytes (entry->body, entry->inject_at, length - entry->inject_at);
+
+      cockpit_web_response_headers_full (response, 200, "OK", length + g_bytes_get_size (content), entry->headers);
+      cockpit_web_response_queue (response, before);
+      cockpit_web_response_queue (response, content);
+      if (g_bytes_get_size (after) > 0)
+        cockpit_web_response_queue (response, after);
+    }
+  else
+    {
+      cockpit_web_response_headers_full (response, 200, "OK", length, entry->headers);
+      cockpit_web_response_queue (response, entry->body);
+    }
+
+  cockpit_web_response_complete (response);
+}
+
 void
 cockpit_channel_response_serve (CockpitWebService *service,
                                 GHashTable *in_headers,
@@ -575,7 +771,11 @@ cockpit_channel_response_serve (CockpitWebService *service,
   const gchar *injecting_base_path = NULL;
   const gchar *host = NULL;
   const gchar *pragma;
+  const gchar *range;
+  const gchar *if_range;
   gchar *quoted_etag = NULL;
+  gchar *cache_key = NULL;
+  ResourceCacheEntry *entry;
   GHashTable *out_headers = NULL;
   gchar *val = NULL;
   gboolean handled = FALSE;
@@ -583,7 +783,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
   JsonObject *object = NULL;
   JsonObject *heads;
   const gchar *protocol;
-  const gchar *http_host = "localhost";
+  const gchar *http_host;
   gchar *channel = NULL;
   gpointer key;
   gpointer value;
@@ -601,7 +801,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
       goto out;
     }
 
-  allow_multihost = cockpit_conf_bool ("WebService", "AllowMultiHost", ALLOW_MULTIHOST_DEFAULT);
+  allow_multihost = cockpit_conf_snapshot ()->allow_multihost;
   if (!allow_multihost && g_strcmp0 (host, "localhost") != 0)
     {
       cockpit_web_response_error (response, 403, NULL, NULL);
@@ -625,6 +825,41 @@ cockpit_channel_response_serve (CockpitWebService *service,
     }
 
   cockpit_web_response_set_cache_type (response, cache_type);
+
+  /* We only inject a <base> if root level request */
+  injecting_base_path = where ? NULL : path;
+
+  /* The HTTP scheme and host the package should assume are accessing things */
+  protocol = cockpit_web_response_get_protocol (response);
+  http_host = g_hash_table_lookup (in_headers, "Host") ?: "localhost";
+
+  /*
+   * Only resources addressed by checksum are cached, and only for the
+   * user and host the checksum was resolved for. The bridge picks a file
+   * by the whole Accept-Language and Accept-Encoding, not just the
+   * language in the ETag. It builds the Content-Security-Policy from the
+   * forwarded scheme and host, so responses for each of them are kept
+   * apart. None of these can contain a newline.
+   */
+  range = g_hash_table_lookup (in_headers, "Range");
+  if (quoted_etag && !injecting_base_path && !range)
+    {
+      cache_key = g_strdup_printf ("%s\n%s\n%s\n%s\n%s\n%s\n%s://%s",
+                                   cockpit_creds_get_user (cockpit_web_service_get_creds (service)) ?: "",
+                                   host, quoted_etag, path,
+                                   (gchar *)g_hash_table_lookup (in_headers, "Accept-Language") ?: "",
+                                   (gchar *)g_hash_table_lookup (in_headers, "Accept-Encoding") ?: "",
+                                   protocol, http_host);
+      entry = resource_cache_lookup (cache_key);
+      if (entry)
+        {
+          g_debug ("%s: serving from resource cache", path);
+          serve_from_resource_cache (service, response, host, entry);
+          handled = TRUE;
+          goto out;
+        }
+    }
+
   object = cockpit_transport_build_json ("command", "open",
                                          "payload", "http-stream1",
                                          "internal", "packages",
@@ -673,6 +908,7 @@ cockpit_channel_response_serve (CockpitWebService *service,
           g_ascii_strcasecmp (key, "Content-MD5") == 0 ||
           g_ascii_strcasecmp (key, "Content-Range") == 0 ||
           g_ascii_strcasecmp (key, "Range") == 0 ||
+          g_ascii_strcasecmp (key, "If-Range") == 0 ||
           g_ascii_strcasecmp (key, "TE") == 0 ||
           g_ascii_strcasecmp (key, "Trailer") == 0 ||
           g_ascii_strcasecmp (key, "Upgrade") == 0 ||
@@ -682,35 +918,38 @@ cockpit_channel_response_serve (CockpitWebService *service,
           g_ascii_strcasecmp (key, "X-Forwarded-Protocol") == 0)
         continue;
 
-      if (g_ascii_strcasecmp (key, "Host") == 0)
-        http_host = (gchar *) value;
-      else
+      if (g_ascii_strcasecmp (key, "Host") != 0)
         json_object_set_string_member (heads, key, value);
 
       g_free (val);
     }
 
-  /* Send along the HTTP scheme the package should assume is accessing things */
-  protocol = cockpit_web_response_get_protocol (response);
-
   json_object_set_string_member (heads, "Host", host);
   json_object_set_string_member (heads, "X-Forwarded-Proto", protocol);
   json_object_set_string_member (heads, "X-Forwarded-Host", http_host);
 
-  /* We only inject a <base> if root level request */
-  injecting_base_path = where ? NULL : path;
   if (injecting_base_path)
     {
       /* If we are injecting a <base> element, then we don't allow gzip compression */
       json_object_set_string_member (heads, "Accept-Encoding", "identity");
     }
 
+  /*
+   * Byte ranges are only forwarded when the body passes through unchanged.
+   * We are the ones who know the ETag, so we check If-Range here.
+   */
+  if_range = g_hash_table_lookup (in_headers, "If-Range");
+  if (range && !injecting_base_path && !cockpit_web_response_get_url_root (response) &&
+      (!if_range || g_strcmp0 (if_range, g_hash_table_lookup (out_headers, "ETag")) == 0))
+    json_object_set_string_member (heads, "Range", range);
+
   json_object_set_object_member (object, "headers", heads);
 
   self = cockpit_channel_response_new (service, response, transport,
                                        out_headers, object);
 
   self->inject = cockpit_channel_inject_new (service, injecting_base_path, host);
+  self->cache_key = g_steal_pointer (&cache_key);
   handled = TRUE;
 
   /* Unref when the channel closes */
@@ -720,6 +959,7 @@ out:
   if (object)
     json_object_unref (object);
   g_free (quoted_etag);
+  g_free (cache_key);
   if (out_headers)
     g_hash_table_unref (out_headers);
   g_free (channel);
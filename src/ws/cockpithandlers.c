@@ -214,19 +214,15 @@ cockpit_handler_external (CockpitWebServer *server,
 static void
 add_oauth_to_environment (JsonObject *environment)
 {
-  static const gchar *url;
+  const CockpitConfSnapshot *conf = cockpit_conf_snapshot ();
   JsonObject *object;
 
-  url = cockpit_conf_string ("OAuth", "URL");
-
-  if (url)
+  if (conf->oauth_url)
     {
       object = json_object_new ();
-      json_object_set_string_member (object, "URL", url);
-      json_object_set_string_member (object, "ErrorParam",
-                                     cockpit_conf_string ("oauth", "ErrorParam"));
-      json_object_set_string_member (object, "TokenParam",
-                                     cockpit_conf_string ("oauth", "TokenParam"));
+      json_object_set_string_member (object, "URL", conf->oauth_url);
+      json_object_set_string_member (object, "ErrorParam", conf->oauth_error_param);
+      json_object_set_string_member (object, "TokenParam", conf->oauth_token_param);
       json_object_set_object_member (environment, "OAuth", object);
   }
 }
@@ -253,17 +249,15 @@ static void
 add_page_to_environment (JsonObject *object,
                          gboolean    is_cockpit_client)
 {
+  const CockpitConfSnapshot *conf = cockpit_conf_snapshot ();
   static gint page_login_to = -1;
   gboolean require_host = FALSE;
-  gboolean allow_multihost;
   JsonObject *page;
-  const gchar *value;
 
   page = json_object_new ();
 
-  value = cockpit_conf_string ("WebService", "LoginTitle");
-  if (value)
-    json_object_set_string_member (page, "title", value);
+  if (conf->login_title)
+    json_object_set_string_member (page, "title", conf->login_title);
 
   if (page_login_to < 0)
     {
@@ -274,12 +268,11 @@ add_page_to_environment (JsonObject *object,
       page_login_to = cockpit_conf_bool ("WebService", "LoginTo", have_ssh);
     }
 
-  require_host = is_cockpit_client || cockpit_conf_bool ("WebService", "RequireHost", FALSE);
-  allow_multihost = cockpit_conf_bool ("WebService", "AllowMultiHost", ALLOW_MULTIHOST_DEFAULT);
+  require_host = is_cockpit_client || conf->require_host;
 
   json_object_set_boolean_member (page, "connect", page_login_to);
   json_object_set_boolean_member (page, "require_host", require_host);
-  json_object_set_boolean_member (page, "allow_multihost", allow_multihost);
+  json_object_set_boolean_member (page, "allow_multihost", conf->allow_multihost);
   json_object_set_object_member (object, "page", page);
 }
 
@@ -335,7 +328,7 @@ build_environment (CockpitAuth *auth, GHashTable *request_headers)
 
   object = json_object_new ();
 
-  gboolean is_cockpit_client = cockpit_conf_bool ("WebService", "X-For-CockpitClient", FALSE);
+  gboolean is_cockpit_client = cockpit_conf_snapshot ()->for_cockpit_client;
   json_object_set_boolean_member (object, "is_cockpit_client", is_cockpit_client);
 
   add_page_to_environment (object, is_cockpit_client);
@@ -357,7 +350,7 @@ build_environment (CockpitAuth *auth, GHashTable *request_headers)
   g_autoptr(GError) error = NULL;
   gsize len;
 
-  const gchar *banner = cockpit_conf_string ("Session", "Banner");
+  const gchar *banner = cockpit_conf_snapshot ()->banner;
   if (banner)
     {
       // TODO: parse macros (see `man agetty` for possible macros)
@@ -624,7 +617,7 @@ handle_shell (CockpitHandlerData *data,
     }
   else if (service)
     {
-      shell_path = cockpit_conf_string ("WebService", "Shell");
+      shell_path = cockpit_conf_snapshot ()->shell;
       cockpit_channel_response_serve (service, headers, response, NULL,
                                       shell_path ? shell_path : cockpit_ws_shell_component);
       cockpit_web_response_set_cache_type (response, COCKPIT_WEB_RESPONSE_NO_CACHE);
@@ -1553,6 +1553,43 @@ cockpit_pipe_consume (GByteArray *buffer,
   return bytes;
 }
 
+/**
+ * cockpit_pipe_take:
+ * @buffer: a data buffer
+ * @length: length of data to take
+ *
+ * Used to take a block of data, such as several complete
+ * frames, from the front of the buffer passed to the read signal.
+ *
+ * The memory of the buffer is handed over to the returned bytes
+ * without copying, so that callers can cheaply split the block up
+ * with g_bytes_new_from_bytes(). Only the data that remains in
+ * the @buffer, usually a partial frame, is copied.
+ *
+ * Returns: (transfer full): the taken bytes
+ */
+GBytes *
+cockpit_pipe_take (GByteArray *buffer,
+                   gsize length)
+{
+  gsize remaining;
+  guint8 *buf;
+
+  g_return_val_if_fail (buffer != NULL, NULL);
+  g_return_val_if_fail (length <= buffer->len, NULL);
+
+  remaining = buffer->len - length;
+
+  /* When array is reffed, this just clears byte array */
+  g_byte_array_ref (buffer);
+  buf = g_byte_array_free (buffer, FALSE);
+
+  if (remaining > 0)
+    g_byte_array_append (buffer, buf + length, remaining);
+
+  return g_bytes_new_take (buf, length);
+}
+
 /**
  * cockpit_pipe_skip:
  * @buffer: a data buffer
@@ -82,6 +82,9 @@ GBytes *           cockpit_pipe_consume      (GByteArray *buffer,
                                               gsize length,
                                               gsize after);
 
+GBytes *           cockpit_pipe_take         (GByteArray *buffer,
+                                              gsize length);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_PIPE_H__ */
@@ -27,6 +27,9 @@
 #include <string.h>
 #include <unistd.h>
 
+/* Smaller messages are copied rather than pinning the whole read buffer */
+#define SLICE_MIN_SIZE    4096
+
 /**
  * CockpitPipeTransport:
  *
@@ -40,6 +43,7 @@ struct _CockpitPipeTransport {
   gchar *name;
   CockpitPipe *pipe;
   gboolean closed;
+  gboolean binary_framing;
   gulong read_sig;
   gulong close_sig;
 };
@@ -215,7 +219,8 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
   GBytes *prefix;
-  gchar *prefix_str;
+  guchar *prefix_data;
+  gsize prefix_len;
   gsize payload_len;
   gsize channel_len;
 
@@ -228,10 +233,12 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
   channel_len = channel_id ? strlen (channel_id) : 0;
   payload_len = g_bytes_get_size (payload);
 
-  prefix_str = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
-                                channel_len + 1 + payload_len,
-                                channel_id ? channel_id : "");
-  prefix = g_bytes_new_take (prefix_str, strlen (prefix_str));
+  prefix_data = g_malloc (COCKPIT_FRAME_HEADER_MAX + channel_len + 1);
+  prefix_len = cockpit_frame_header (prefix_data, channel_len + 1 + payload_len, self->binary_framing);
+  memcpy (prefix_data + prefix_len, channel_id ? channel_id : "", channel_len);
+  prefix_len += channel_len;
+  prefix_data[prefix_len++] = '\n';
+  prefix = g_bytes_new_take (prefix_data, prefix_len);
 
   cockpit_pipe_write (self->pipe, prefix);
   cockpit_pipe_write (self->pipe, payload);
@@ -319,6 +326,23 @@ cockpit_pipe_transport_get_pipe (CockpitPipeTransport *self)
   return self->pipe;
 }
 
+/**
+ * cockpit_pipe_transport_set_binary_framing:
+ * @self: the transport
+ * @binary_framing: whether to send binary frames
+ *
+ * Switch the frames we send to the binary length prefix. Only do
+ * this once the other side has said it understands that. Incoming
+ * frames are always accepted in either form.
+ */
+void
+cockpit_pipe_transport_set_binary_framing (CockpitPipeTransport *self,
+                                           gboolean binary_framing)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self));
+  self->binary_framing = binary_framing;
+}
+
 /**
  * cockpit_transport_read_from_pipe:
  *
@@ -334,14 +358,18 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
                                   GByteArray *input,
                                   gboolean end_of_data)
 {
+  gboolean invalid = FALSE;
+  gsize complete = 0;
+
   /* This may be updated during the loop. */
   g_assert (closed != NULL);
   g_object_ref (self);
 
-  while (!*closed)
+  /* Find all the complete frames at the front of the buffer */
+  for (;;)
     {
       gsize i;
-      gssize size = cockpit_frame_parse (input->data, input->len, &i);
+      gssize size = cockpit_frame_parse (input->data + complete, input->len - complete, &i);
 
       if (size == 0)
         {
@@ -351,26 +379,60 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
         }
       else if (size < 0)
         {
-          g_warning ("%s: incorrect protocol: received invalid length prefix", logname);
-          cockpit_pipe_close (pipe, "protocol-error");
+          invalid = TRUE;
           break;
         }
-      else if (input->len < i + size)
+      else if (input->len - complete < i + size)
         {
           g_debug ("%s: want more data 2", logname);
           break;
         }
 
-      g_autoptr(GBytes) message = cockpit_pipe_consume (input, i, size, 0);
-      g_autofree gchar *channel = NULL;
-      g_autoptr(GBytes) payload = cockpit_transport_parse_frame (message, &channel);
-      if (payload)
+      complete += i + size;
+    }
+
+  /*
+   * Take them out of the buffer in one go. Large messages are views into
+   * that block, which avoids copying each one and moving the rest of
+   * the buffer along every time. Small ones are copied: they may sit in
+   * a WebSocket queue for a while, and a view would keep the whole read
+   * buffer allocated for each of them.
+   */
+  if (complete > 0)
+    {
+      g_autoptr(GBytes) block = cockpit_pipe_take (input, complete);
+      guchar *data = (guchar *)g_bytes_get_data (block, NULL);
+      gsize offset = 0;
+
+      while (offset < complete && !*closed)
         {
-          g_debug ("%s: received a %d byte payload", logname, (int)size);
-          cockpit_transport_emit_recv (self, channel, payload);
+          gsize i;
+          gssize size = cockpit_frame_parse (data + offset, complete - offset, &i);
+          g_assert (size > 0);
+
+          g_autoptr(GBytes) message = NULL;
+          if (size >= SLICE_MIN_SIZE)
+            message = g_bytes_new_from_bytes (block, offset + i, size);
+          else
+            message = g_bytes_new (data + offset + i, size);
+          offset += i + size;
+
+          g_autofree gchar *channel = NULL;
+          g_autoptr(GBytes) payload = cockpit_transport_parse_frame (message, &channel);
+          if (payload)
+            {
+              g_debug ("%s: received a %d byte payload", logname, (int)size);
+              cockpit_transport_emit_recv (self, channel, payload);
+            }
         }
     }
 
+  if (invalid && !*closed)
+    {
+      g_warning ("%s: incorrect protocol: received invalid length prefix", logname);
+      cockpit_pipe_close (pipe, "protocol-error");
+    }
+
   if (end_of_data)
     {
       /* Received a partial message */
@@ -24,6 +24,9 @@ CockpitTransport * cockpit_pipe_transport_new_fds    (const gchar *name,
 
 CockpitPipe *      cockpit_pipe_transport_get_pipe   (CockpitPipeTransport *self);
 
+void               cockpit_pipe_transport_set_binary_framing (CockpitPipeTransport *self,
+                                                              gboolean binary_framing);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_PIPE_TRANSPORT_H__ */
@@ -334,39 +334,47 @@ cockpit_transport_thaw (CockpitTransport *self,
   g_free (stolen);
 }
 
-static GBytes *
-parse_frame (GBytes *message,
-             gchar **channel)
+/**
+ * cockpit_transport_parse_frame_span:
+ * @message: message to parse
+ * @channel: location to return the start of the channel
+ * @channel_len: location to return the length of the channel
+ *
+ * Parse a message into a channel and payload without copying
+ * anything. @channel points into the data of @message and is
+ * not nul terminated. @channel_len will be zero if a control
+ * channel message. The payload follows at @channel_len + 1.
+ *
+ * Returns: FALSE if invalid message.
+ */
+gboolean
+cockpit_transport_parse_frame_span (GBytes *message,
+                                    const gchar **channel,
+                                    gsize *channel_len)
 {
   const gchar *data;
   gsize length;
   const gchar *line;
-  gsize channel_len;
 
-  g_return_val_if_fail (message != NULL, NULL);
+  g_return_val_if_fail (message != NULL, FALSE);
 
   data = g_bytes_get_data (message, &length);
   line = memchr (data, '\n', length);
   if (!line)
     {
       g_message ("received invalid message without channel prefix");
-      return NULL;
+      return FALSE;
     }
 
-  channel_len = line - data;
-  if (memchr (data, '\0', channel_len) != NULL)
+  if (memchr (data, '\0', line - data) != NULL)
     {
       g_message ("received massage with invalid channel prefix");
-      return NULL;
+      return FALSE;
     }
 
-  if (channel_len)
-    *channel = g_strndup (data, channel_len);
-  else
-    *channel = NULL;
-
-  channel_len++;
-  return g_bytes_new_from_bytes (message, channel_len, length - channel_len);
+  *channel = data;
+  *channel_len = line - data;
+  return TRUE;
 }
 
 /**
@@ -386,7 +394,19 @@ GBytes *
 cockpit_transport_parse_frame (GBytes *message,
                                gchar **channel)
 {
-  return parse_frame (message, channel);
+  const gchar *data;
+  gsize channel_len;
+
+  if (!cockpit_transport_parse_frame_span (message, &data, &channel_len))
+    return NULL;
+
+  if (channel_len)
+    *channel = g_strndup (data, channel_len);
+  else
+    *channel = NULL;
+
+  channel_len++;
+  return g_bytes_new_from_bytes (message, channel_len, g_bytes_get_size (message) - channel_len);
 }
 
 /**
@@ -78,6 +78,10 @@ void        cockpit_transport_thaw           (CockpitTransport *transport,
 GBytes *    cockpit_transport_parse_frame    (GBytes *message,
                                               gchar **channel);
 
+gboolean    cockpit_transport_parse_frame_span (GBytes *message,
+                                                const gchar **channel,
+                                                gsize *channel_len);
+
 gboolean    cockpit_transport_parse_command  (GBytes *payload,
                                               const gchar **command,
                                               const gchar **channel,
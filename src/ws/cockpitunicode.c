@@ -13,29 +13,217 @@
 
 #include "cockpitunicode.h"
 
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/*
+ * Skip over a run of ASCII, which is most of what goes through here. Like
+ * g_utf8_validate() we treat NUL bytes as invalid, so those stop the run too.
+ * This may stop a bit early; the caller continues one character at a time.
+ */
+static gsize
+skip_ascii (const guchar *data,
+            gsize length)
+{
+  gsize i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128 ();
+  for (; i + 16 <= length; i += 16)
+    {
+      __m128i block = _mm_loadu_si128 ((const __m128i *)(data + i));
+      /* Sets the high bit of NUL bytes, so one mask catches both */
+      if (_mm_movemask_epi8 (_mm_or_si128 (block, _mm_cmpeq_epi8 (block, zero))))
+        break;
+    }
+#elif defined(HAVE_NEON)
+  for (; i + 16 <= length; i += 16)
+    {
+      uint8x16_t block = vld1q_u8 (data + i);
+      if (vmaxvq_u8 (block) >= 0x80 || vminvq_u8 (block) == 0)
+        break;
+    }
+#endif
+
+  for (; i + 8 <= length; i += 8)
+    {
+      guint64 word;
+      memcpy (&word, data + i, sizeof (word));
+      if ((word & 0x8080808080808080ULL) ||
+          ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL))
+        break;
+    }
+
+  return i;
+}
+
+/* Returns the length of the valid character at @data, or zero */
+static gsize
+char_length (const guchar *data,
+             gsize length)
+{
+  guchar c = data[0];
+  guchar lower = 0x80;
+  guchar upper = 0xBF;
+
+  if (c >= 0x01 && c < 0x80)
+    return 1;
+
+  if (c >= 0xC2 && c <= 0xDF)
+    {
+      if (length >= 2 && (data[1] & 0xC0) == 0x80)
+        return 2;
+    }
+  else if (c >= 0xE0 && c <= 0xEF)
+    {
+      /* No overlong forms, no surrogates */
+      if (c == 0xE0)
+        lower = 0xA0;
+      else if (c == 0xED)
+        upper = 0x9F;
+      if (length >= 3 && data[1] >= lower && data[1] <= upper &&
+          (data[2] & 0xC0) == 0x80)
+        return 3;
+    }
+  else if (c >= 0xF0 && c <= 0xF4)
+    {
+      /* No overlong forms, nothing above U+10FFFF */
+      if (c == 0xF0)
+        lower = 0x90;
+      else if (c == 0xF4)
+        upper = 0x8F;
+      if (length >= 4 && data[1] >= lower && data[1] <= upper &&
+          (data[2] & 0xC0) == 0x80 && (data[3] & 0xC0) == 0x80)
+        return 4;
+    }
+
+  return 0;
+}
+
+/**
+ * cockpit_unicode_valid_length:
+ * @data: the data to check
+ * @length: the length of @data
+ *
+ * Check how much of @data is valid UTF-8. This accepts the same
+ * input as g_utf8_validate(), including treating NUL as invalid,
+ * but gets through runs of ASCII a block at a time.
+ *
+ * Returns: the length of the valid start of @data, equal to @length
+ *          if all of it is valid
+ */
+gsize
+cockpit_unicode_valid_length (const gchar *data,
+                              gsize length)
+{
+  const guchar *bytes = (const guchar *)data;
+  gsize offset = 0;
+  gsize n;
+
+  while (offset < length)
+    {
+      offset += skip_ascii (bytes + offset, length - offset);
+
+      /* Go one character at a time until the next ASCII one */
+      while (offset < length)
+        {
+          n = char_length (bytes + offset, length - offset);
+          if (n == 0)
+            return offset;
+          offset += n;
+          if (n == 1)
+            break;
+        }
+    }
+
+  return offset;
+}
+
+/**
+ * cockpit_unicode_scan:
+ * @data: the data to check
+ * @length: the length of @data
+ * @tail: (out): the number of invalid bytes at the end of @data
+ *
+ * Check all of @data in a single walk. Invalid bytes are skipped one
+ * at a time, in the same way that cockpit_unicode_repair() replaces
+ * them. A non-zero @tail means the data ends with some of those,
+ * possibly the start of a character that is yet to be completed.
+ *
+ * Returns: the length of the valid start of @data, equal to @length
+ *          if all of it is valid
+ */
+gsize
+cockpit_unicode_scan (const gchar *data,
+                      gsize length,
+                      gsize *tail)
+{
+  const guchar *bytes = (const guchar *)data;
+  gsize valid = length;
+  gsize good_end = 0;
+  gsize offset = 0;
+  gsize n;
+
+  while (offset < length)
+    {
+      n = skip_ascii (bytes + offset, length - offset);
+      if (n > 0)
+        good_end = offset += n;
+
+      while (offset < length)
+        {
+          n = char_length (bytes + offset, length - offset);
+          if (n == 0)
+            {
+              if (valid == length)
+                valid = offset;
+              offset++;
+              continue;
+            }
+          good_end = offset += n;
+          if (n == 1)
+            break;
+        }
+    }
+
+  *tail = length - good_end;
+  return valid;
+}
+
 gboolean
 cockpit_unicode_has_incomplete_ending (GBytes *input)
 {
   const gchar *data;
-  const gchar *end;
   gsize length;
+  gsize tail;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
-    return FALSE;
-
-  do
-    {
-      length -= (end - data) + 1;
-      data = end + 1;
-    }
-  while (!g_utf8_validate (data, length, &end));
-
-  return length == 0;
+  cockpit_unicode_scan (data, length, &tail);
+  return tail > 0;
 }
 
+/**
+ * cockpit_unicode_repair:
+ * @input: the data to repair
+ * @valid: the length of the valid start of @input
+ * @tail: the number of invalid bytes at its end
+ *
+ * Replace the invalid bytes in @input with U+FFFD, given what
+ * cockpit_unicode_scan() found. Neither the valid start nor the
+ * invalid end are looked at again.
+ *
+ * Returns: (transfer full): the repaired data, or @input if valid
+ */
 GBytes *
-cockpit_unicode_force_utf8 (GBytes *input)
+cockpit_unicode_repair (GBytes *input,
+                        gsize valid,
+                        gsize tail)
 {
   const gchar *data;
   const gchar *end;
@@ -43,26 +231,40 @@ cockpit_unicode_force_utf8 (GBytes *input)
   GString *string;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
+  g_return_val_if_fail (valid <= length - tail, NULL);
+
+  if (valid == length)
     return g_bytes_ref (input);
 
   string = g_string_sized_new (length + 16);
-  do
+  end = data + length - tail;
+  for (;;)
     {
       /* Valid part of the string */
-      g_string_append_len (string, data, end - data);
+      g_string_append_len (string, data, valid);
+      data += valid;
+      if (data == end)
+        break;
 
       /* Replacement character */
       g_string_append (string, "\xef\xbf\xbd");
 
-      length -= (end - data) + 1;
-      data = end + 1;
+      data++;
+      valid = cockpit_unicode_valid_length (data, end - data);
     }
-  while (!g_utf8_validate (data, length, &end));
 
-  if (length)
-    g_string_append_len (string, data, length);
+  while (tail-- > 0)
+    g_string_append (string, "\xef\xbf\xbd");
 
   return g_string_free_to_bytes (string);
 }
 
+GBytes *
+cockpit_unicode_force_utf8 (GBytes *input)
+{
+  const gchar *data;
+  gsize length;
+
+  data = g_bytes_get_data (input, &length);
+  return cockpit_unicode_repair (input, cockpit_unicode_valid_length (data, length), 0);
+}
@@ -10,6 +10,17 @@
 
 G_BEGIN_DECLS
 
+gsize         cockpit_unicode_valid_length  (const gchar *data,
+                                             gsize length);
+
+gsize         cockpit_unicode_scan          (const gchar *data,
+                                             gsize length,
+                                             gsize *tail);
+
+GBytes *      cockpit_unicode_repair        (GBytes *input,
+                                             gsize valid,
+                                             gsize tail);
+
 GBytes *      cockpit_unicode_force_utf8    (GBytes *input);
 
 gboolean      cockpit_unicode_has_incomplete_ending (GBytes *input);
@@ -2,6 +2,21 @@
 #pragma once
 
 #include "cockpitwebserver.h"
+#include "websocket.h"
+
+#define COCKPIT_WEB_REQUEST_MAX_HEADERS 128
+
+/* Headers which are looked up for most requests */
+enum {
+  COCKPIT_WEB_REQUEST_HOST,
+  COCKPIT_WEB_REQUEST_COOKIE,
+  COCKPIT_WEB_REQUEST_ACCEPT_ENCODING,
+  COCKPIT_WEB_REQUEST_UPGRADE,
+  COCKPIT_WEB_REQUEST_IF_NONE_MATCH,
+  COCKPIT_WEB_REQUEST_CONNECTION,
+  COCKPIT_WEB_REQUEST_CONTENT_LENGTH,
+  COCKPIT_WEB_REQUEST_N_WELL_KNOWN
+};
 
 struct _CockpitWebRequest {
   int state;
@@ -13,6 +28,15 @@ struct _CockpitWebRequest {
   GSource *source;
   GSource *timeout;
   gboolean check_tls_redirect;
+  gboolean no_keep_alive;
+  guint count;
+
+  /* Parsed headers point into the buffer until it is consumed */
+  gsize scanned;
+  gsize consumed;
+  WebSocketHeaderSpan header_spans[COCKPIT_WEB_REQUEST_MAX_HEADERS];
+  gsize n_header_spans;
+  const gchar *well_known[COCKPIT_WEB_REQUEST_N_WELL_KNOWN];
 
   GHashTable *headers;
   const gchar *original_path;
@@ -21,8 +21,15 @@
 #include "cockpittemplate.h"
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
 
 /**
  * CockpitWebResponse:
@@ -64,6 +71,13 @@ struct _CockpitWebResponse {
   gboolean done;
   gboolean chunked;
   gboolean keep_alive;
+  gboolean accept_gzip;
+
+  /* Conditional and range request headers */
+  gchar *if_none_match;
+  gint64 if_modified_since;
+  gchar *range;
+  gchar *if_range;
 
   GList *filters;
 };
@@ -84,6 +98,7 @@ cockpit_web_response_init (CockpitWebResponse *self)
   self->queue = g_queue_new ();
   self->out_queueable = G_MAXSIZE;
   self->cache_type = COCKPIT_WEB_RESPONSE_CACHE_UNSET;
+  self->if_modified_since = -1;
 }
 
 static void
@@ -146,6 +161,9 @@ cockpit_web_response_finalize (GObject *object)
   g_free (self->url_root);
   g_free (self->method);
   g_free (self->origin);
+  g_free (self->if_none_match);
+  g_free (self->range);
+  g_free (self->if_range);
   g_assert (self->io == NULL);
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
@@ -168,6 +186,102 @@ cockpit_web_response_class_init (CockpitWebResponseClass *klass)
                                G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
 }
 
+static gboolean
+accepts_content_coding (const gchar *header,
+                        const gchar *coding)
+{
+  g_auto(GStrv) parts = NULL;
+  gchar *name;
+  gchar *params;
+  gint i;
+
+  if (!header)
+    return FALSE;
+
+  parts = g_strsplit (header, ",", -1);
+  for (i = 0; parts[i] != NULL; i++)
+    {
+      name = parts[i];
+      params = strchr (name, ';');
+      if (params)
+        *(params++) = '\0';
+
+      name = g_strstrip (name);
+      if (g_ascii_strcasecmp (name, coding) != 0)
+        continue;
+
+      /* A quality of zero means "not acceptable" */
+      if (params)
+        {
+          params = g_strstrip (params);
+          if (g_ascii_strncasecmp (params, "q=", 2) == 0 &&
+              g_ascii_strtod (params + 2, NULL) == 0.0)
+            return FALSE;
+        }
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static const gchar *const http_days[] = {
+  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+static const gchar *const http_months[] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* Formats an IMF-fixdate, independent of the locale */
+static gchar *
+format_http_date (gint64 when)
+{
+  g_autoptr(GDateTime) date = g_date_time_new_from_unix_utc (when);
+
+  if (!date)
+    return NULL;
+
+  return g_strdup_printf ("%s, %02d %s %04d %02d:%02d:%02d GMT",
+                          http_days[g_date_time_get_day_of_week (date) % 7],
+                          g_date_time_get_day_of_month (date),
+                          http_months[g_date_time_get_month (date) - 1],
+                          g_date_time_get_year (date),
+                          g_date_time_get_hour (date),
+                          g_date_time_get_minute (date),
+                          g_date_time_get_second (date));
+}
+
+/* Parses an IMF-fixdate, the only format we ever send. Returns -1 on failure */
+static gint64
+parse_http_date (const gchar *value)
+{
+  g_autoptr(GDateTime) date = NULL;
+  gchar weekday[4];
+  gchar month[4];
+  gint day, year, hour, minute, second;
+  gint i;
+
+  if (!value ||
+      sscanf (value, "%3s, %2d %3s %4d %2d:%2d:%2d GMT",
+              weekday, &day, month, &year, &hour, &minute, &second) != 7)
+    return -1;
+
+  for (i = 0; i < G_N_ELEMENTS (http_months); i++)
+    {
+      if (g_str_equal (month, http_months[i]))
+        break;
+    }
+  if (i == G_N_ELEMENTS (http_months))
+    return -1;
+
+  date = g_date_time_new_utc (year, i + 1, day, hour, minute, second);
+  if (!date)
+    return -1;
+
+  return g_date_time_to_unix (date);
+}
+
 /**
  * cockpit_web_response_new:
  * @io: the stream to send on
@@ -243,6 +357,11 @@ cockpit_web_response_new (GIOStream *io,
       if (connection)
         self->keep_alive = g_str_equal (connection, "keep-alive");
       host = g_hash_table_lookup (in_headers, "Host");
+      self->accept_gzip = accepts_content_coding (g_hash_table_lookup (in_headers, "Accept-Encoding"), "gzip");
+      self->if_none_match = g_strdup (g_hash_table_lookup (in_headers, "If-None-Match"));
+      self->if_modified_since = parse_http_date (g_hash_table_lookup (in_headers, "If-Modified-Since"));
+      self->range = g_strdup (g_hash_table_lookup (in_headers, "Range"));
+      self->if_range = g_strdup (g_hash_table_lookup (in_headers, "If-Range"));
     }
 
   self->protocol = g_strdup (protocol ?: "http");
@@ -828,7 +947,7 @@ finish_headers (CockpitWebResponse *self,
         }
     }
 
-  if ((seen & HEADER_CACHE_CONTROL) == 0 && status >= 200 && status <= 299)
+  if ((seen & HEADER_CACHE_CONTROL) == 0 && ((status >= 200 && status <= 299) || status == 304))
     {
       if (self->cache_type == COCKPIT_WEB_RESPONSE_NO_CACHE)
         g_string_append (string, "Cache-Control: no-cache, no-store\r\n");
@@ -836,7 +955,7 @@ finish_headers (CockpitWebResponse *self,
         g_string_append (string, "Cache-Control: max-age=86400, private\r\n");
     }
 
-  if ((seen & HEADER_VARY) == 0 && status >= 200 && status <= 299 &&
+  if ((seen & HEADER_VARY) == 0 && ((status >= 200 && status <= 299) || status == 304) &&
       self->cache_type == COCKPIT_WEB_RESPONSE_CACHE)
     {
       g_string_append (string, "Vary: Cookie\r\n");
@@ -877,6 +996,23 @@ cockpit_web_response_set_cache_type (CockpitWebResponse *self,
   self->cache_type = cache_type;
 }
 
+/**
+ * cockpit_web_response_set_keep_alive:
+ * @self: the response
+ * @keep_alive: whether the connection may be reused
+ *
+ * Must be called before the headers are sent. A response to a
+ * request that asked for "Connection: close" is never kept alive.
+ */
+void
+cockpit_web_response_set_keep_alive (CockpitWebResponse *self,
+                                     gboolean keep_alive)
+{
+  g_return_if_fail (COCKPIT_IS_WEB_RESPONSE (self));
+  g_return_if_fail (self->count == 0);
+  self->keep_alive = self->keep_alive && keep_alive;
+}
+
 /**
  * cockpit_web_response_headers:
  * @self: the response
@@ -1254,6 +1390,509 @@ cockpit_web_response_resolve_roots (const gchar **input)
   return (gchar **)g_ptr_array_free (roots, FALSE);
 }
 
+/*
+ * A per-process cache of the static files served by web_response_file().
+ *
+ * Each entry holds a copy of the file contents, a lazily built gzip variant,
+ * a strong ETag and the modification time. Before looking for a file we
+ * place inotify watches on the directories it could be found in, and any
+ * change in those directories drops the entries that depend on them.
+ * Pending events are read before each lookup, so a cache hit involves no
+ * file system access at all.
+ */
+
+typedef struct {
+  GBytes *body;
+  GBytes *gzipped;
+  gboolean is_gzip;
+  gboolean compressible;
+  gboolean gzip_checked;
+  gchar *etag;
+  gchar *gzip_etag;
+  gint64 mtime;
+} CachedFile;
+
+#define FILE_CACHE_MAX_ENTRIES 256
+#define FILE_CACHE_MAX_SIZE (8 * 1024 * 1024)
+#define FILE_CACHE_GZIP_MIN_SIZE 256
+
+#define FILE_CACHE_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                           IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static struct {
+  gboolean initialized;
+  gint inotify_fd;
+  GHashTable *entries;   /* key -> CachedFile */
+  GHashTable *watches;   /* watch descriptor -> set of keys */
+} file_cache;
+
+static void
+cached_file_free (gpointer data)
+{
+  CachedFile *cached = data;
+  g_bytes_unref (cached->body);
+  if (cached->gzipped)
+    g_bytes_unref (cached->gzipped);
+  g_free (cached->etag);
+  g_free (cached->gzip_etag);
+  g_free (cached);
+}
+
+static gboolean
+file_cache_init (void)
+{
+  if (!file_cache.initialized)
+    {
+      file_cache.initialized = TRUE;
+      file_cache.inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+      if (file_cache.inotify_fd < 0)
+        {
+          g_debug ("couldn't initialize inotify, not caching files: %m");
+        }
+      else
+        {
+          file_cache.entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free, cached_file_free);
+          file_cache.watches = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                      NULL, (GDestroyNotify)g_hash_table_unref);
+        }
+    }
+
+  return file_cache.inotify_fd >= 0;
+}
+
+static void
+file_cache_clear (void)
+{
+  g_hash_table_remove_all (file_cache.entries);
+  g_hash_table_remove_all (file_cache.watches);
+}
+
+static void
+file_cache_process_events (void)
+{
+  gchar buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *event;
+  GHashTableIter iter;
+  GHashTable *keys;
+  gpointer key;
+  gssize len;
+  gchar *p;
+
+  for (;;)
+    {
+      len = read (file_cache.inotify_fd, buffer, sizeof (buffer));
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN)
+            {
+              g_warning ("couldn't read file change notifications: %m");
+              file_cache_clear ();
+            }
+          break;
+        }
+      else if (len == 0)
+        {
+          break;
+        }
+
+      for (p = buffer; p < buffer + len; )
+        {
+          event = (const struct inotify_event *)p;
+          p += sizeof (struct inotify_event) + event->len;
+
+          if (event->mask & IN_Q_OVERFLOW)
+            {
+              g_debug ("missed file change notifications, clearing file cache");
+              file_cache_clear ();
+              continue;
+            }
+
+          keys = g_hash_table_lookup (file_cache.watches, GINT_TO_POINTER (event->wd));
+          if (keys)
+            {
+              g_hash_table_iter_init (&iter, keys);
+              while (g_hash_table_iter_next (&iter, &key, NULL))
+                {
+                  if (g_hash_table_remove (file_cache.entries, key))
+                    g_debug ("%s: dropping cached file", (const gchar *)key);
+                }
+              g_hash_table_remove (file_cache.watches, GINT_TO_POINTER (event->wd));
+            }
+        }
+    }
+}
+
+static gboolean
+file_cache_watch_dir (const gchar *key,
+                      const gchar *directory)
+{
+  g_autofree gchar *dir = g_strdup (directory);
+  GHashTable *keys;
+  gchar *parent;
+  gint wd;
+
+  /* Watch the closest directory that exists, so we notice when it gets created */
+  for (;;)
+    {
+      wd = inotify_add_watch (file_cache.inotify_fd, dir, FILE_CACHE_EVENTS);
+      if (wd >= 0)
+        break;
+
+      parent = g_path_get_dirname (dir);
+      if ((errno != ENOENT && errno != ENOTDIR) || g_str_equal (parent, dir))
+        {
+          g_debug ("%s: couldn't watch directory: %m", dir);
+          g_free (parent);
+          return FALSE;
+        }
+
+      g_free (dir);
+      dir = parent;
+    }
+
+  keys = g_hash_table_lookup (file_cache.watches, GINT_TO_POINTER (wd));
+  if (!keys)
+    {
+      keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (file_cache.watches, GINT_TO_POINTER (wd), keys);
+    }
+  if (!g_hash_table_contains (keys, key))
+    g_hash_table_add (keys, g_strdup (key));
+
+  return TRUE;
+}
+
+static gboolean
+file_cache_watch (const gchar *key,
+                  const gchar **roots,
+                  const gchar *unescaped)
+{
+  gint i;
+
+  /* Start over rather than growing without bounds */
+  if (g_hash_table_size (file_cache.entries) >= FILE_CACHE_MAX_ENTRIES)
+    file_cache_clear ();
+
+  for (i = 0; roots[i]; i++)
+    {
+      g_autofree gchar *path = g_build_filename (roots[i], unescaped, NULL);
+      g_autofree gchar *dir = g_path_get_dirname (path);
+      if (!file_cache_watch_dir (key, dir))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+is_compressible (const gchar *path)
+{
+  const gchar *content_type = cockpit_web_response_content_type (path);
+
+  return content_type && (g_str_has_prefix (content_type, "text/") ||
+                          g_str_equal (content_type, "application/javascript") ||
+                          g_str_equal (content_type, "application/json") ||
+                          g_str_equal (content_type, "image/svg+xml"));
+}
+
+static CachedFile *
+file_cache_insert (const gchar *key,
+                   const gchar *path,
+                   const gchar *unescaped,
+                   GBytes *body,
+                   gboolean is_gzip)
+{
+  g_autofree gchar *checksum = NULL;
+  CachedFile *cached;
+  gboolean ret = FALSE;
+  struct stat st;
+  gchar *real;
+
+  if (g_bytes_get_size (body) > FILE_CACHE_MAX_SIZE)
+    return NULL;
+
+  /* Files reached through symlinks also change along with their target */
+  real = realpath (path, NULL);
+  if (real && stat (real, &st) == 0)
+    {
+      if (g_str_equal (real, path))
+        {
+          ret = TRUE;
+        }
+      else
+        {
+          g_autofree gchar *dir = g_path_get_dirname (real);
+          ret = file_cache_watch_dir (key, dir);
+        }
+    }
+  free (real);
+
+  if (!ret)
+    return NULL;
+
+  cached = g_new0 (CachedFile, 1);
+
+  /*
+   * Keep a copy rather than the mapping: a file truncated in place
+   * would otherwise SIGBUS us the next time it is served from here.
+   */
+  cached->body = g_bytes_new (g_bytes_get_data (body, NULL), g_bytes_get_size (body));
+  checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, cached->body);
+
+  cached->is_gzip = is_gzip;
+  cached->compressible = !is_gzip && is_compressible (unescaped) &&
+                         g_bytes_get_size (body) >= FILE_CACHE_GZIP_MIN_SIZE;
+  cached->etag = g_strdup_printf ("\"%s\"", checksum);
+  cached->gzip_etag = g_strdup_printf ("\"%s-gzip\"", checksum);
+  cached->mtime = st.st_mtime;
+
+  g_hash_table_replace (file_cache.entries, g_strdup (key), cached);
+  return cached;
+}
+
+static GBytes *
+gzip_bytes (GBytes *input)
+{
+  z_stream zs = { 0, };
+  gconstpointer data;
+  guchar *output;
+  gsize length;
+  gsize bound;
+  gsize size;
+  gint ret;
+
+  if (deflateInit2 (&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  data = g_bytes_get_data (input, &length);
+  bound = deflateBound (&zs, length);
+  output = g_malloc (bound);
+
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = length;
+  zs.next_out = output;
+  zs.avail_out = bound;
+
+  ret = deflate (&zs, Z_FINISH);
+  size = zs.total_out;
+  deflateEnd (&zs);
+
+  if (ret != Z_STREAM_END)
+    {
+      g_free (output);
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_realloc (output, size), size);
+}
+
+static GBytes *
+cached_file_get_gzipped (CachedFile *cached)
+{
+  if (!cached->gzip_checked)
+    {
+      cached->gzip_checked = TRUE;
+      cached->gzipped = gzip_bytes (cached->body);
+
+      /* Not worth it */
+      if (cached->gzipped && g_bytes_get_size (cached->gzipped) >= g_bytes_get_size (cached->body))
+        g_clear_pointer (&cached->gzipped, g_bytes_unref);
+    }
+
+  return cached->gzipped;
+}
+
+static gboolean
+etag_list_matches (const gchar *header,
+                   const gchar *etag)
+{
+  g_auto(GStrv) tags = g_strsplit (header, ",", -1);
+  const gchar *tag;
+  gint i;
+
+  for (i = 0; tags[i] != NULL; i++)
+    {
+      tag = g_strstrip (tags[i]);
+      if (g_str_equal (tag, "*"))
+        return TRUE;
+
+      /* If-None-Match uses the weak comparison */
+      if (g_str_has_prefix (tag, "W/"))
+        tag += 2;
+      if (g_str_equal (tag, etag))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+response_not_modified (CockpitWebResponse *self,
+                       const gchar *etag,
+                       gint64 mtime)
+{
+  if (!g_str_equal (self->method, "GET") && !g_str_equal (self->method, "HEAD"))
+    return FALSE;
+
+  /* If-None-Match takes precedence when both are present */
+  if (self->if_none_match)
+    return etag && etag_list_matches (self->if_none_match, etag);
+  if (self->if_modified_since >= 0 && mtime >= 0)
+    return mtime <= self->if_modified_since;
+
+  return FALSE;
+}
+
+static gboolean
+if_range_matches (CockpitWebResponse *self,
+                  const gchar *etag,
+                  const gchar *last_modified)
+{
+  if (!self->if_range)
+    return TRUE;
+
+  /* If-Range uses the strong comparison, so weak tags never match */
+  if (self->if_range[0] == '"')
+    return etag && g_str_equal (self->if_range, etag);
+  return last_modified && g_str_equal (self->if_range, last_modified);
+}
+
+typedef struct {
+  gsize start;
+  gsize end;
+} ByteRange;
+
+#define MAX_BYTE_RANGES 16
+
+static gboolean
+parse_range_position (const gchar *beg,
+                      const gchar *end,
+                      guint64 *position)
+{
+  g_autofree gchar *string = NULL;
+
+  if (beg == end)
+    return FALSE;
+
+  string = g_strndup (beg, end - beg);
+  return g_ascii_string_to_unsigned (string, 10, 0, G_MAXUINT64, position, NULL);
+}
+
+/*
+ * Parses a Range header for a body of @length bytes. Returns FALSE if the
+ * header should be ignored. Otherwise @ranges holds the satisfiable ranges,
+ * with inclusive ends, and may be empty.
+ */
+static gboolean
+parse_byte_ranges (const gchar *header,
+                   gsize length,
+                   GArray **ranges)
+{
+  g_auto(GStrv) specs = NULL;
+  g_autoptr(GArray) result = NULL;
+  ByteRange range;
+  guint64 first;
+  guint64 last;
+  const gchar *spec;
+  const gchar *dash;
+  gint i;
+
+  if (g_ascii_strncasecmp (header, "bytes=", 6) != 0)
+    return FALSE;
+
+  specs = g_strsplit (header + 6, ",", -1);
+  if (g_strv_length (specs) > MAX_BYTE_RANGES)
+    return FALSE;
+
+  result = g_array_new (FALSE, FALSE, sizeof (ByteRange));
+  for (i = 0; specs[i] != NULL; i++)
+    {
+      spec = g_strstrip (specs[i]);
+      dash = strchr (spec, '-');
+      if (!dash)
+        return FALSE;
+
+      if (dash == spec)
+        {
+          /* A suffix range: the last N bytes */
+          if (!parse_range_position (dash + 1, dash + strlen (dash), &last))
+            return FALSE;
+          if (last == 0 || length == 0)
+            continue;
+          range.start = last < length ? length - last : 0;
+          range.end = length - 1;
+        }
+      else
+        {
+          if (!parse_range_position (spec, dash, &first))
+            return FALSE;
+          if (dash[1] == '\0')
+            last = G_MAXUINT64;
+          else if (!parse_range_position (dash + 1, dash + strlen (dash), &last) || last < first)
+            return FALSE;
+          if (first >= length)
+            continue;
+          range.start = first;
+          range.end = MIN (last, length - 1);
+        }
+
+      g_array_append_val (result, range);
+    }
+
+  *ranges = g_steal_pointer (&result);
+  return TRUE;
+}
+
+static GList *
+build_byte_ranges (GBytes *body,
+                   GArray *ranges,
+                   const gchar *content_type,
+                   const gchar *boundary,
+                   gssize *length)
+{
+  gsize total = g_bytes_get_size (body);
+  const ByteRange *range;
+  GList *output = NULL;
+  GString *part;
+  GList *l;
+  guint i;
+
+  for (i = 0; i < ranges->len; i++)
+    {
+      range = &g_array_index (ranges, ByteRange, i);
+      part = g_string_new ("");
+      g_string_append_printf (part, "\r\n--%s\r\n", boundary);
+      if (content_type)
+        g_string_append_printf (part, "Content-Type: %s\r\n", content_type);
+      g_string_append_printf (part, "Content-Range: bytes %" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT "/%" G_GSIZE_FORMAT "\r\n\r\n",
+                              range->start, range->end, total);
+      output = g_list_prepend (output, g_string_free_to_bytes (part));
+      output = g_list_prepend (output, g_bytes_new_from_bytes (body, range->start, range->end - range->start + 1));
+    }
+
+  output = g_list_prepend (output, g_bytes_new_take (g_strdup_printf ("\r\n--%s--\r\n", boundary),
+                                                     strlen (boundary) + 8));
+  output = g_list_reverse (output);
+
+  *length = 0;
+  for (l = output; l != NULL; l = g_list_next (l))
+    *length += g_bytes_get_size (l->data);
+
+  return output;
+}
+
+static gchar *
+file_cache_key (const gchar **roots,
+                const gchar *unescaped,
+                gboolean search_gzip)
+{
+  g_autofree gchar *joined = g_strjoinv ("\n", (gchar **)roots);
+  return g_strconcat (joined, "\n", unescaped, search_gzip ? "\n.gz" : "", NULL);
+}
+
 static void
 web_response_file (CockpitWebResponse *response,
                    const gchar *escaped,
@@ -1281,80 +1920,201 @@ web_response_file (CockpitWebResponse *response,
       return;
     }
 
+  g_autofree gchar *cache_key = NULL;
+  CachedFile *cached = NULL;
+
+  if (file_cache_init ())
+    {
+      cache_key = file_cache_key (roots, unescaped, search_gzip);
+      file_cache_process_events ();
+      cached = g_hash_table_lookup (file_cache.entries, cache_key);
+      if (!cached && !file_cache_watch (cache_key, roots, unescaped))
+        g_clear_pointer (&cache_key, g_free);
+    }
+
   gboolean is_gzip = FALSE;
-  g_autoptr(GMappedFile) file = NULL;
-  for (gint i = 0; roots[i]; i++)
+  g_autoptr(GBytes) body = NULL;
+  gint64 mtime = -1;
+
+  if (cached)
+    {
+      g_debug ("%s: serving cached file", escaped);
+      body = g_bytes_ref (cached->body);
+      is_gzip = cached->is_gzip;
+    }
+  else
     {
-      const gchar *root = roots[i];
-      g_autofree gchar *path = g_build_filename (root, unescaped, NULL);
+      g_autoptr(GMappedFile) file = NULL;
+      g_autofree gchar *found = NULL;
+      for (gint i = 0; roots[i]; i++)
+        {
+          const gchar *root = roots[i];
+          g_autofree gchar *path = g_build_filename (root, unescaped, NULL);
+
+          if (g_file_test (path, G_FILE_TEST_IS_DIR))
+            {
+              cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
+              return;
+            }
+
+          /* As a double check of above behavior */
+          g_assert (path_has_prefix (path, root));
 
-      if (g_file_test (path, G_FILE_TEST_IS_DIR))
+          g_autoptr(GError) error = NULL;
+          file = g_mapped_file_new (path, FALSE, &error);
+
+          if (file == NULL && search_gzip &&
+              g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            {
+              g_debug ("%s: file not found in root: %s, looking for .gz", escaped, root);
+              g_clear_error (&error);
+              g_autofree gchar *old_path = g_steal_pointer (&path);
+              path = g_strconcat (old_path, ".gz", NULL);
+              file = g_mapped_file_new (path, FALSE, &error);
+              is_gzip = file != NULL;
+            }
+
+          if (file != NULL)
+            {
+              found = g_steal_pointer (&path);
+              break;
+            }
+
+          if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
+              g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
+            {
+              g_debug ("%s: file not found in root: %s", escaped, root);
+            }
+          else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_PERM) ||
+                   g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ACCES) ||
+                   g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ISDIR))
+            {
+              cockpit_web_response_error (response, 403, NULL, "Access denied");
+              return;
+            }
+          else
+            {
+              g_warning ("%s: %s", path, error->message);
+              cockpit_web_response_error (response, 500, NULL, "Internal server error");
+              return;
+            }
+        }
+
+      if (file == NULL)
         {
-          cockpit_web_response_error (response, 403, NULL, "Directory Listing Denied");
+          cockpit_web_response_error (response, 404, NULL, "Not Found");
           return;
         }
 
-      /* As a double check of above behavior */
-      g_assert (path_has_prefix (path, root));
-
-      g_autoptr(GError) error = NULL;
-      file = g_mapped_file_new (path, FALSE, &error);
-
-      if (file == NULL && search_gzip &&
-          g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      body = g_mapped_file_get_bytes (file);
+      if (cache_key)
+        cached = file_cache_insert (cache_key, found, unescaped, body, is_gzip);
+      if (cached)
         {
-          g_debug ("%s: file not found in root: %s, looking for .gz", escaped, root);
-          g_clear_error (&error);
-          g_autofree gchar *old_path = g_steal_pointer (&path);
-          path = g_strconcat (old_path, ".gz", NULL);
-          file = g_mapped_file_new (path, FALSE, &error);
-          is_gzip = file != NULL;
+          g_bytes_unref (body);
+          body = g_bytes_ref (cached->body);
         }
 
-      if (file != NULL)
-        break;
+      /* Large or uncacheable files still get a Last-Modified header */
+      struct stat st;
+      if (!cached && stat (found, &st) == 0)
+        mtime = st.st_mtime;
+    }
 
-      if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) ||
-          g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NAMETOOLONG))
+  /*
+   * Serve the precompressed variant to clients that accept it. Byte
+   * ranges always refer to the file as it is on disk, though.
+   */
+  gboolean vary_encoding = FALSE;
+  const gchar *etag = NULL;
+  if (cached)
+    {
+      GBytes *gzipped = NULL;
+      etag = cached->etag;
+      mtime = cached->mtime;
+      vary_encoding = cached->compressible && !template_func;
+      if (vary_encoding && response->accept_gzip && !response->range)
+        gzipped = cached_file_get_gzipped (cached);
+      if (gzipped)
         {
-          g_debug ("%s: file not found in root: %s", escaped, root);
+          g_bytes_unref (body);
+          body = g_bytes_ref (gzipped);
+          etag = cached->gzip_etag;
+          is_gzip = TRUE;
         }
-      else if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_PERM) ||
-               g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ACCES) ||
-               g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ISDIR))
+    }
+
+  /*
+   * Expanded templates vary with their values, so only plain files get
+   * validators. This lets browsers revalidate them with a cheap 304.
+   */
+  if (template_func)
+    {
+      etag = NULL;
+      mtime = -1;
+    }
+
+  g_autofree gchar *last_modified = NULL;
+  if (mtime >= 0)
+    last_modified = format_http_date (mtime);
+
+  gboolean ranged = !template_func && !is_gzip;
+  gsize body_size = g_bytes_get_size (body);
+  g_autoptr(GArray) ranges = NULL;
+  gint status = 200;
+  const gchar *reason = "OK";
+
+  if ((etag || mtime >= 0) && response_not_modified (response, etag, mtime))
+    {
+      status = 304;
+      reason = "Not Modified";
+    }
+  else if (ranged && response->range &&
+           if_range_matches (response, etag, last_modified) &&
+           parse_byte_ranges (response->range, body_size, &ranges))
+    {
+      if (ranges->len == 0)
         {
-          cockpit_web_response_error (response, 403, NULL, "Access denied");
-          return;
+          status = 416;
+          reason = "Range Not Satisfiable";
         }
       else
         {
-          g_warning ("%s: %s", path, error->message);
-          cockpit_web_response_error (response, 500, NULL, "Internal server error");
-          return;
+          status = 206;
+          reason = "Partial Content";
         }
     }
 
-  if (file == NULL)
+  GList *output = NULL;
+  gssize content_length = -1;
+  g_autofree gchar *boundary = NULL;
+  if (status == 304 || status == 416)
     {
-      cockpit_web_response_error (response, 404, NULL, "Not Found");
-      return;
+      content_length = 0;
     }
-
-  g_autoptr(GBytes) body = g_mapped_file_get_bytes (file);
-
-  GList *output;
-  gint content_length = -1;
-  if (template_func)
+  else if (template_func)
     {
       output = cockpit_template_expand (body, template_func, user_data);
     }
+  else if (status == 206 && ranges->len > 1)
+    {
+      boundary = g_strdup_printf ("%08x%08x", g_random_int (), g_random_int ());
+      output = build_byte_ranges (body, ranges, cockpit_web_response_content_type (unescaped),
+                                  boundary, &content_length);
+    }
+  else if (status == 206)
+    {
+      const ByteRange *range = &g_array_index (ranges, ByteRange, 0);
+      output = g_list_prepend (NULL, g_bytes_new_from_bytes (body, range->start, range->end - range->start + 1));
+      content_length = range->end - range->start + 1;
+    }
   else
     {
       output = g_list_prepend (NULL, g_bytes_ref (body));
-      content_length = g_bytes_get_size (body);
+      content_length = body_size;
     }
 
-  GString *string = begin_headers (response, 200, "OK");
+  GString *string = begin_headers (response, status, reason);
   guint seen = 0;
 
   if (response->origin)
@@ -1372,10 +2132,43 @@ web_response_file (CockpitWebResponse *response,
       seen |= append_header (string, "Content-Security-Policy", policy);
     }
 
-  if (is_gzip)
+  if (is_gzip && status != 304)
     seen |= append_header (string, "Content-Encoding", "gzip");
 
-  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, 200, seen);
+  if (vary_encoding)
+    {
+      seen |= append_header (string, "Vary",
+                             response->cache_type == COCKPIT_WEB_RESPONSE_CACHE ?
+                             "Cookie, Accept-Encoding" : "Accept-Encoding");
+    }
+
+  if (etag)
+    seen |= append_header (string, "ETag", etag);
+  if (last_modified)
+    seen |= append_header (string, "Last-Modified", last_modified);
+
+  if (ranged)
+    seen |= append_header (string, "Accept-Ranges", "bytes");
+
+  if (status == 416)
+    {
+      g_autofree gchar *content_range = g_strdup_printf ("bytes */%" G_GSIZE_FORMAT, body_size);
+      seen |= append_header (string, "Content-Range", content_range);
+    }
+  else if (status == 206 && boundary)
+    {
+      g_autofree gchar *content_type = g_strdup_printf ("multipart/byteranges; boundary=%s", boundary);
+      seen |= append_header (string, "Content-Type", content_type);
+    }
+  else if (status == 206)
+    {
+      const ByteRange *range = &g_array_index (ranges, ByteRange, 0);
+      g_autofree gchar *content_range = g_strdup_printf ("bytes %" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT "/%" G_GSIZE_FORMAT,
+                                                         range->start, range->end, body_size);
+      seen |= append_header (string, "Content-Range", content_range);
+    }
+
+  g_autoptr(GBytes) headers_block = finish_headers (response, string, content_length, status, seen);
   queue_bytes (response, headers_block);
 
   GList *l;
@@ -1396,7 +2189,10 @@ web_response_file (CockpitWebResponse *response,
  * @path: escaped path, or NULL to get from response
  * @roots: directories to look for file in
  *
- * Serve a file from disk as an HTTP response.
+ * Serve a file from disk as an HTTP response. The file contents are
+ * kept in memory until the file changes on disk, and compressible files
+ * are sent gzip encoded to clients that accept it. Files carry an ETag
+ * and Last-Modified header, and conditional requests get a 304 answer.
  */
 void
 cockpit_web_response_file (CockpitWebResponse *response,
@@ -124,6 +124,9 @@ gboolean     cockpit_web_response_is_header_value        (const gchar *string);
 void         cockpit_web_response_set_cache_type         (CockpitWebResponse *self,
                                                           CockpitCacheType cache_type);
 
+void         cockpit_web_response_set_keep_alive         (CockpitWebResponse *self,
+                                                          gboolean keep_alive);
+
 const gchar *  cockpit_web_response_get_url_root         (CockpitWebResponse *response);
 
 const gchar *  cockpit_web_response_get_origin           (CockpitWebResponse *response);
@@ -33,6 +33,8 @@
 #include "cockpitwebrequest-private.h"
 
 guint cockpit_webserver_request_timeout = 30;
+guint cockpit_webserver_keep_alive_timeout = 15;
+guint cockpit_webserver_keep_alive_maximum = 100;
 const gsize cockpit_webserver_request_maximum = 8192;
 
 struct _CockpitWebServer {
@@ -67,7 +69,8 @@ static void cockpit_web_request_free (gpointer data);
 
 static void cockpit_web_request_start (CockpitWebServer *web_server,
                                        GIOStream *stream,
-                                       gboolean first);
+                                       GByteArray *buffer,
+                                       guint count);
 
 G_DEFINE_TYPE (CockpitWebServer, cockpit_web_server, G_TYPE_OBJECT)
 
@@ -80,7 +83,7 @@ on_incoming (GSocketService *service,
              gpointer user_data)
 {
   CockpitWebServer *self = COCKPIT_WEB_SERVER (user_data);
-  cockpit_web_request_start (self, G_IO_STREAM (connection), TRUE);
+  cockpit_web_request_start (self, G_IO_STREAM (connection), NULL, 0);
 
   /* handled */
   return TRUE;
@@ -228,21 +231,63 @@ close_io_stream (GIOStream *io)
   g_io_stream_close_async (io, G_PRIORITY_DEFAULT, NULL, on_io_closed, NULL);
 }
 
+/* What a kept alive connection carries over to its next request */
+typedef struct {
+  CockpitWebServer *web_server;
+  GByteArray *buffer;
+  guint count;
+} KeepAlive;
+
+static void
+keep_alive_free (gpointer data,
+                 GClosure *closure)
+{
+  KeepAlive *ka = data;
+  g_object_unref (ka->web_server);
+  g_byte_array_unref (ka->buffer);
+  g_free (ka);
+}
+
 static void
 on_web_response_done (CockpitWebResponse *response,
                       gboolean reusable,
                       gpointer user_data)
 {
-  CockpitWebServer *self = user_data;
+  KeepAlive *ka = user_data;
   GIOStream *io;
 
   io = cockpit_web_response_get_stream (response);
   if (reusable)
-    cockpit_web_request_start (self, io, FALSE);
+    cockpit_web_request_start (ka->web_server, io, ka->buffer, ka->count);
   else
     close_io_stream (io);
 }
 
+/*
+ * Responds to the request, and once the response is done starts the
+ * next request on the same connection. Any pipelined data that was
+ * read along with this request remains in the buffer for the next one.
+ */
+static CockpitWebResponse *
+cockpit_web_request_respond_and_keep_alive (CockpitWebRequest *self)
+{
+  CockpitWebResponse *response;
+  KeepAlive *ka;
+
+  response = cockpit_web_request_respond (self);
+
+  ka = g_new0 (KeepAlive, 1);
+  ka->web_server = g_object_ref (self->web_server);
+  ka->buffer = g_byte_array_ref (self->buffer);
+  ka->count = self->count + 1;
+  if (ka->count >= cockpit_webserver_keep_alive_maximum || self->no_keep_alive)
+    cockpit_web_response_set_keep_alive (response, FALSE);
+
+  g_signal_connect_data (response, "done", G_CALLBACK (on_web_response_done),
+                         ka, keep_alive_free, 0);
+  return response;
+}
+
 static gboolean
 cockpit_web_server_default_handle_resource (CockpitWebServer *self,
                                             CockpitWebRequest *request,
@@ -263,9 +308,7 @@ cockpit_web_server_default_handle_stream (CockpitWebServer *self,
   GQuark detail = 0;
 
   /* TODO: Correct HTTP version for response */
-  response = cockpit_web_request_respond (request);
-  g_signal_connect_data (response, "done", G_CALLBACK (on_web_response_done),
-                         g_object_ref (self), (GClosureNotify)g_object_unref, 0);
+  response = cockpit_web_request_respond_and_keep_alive (request);
 
   /*
    * If the path has more than one component, then we search
@@ -299,14 +342,14 @@ cockpit_web_server_default_handle_stream (CockpitWebServer *self,
                  sig_handle_resource, detail,
                  request,
                  request->path,
-                 request->headers,
+                 cockpit_web_request_get_headers (request),
                  response,
                  &claimed);
 
   if (!claimed)
-    claimed = cockpit_web_server_default_handle_resource (self, request, request->path, request->headers, response);
+    claimed = cockpit_web_server_default_handle_resource (self, request, request->path,
+                                                          cockpit_web_request_get_headers (request), response);
 
-  /* TODO: Here is where we would plug keep-alive into response */
   g_object_unref (response);
 
   return claimed;
@@ -388,11 +431,10 @@ cockpit_web_server_new_table (void)
   return g_hash_table_new_full (cockpit_str_case_hash, cockpit_str_case_equal, g_free, g_free);
 }
 
-gchar *
-cockpit_web_server_parse_cookie (GHashTable *headers,
-                                 const gchar *name)
+static gchar *
+parse_cookie_header (const gchar *header,
+                     const gchar *name)
 {
-  const gchar *header;
   const gchar *pos;
   const gchar *value;
   const gchar *end;
@@ -401,7 +443,6 @@ cockpit_web_server_parse_cookie (GHashTable *headers,
   gint diff;
   gint offset;
 
-  header = g_hash_table_lookup (headers, "Cookie");
   if (!header)
     return NULL;
 
@@ -449,6 +490,13 @@ cockpit_web_server_parse_cookie (GHashTable *headers,
     }
 }
 
+gchar *
+cockpit_web_server_parse_cookie (GHashTable *headers,
+                                 const gchar *name)
+{
+  return parse_cookie_header (g_hash_table_lookup (headers, "Cookie"), name);
+}
+
 typedef struct {
   double qvalue;
   const gchar *value;
@@ -669,6 +717,8 @@ cockpit_web_request_free (gpointer data)
    * clear it here. The buffer may still be in use.
    */
   g_byte_array_unref (self->buffer);
+  if (self->headers)
+    g_hash_table_unref (self->headers);
   g_object_unref (self->io);
   g_free (self);
 }
@@ -682,17 +732,14 @@ cockpit_web_request_finish (CockpitWebRequest *self)
 static void
 cockpit_web_request_process_delayed_reply (CockpitWebRequest *self,
                                            const gchar *path,
-                                           GHashTable *headers)
+                                           const gchar *host)
 {
   g_assert (self->delayed_reply > 299);
 
-  g_autoptr(CockpitWebResponse) response = cockpit_web_request_respond (self);
-  g_signal_connect_data (response, "done", G_CALLBACK (on_web_response_done),
-                         g_object_ref (self->web_server), (GClosureNotify)g_object_unref, 0);
+  g_autoptr(CockpitWebResponse) response = cockpit_web_request_respond_and_keep_alive (self);
 
   if (self->delayed_reply == 301)
     {
-      const gchar *host = g_hash_table_lookup (headers, "Host");
       g_autofree gchar *url = g_strdup_printf ("https://%s%s", host != NULL ? host : "", path);
       cockpit_web_response_headers (response, 301, "Moved Permanently", 0, "Location", url, NULL);
       cockpit_web_response_complete (response);
@@ -729,8 +776,7 @@ static void
 cockpit_web_request_process (CockpitWebRequest *self,
                              const gchar *method,
                              const gchar *path,
-                             const gchar *host,
-                             GHashTable *headers)
+                             const gchar *host)
 {
   gboolean claimed = FALSE;
 
@@ -760,7 +806,7 @@ cockpit_web_request_process (CockpitWebRequest *self,
 
   if (self->delayed_reply)
     {
-      cockpit_web_request_process_delayed_reply (self, path, headers);
+      cockpit_web_request_process_delayed_reply (self, path, host);
       return;
     }
 
@@ -768,7 +814,6 @@ cockpit_web_request_process (CockpitWebRequest *self,
 
   self->original_path = path_copy;
   self->path = path_copy + self->web_server->url_root->len;
-  self->headers = headers;
   self->host = host;
 
   gchar *query = strchr (path_copy, '?');
@@ -794,17 +839,138 @@ cockpit_web_request_process (CockpitWebRequest *self,
     g_critical ("no handler responded to request: %s", self->path);
 }
 
+/*
+ * Looks for the empty line at the end of the headers, carrying on from
+ * where the last call left off, so that requests arriving in several
+ * pieces aren't parsed over and over.
+ */
+static gboolean
+cockpit_web_request_have_headers (CockpitWebRequest *self)
+{
+  const guint8 *data = self->buffer->data;
+  gsize len = self->buffer->len;
+  const guint8 *line;
+  gsize at = self->scanned;
+
+  for (;;)
+    {
+      line = memchr (data + at, '\n', len - at);
+      if (line == NULL)
+        {
+          self->scanned = len;
+          return FALSE;
+        }
+
+      at = (line - data) + 1;
+      if (at < len && data[at] == '\n')
+        return TRUE;
+      if (at + 1 < len && data[at] == '\r' && data[at + 1] == '\n')
+        return TRUE;
+
+      /* Not enough to tell yet, look at this line ending again */
+      if (at + 1 >= len)
+        {
+          self->scanned = line - data;
+          return FALSE;
+        }
+    }
+}
+
+static const gchar *well_known_headers[] = {
+  [COCKPIT_WEB_REQUEST_HOST] = "Host",
+  [COCKPIT_WEB_REQUEST_COOKIE] = "Cookie",
+  [COCKPIT_WEB_REQUEST_ACCEPT_ENCODING] = "Accept-Encoding",
+  [COCKPIT_WEB_REQUEST_UPGRADE] = "Upgrade",
+  [COCKPIT_WEB_REQUEST_IF_NONE_MATCH] = "If-None-Match",
+  [COCKPIT_WEB_REQUEST_CONNECTION] = "Connection",
+  [COCKPIT_WEB_REQUEST_CONTENT_LENGTH] = "Content-Length",
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (well_known_headers) == COCKPIT_WEB_REQUEST_N_WELL_KNOWN);
+
+static const WebSocketHeaderSpan *
+find_header_span (const WebSocketHeaderSpan *spans,
+                  gsize n_spans,
+                  const gchar *name)
+{
+  gsize len = strlen (name);
+
+  /* The last one wins, like in the table */
+  while (n_spans > 0)
+    {
+      n_spans--;
+      if (spans[n_spans].name_len == len &&
+          g_ascii_strncasecmp (spans[n_spans].name, name, len) == 0)
+        return spans + n_spans;
+    }
+
+  return NULL;
+}
+
+/*
+ * The header spans point into the request buffer. Null terminate them
+ * in place, so they can be handed out as strings without copying, and
+ * remember where the well known ones are.
+ */
+static void
+cockpit_web_request_index_headers (CockpitWebRequest *self)
+{
+  WebSocketHeaderSpan *span;
+  gsize i, j;
+
+  for (i = 0; i < self->n_header_spans; i++)
+    {
+      span = self->header_spans + i;
+      ((gchar *)span->name)[span->name_len] = '\0';
+      ((gchar *)span->value)[span->value_len] = '\0';
+
+      for (j = 0; j < G_N_ELEMENTS (well_known_headers); j++)
+        {
+          if (g_ascii_strcasecmp (span->name, well_known_headers[j]) == 0)
+            {
+              self->well_known[j] = span->value;
+              break;
+            }
+        }
+    }
+}
+
+/*
+ * Drops the parsed request from the buffer, so that only data after
+ * it remains. The header spans are gone afterwards, so the table is
+ * made first if it may still be needed.
+ */
+static void
+cockpit_web_request_consume (CockpitWebRequest *self)
+{
+  if (self->consumed == 0)
+    return;
+
+  if (self->n_header_spans > 0)
+    {
+      cockpit_web_request_get_headers (self);
+      if (self->host)
+        self->host = g_hash_table_lookup (self->headers, "Host");
+      self->n_header_spans = 0;
+    }
+
+  memset (self->well_known, 0, sizeof (self->well_known));
+  g_byte_array_remove_range (self->buffer, 0, self->consumed);
+  self->consumed = 0;
+}
+
 static gboolean
 cockpit_web_request_parse_and_process (CockpitWebRequest *self)
 {
   gboolean again = FALSE;
-  GHashTable *headers = NULL;
   gchar *method = NULL;
   gchar *path = NULL;
+  const WebSocketHeaderSpan *span;
   const gchar *str;
   gchar *end = NULL;
   gssize off1;
   gssize off2;
+  gsize n_spans;
   guint64 length;
 
   /* The hard input limit, we just terminate the connection */
@@ -814,6 +980,13 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
       goto out;
     }
 
+  /* Don't bother parsing anything until all headers are here */
+  if (!cockpit_web_request_have_headers (self))
+    {
+      again = TRUE;
+      goto out;
+    }
+
   off1 = web_socket_util_parse_req_line ((const gchar *)self->buffer->data,
                                          self->buffer->len,
                                          &method,
@@ -836,9 +1009,10 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
       goto out;
     }
 
-  off2 = web_socket_util_parse_headers ((const gchar *)self->buffer->data + off1,
-                                        self->buffer->len - off1,
-                                        &headers);
+  n_spans = G_N_ELEMENTS (self->header_spans);
+  off2 = web_socket_util_scan_headers ((const gchar *)self->buffer->data + off1,
+                                       self->buffer->len - off1,
+                                       self->header_spans, &n_spans);
   if (off2 == 0)
     {
       again = TRUE;
@@ -853,11 +1027,12 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
 
   /* If we get a Content-Length then verify it is zero */
   length = 0;
-  str = g_hash_table_lookup (headers, "Content-Length");
-  if (str != NULL)
+  span = find_header_span (self->header_spans, n_spans, "Content-Length");
+  if (span != NULL)
     {
+      g_autofree gchar *value = g_strndup (span->value, span->value_len);
       end = NULL;
-      length = g_ascii_strtoull (str, &end, 10);
+      length = g_ascii_strtoull (value, &end, 10);
       if (!end || end[0])
         {
           g_message ("received invalid Content-Length");
@@ -865,40 +1040,63 @@ cockpit_web_request_parse_and_process (CockpitWebRequest *self)
           goto out;
         }
 
+      /*
+       * Too large to skip: refuse it without reading the body, and
+       * close the connection as we don't know where the next request
+       * would start.
+       */
+      if (length > cockpit_webserver_request_maximum)
+        {
+          g_message ("received too large Content-Length");
+          self->delayed_reply = 413;
+          self->no_keep_alive = TRUE;
+          length = 0;
+        }
+
       /* The soft limit, we return 413 */
-      if (length != 0)
+      else if (length != 0)
         {
           g_debug ("received non-zero Content-Length");
           self->delayed_reply = 413;
         }
     }
 
-  /* Not enough data yet */
+  /*
+   * Not enough data yet. The spans may not survive the buffer growing,
+   * so they're scanned again, but that's rare as bodies are refused.
+   */
   if (self->buffer->len < off1 + off2 + length)
     {
       again = TRUE;
       goto out;
     }
 
+  self->n_header_spans = n_spans;
+  cockpit_web_request_index_headers (self);
+
   if (!g_str_equal (method, "GET") && !g_str_equal (method, "HEAD"))
     {
       g_message ("received unsupported HTTP method");
       self->delayed_reply = 405;
     }
 
-  str = g_hash_table_lookup (headers, "Host");
+  str = self->well_known[COCKPIT_WEB_REQUEST_HOST];
   if (!str || g_str_equal (str, ""))
     {
       g_message ("received HTTP request without Host header");
       self->delayed_reply = 400;
     }
 
-  g_byte_array_remove_range (self->buffer, 0, off1 + off2);
-  cockpit_web_request_process (self, method, path, str, headers);
+  /* Any body is refused above, skip it so a pipelined request comes next */
+  self->consumed = off1 + off2 + length;
+  cockpit_web_request_process (self, method, path, str);
+
+  /* Nothing looks at the headers once processed, don't copy them */
+  self->n_header_spans = 0;
+  self->host = NULL;
+  cockpit_web_request_consume (self);
 
 out:
-  if (headers)
-    g_hash_table_unref (headers);
   g_free (method);
   g_free (path);
   if (!again)
@@ -955,9 +1153,8 @@ cockpit_web_request_on_input (GObject *pollable_input,
    * to our allowed maximum size to ensure we got everything that's pending.
    * Add one extra byte so that cockpit_web_request_parse_and_process()
    * correctly rejects requests that are > maximum, instead of hanging.
-   *
-   * FIXME: This may still hang for several large requests that are pipelined;
-   * for these this needs to be changed into a loop.
+   * Pipelined requests which were read along with this one are processed
+   * once the response to this one is done.
    */
   g_byte_array_set_size (self->buffer, length + cockpit_webserver_request_maximum + 1);
 
@@ -1035,6 +1232,18 @@ cockpit_web_request_start_input (CockpitWebRequest *self)
   g_source_attach (self->source, self->web_server->main_context);
 }
 
+static gboolean
+cockpit_web_request_on_pipelined (gpointer user_data)
+{
+  CockpitWebRequest *self = user_data;
+
+  /* A request that was read along with the previous one */
+  if (cockpit_web_request_parse_and_process (self))
+    cockpit_web_request_start_input (self);
+
+  return FALSE;
+}
+
 static gboolean
 cockpit_web_request_on_socket_input (GSocket *socket,
                                      GIOCondition condition,
@@ -1122,27 +1331,45 @@ cockpit_web_request_on_timeout (gpointer data)
   return FALSE;
 }
 
+/*
+ * A @buffer of %NULL means this is the first request on a new connection,
+ * otherwise it holds any data read past the end of the previous request.
+ */
 static void
 cockpit_web_request_start (CockpitWebServer *web_server,
                             GIOStream *io,
-                            gboolean first)
+                            GByteArray *buffer,
+                            guint count)
 {
   GSocketConnection *connection;
   GSocket *socket;
+  guint timeout;
 
   CockpitWebRequest *self = g_new0 (CockpitWebRequest, 1);
   self->web_server = web_server;
   self->io = g_object_ref (io);
-  self->buffer = g_byte_array_new ();
+  self->buffer = buffer ? g_byte_array_ref (buffer) : g_byte_array_new ();
+  self->count = count;
 
   /* Right before a request, EOF is not unexpected */
-  self->eof_okay = TRUE;
+  self->eof_okay = (self->buffer->len == 0);
+
+  /* An idle kept alive connection gets closed sooner */
+  timeout = cockpit_webserver_request_timeout;
+  if (count > 0)
+    timeout = MIN (timeout, cockpit_webserver_keep_alive_timeout);
 
-  self->timeout = g_timeout_source_new_seconds (cockpit_webserver_request_timeout);
+  self->timeout = g_timeout_source_new_seconds (timeout);
   g_source_set_callback (self->timeout, cockpit_web_request_on_timeout, self, NULL);
   g_source_attach (self->timeout, web_server->main_context);
 
-  if (first)
+  if (self->buffer->len > 0)
+    {
+      self->source = g_idle_source_new ();
+      g_source_set_callback (self->source, cockpit_web_request_on_pipelined, self, NULL);
+      g_source_attach (self->source, web_server->main_context);
+    }
+  else if (!buffer)
     {
       connection = G_SOCKET_CONNECTION (io);
       socket = g_socket_connection_get_socket (connection);
@@ -1163,7 +1390,8 @@ cockpit_web_request_start (CockpitWebServer *web_server,
 CockpitWebResponse *
 cockpit_web_request_respond (CockpitWebRequest *self)
 {
-  return cockpit_web_response_new (self->io, self->original_path, self->path, self->headers,
+  return cockpit_web_response_new (self->io, self->original_path, self->path,
+                                   cockpit_web_request_get_headers (self),
                                    self->method, cockpit_web_request_get_protocol (self));
 }
 
@@ -1188,12 +1416,32 @@ cockpit_web_request_get_method (CockpitWebRequest *self)
 GByteArray *
 cockpit_web_request_get_buffer (CockpitWebRequest *self)
 {
+  /* Whoever reads the buffer wants what comes after the request */
+  cockpit_web_request_consume (self);
   return self->buffer;
 }
 
+/*
+ * The table of headers is only made when someone asks for it; most
+ * lookups are answered from the parsed spans in the request buffer.
+ */
 GHashTable *
 cockpit_web_request_get_headers (CockpitWebRequest *self)
 {
+  WebSocketHeaderSpan *span;
+  gsize i;
+
+  if (!self->headers && self->n_header_spans > 0)
+    {
+      self->headers = web_socket_util_new_headers ();
+      for (i = 0; i < self->n_header_spans; i++)
+        {
+          span = self->header_spans + i;
+          g_hash_table_insert (self->headers, g_strndup (span->name, span->name_len),
+                               g_strndup (span->value, span->value_len));
+        }
+    }
+
   return self->headers;
 }
 
@@ -1201,20 +1449,27 @@ const gchar *
 cockpit_web_request_lookup_header (CockpitWebRequest *self,
                                    const gchar *header)
 {
-  if (!self->headers)
-    return NULL;
+  const WebSocketHeaderSpan *span;
+  gsize i;
+
+  if (self->headers)
+    return g_hash_table_lookup (self->headers, header);
 
-  return g_hash_table_lookup (self->headers, header);
+  for (i = 0; i < G_N_ELEMENTS (well_known_headers); i++)
+    {
+      if (g_ascii_strcasecmp (header, well_known_headers[i]) == 0)
+        return self->well_known[i];
+    }
+
+  span = find_header_span (self->header_spans, self->n_header_spans, header);
+  return span ? span->value : NULL;
 }
 
 gchar *
 cockpit_web_request_parse_cookie (CockpitWebRequest *self,
                                   const gchar *name)
 {
-  if (!self->headers)
-    return NULL;
-
-  return cockpit_web_server_parse_cookie (self->headers, name);
+  return parse_cookie_header (cockpit_web_request_lookup_header (self, "Cookie"), name);
 }
 
 GIOStream *
@@ -1237,7 +1492,7 @@ cockpit_web_request_get_protocol (CockpitWebRequest *self)
 
   if (self->web_server && self->web_server->protocol_header)
     {
-      const gchar *protocol = g_hash_table_lookup (self->headers, self->web_server->protocol_header);
+      const gchar *protocol = cockpit_web_request_lookup_header (self, self->web_server->protocol_header);
       if (protocol)
         return protocol;
     }
@@ -1250,7 +1505,7 @@ cockpit_web_request_get_remote_address (CockpitWebRequest *self)
 {
   if (self->web_server && self->web_server->forwarded_for_header)
     {
-      const gchar *forwarded_header = g_hash_table_lookup (self->headers, self->web_server->forwarded_for_header);
+      const gchar *forwarded_header = cockpit_web_request_lookup_header (self, self->web_server->forwarded_for_header);
       if (forwarded_header && forwarded_header[0])
         {
           /* This isn't really standardised, but in practice, it's a
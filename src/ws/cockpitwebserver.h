@@ -66,6 +66,8 @@ cockpit_web_request_get_client_certificate (CockpitWebRequest *self);
 G_DECLARE_FINAL_TYPE(CockpitWebServer, cockpit_web_server, COCKPIT, WEB_SERVER, GObject)
 
 extern guint cockpit_webserver_request_timeout;
+extern guint cockpit_webserver_keep_alive_timeout;
+extern guint cockpit_webserver_keep_alive_maximum;
 
 typedef enum {
   COCKPIT_WEB_SERVER_NONE = 0,
@@ -20,6 +20,7 @@
 #include "common/cockpithex.h"
 #include "cockpitjson.h"
 #include "common/cockpitmemory.h"
+#include "cockpitpipetransport.h"
 #include "cockpitsystem.h"
 #include "cockpitwebresponse.h"
 #include "cockpitwebserver.h"
@@ -42,6 +43,17 @@ typedef struct {
   JsonObject *init_received;
 } CockpitSocket;
 
+/*
+ * A channel is interned here when it is opened, so that routing its
+ * messages in either direction doesn't need to build any strings.
+ */
+typedef struct {
+  gchar *id;
+  GBytes *prefix;
+  CockpitSocket *socket;
+  WebSocketDataType data_type;
+} CockpitSocketChannel;
+
 typedef struct {
   GHashTable *by_channel;
   GHashTable *by_connection;
@@ -60,12 +72,23 @@ cockpit_socket_free (gpointer data)
   g_free (socket);
 }
 
+static void
+cockpit_socket_channel_free (gpointer data)
+{
+  CockpitSocketChannel *chan = data;
+  g_bytes_unref (chan->prefix);
+  g_free (chan->id);
+  g_free (chan);
+}
+
 static void
 cockpit_sockets_init (CockpitSockets *sockets)
 {
   sockets->next_socket_id = 1;
 
-  sockets->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
+  /* This owns the channels, the key is their id */
+  sockets->by_channel = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               NULL, cockpit_socket_channel_free);
 
   /* This owns the socket */
   sockets->by_connection = g_hash_table_new_full (g_direct_hash, g_direct_equal,
@@ -79,11 +102,38 @@ cockpit_socket_lookup_by_connection (CockpitSockets *sockets,
   return g_hash_table_lookup (sockets->by_connection, connection);
 }
 
+inline static CockpitSocketChannel *
+cockpit_socket_lookup_channel (CockpitSockets *sockets,
+                               const gchar *channel)
+{
+  return g_hash_table_lookup (sockets->by_channel, channel);
+}
+
+/* Channel ids are short, so this doesn't need to allocate */
+static CockpitSocketChannel *
+cockpit_socket_lookup_channel_len (CockpitSockets *sockets,
+                                   const gchar *channel,
+                                   gsize length)
+{
+  gchar key[128];
+
+  if (length >= sizeof key)
+    {
+      g_autofree gchar *copy = g_strndup (channel, length);
+      return cockpit_socket_lookup_channel (sockets, copy);
+    }
+
+  memcpy (key, channel, length);
+  key[length] = '\0';
+  return cockpit_socket_lookup_channel (sockets, key);
+}
+
 inline static CockpitSocket *
 cockpit_socket_lookup_by_channel (CockpitSockets *sockets,
                                   const gchar *channel)
 {
-  return g_hash_table_lookup (sockets->by_channel, channel);
+  CockpitSocketChannel *chan = cockpit_socket_lookup_channel (sockets, channel);
+  return chan ? chan->socket : NULL;
 }
 
 static void
@@ -91,9 +141,17 @@ cockpit_socket_remove_channel (CockpitSockets *sockets,
                                CockpitSocket *socket,
                                const gchar *channel)
 {
+  CockpitSocketChannel *chan;
+
   g_debug ("%s remove channel %s for socket", socket->id, channel);
-  g_hash_table_remove (sockets->by_channel, channel);
-  g_hash_table_remove (socket->channels, channel);
+
+  /* The channel is removed from the socket that owns it */
+  chan = cockpit_socket_lookup_channel (sockets, channel);
+  if (chan)
+    {
+      g_hash_table_remove (chan->socket->channels, channel);
+      g_hash_table_remove (sockets->by_channel, channel);
+    }
 }
 
 static void
@@ -102,11 +160,22 @@ cockpit_socket_add_channel (CockpitSockets *sockets,
                             const gchar *channel,
                             WebSocketDataType data_type)
 {
-  gchar *chan;
+  CockpitSocketChannel *chan;
+  gsize length;
+
+  /* Never leave a stale entry behind in another socket */
+  if (cockpit_socket_lookup_channel (sockets, channel))
+    cockpit_socket_remove_channel (sockets, socket, channel);
 
-  chan = g_strdup (channel);
-  g_hash_table_insert (sockets->by_channel, chan, socket);
-  g_hash_table_replace (socket->channels, chan, GINT_TO_POINTER (data_type));
+  length = strlen (channel);
+  chan = g_new0 (CockpitSocketChannel, 1);
+  chan->id = g_strdup (channel);
+  chan->prefix = g_bytes_new_take (g_strdup_printf ("%s\n", channel), length + 1);
+  chan->socket = socket;
+  chan->data_type = data_type;
+
+  g_hash_table_replace (sockets->by_channel, chan->id, chan);
+  g_hash_table_replace (socket->channels, chan->id, chan);
 
   g_debug ("%s added channel %s to socket", socket->id, channel);
 }
@@ -120,7 +189,7 @@ cockpit_socket_track (CockpitSockets *sockets,
   socket = g_new0 (CockpitSocket, 1);
   socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
   socket->connection = g_object_ref (connection);
-  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->channels = g_hash_table_new (g_str_hash, g_str_equal);
 
   g_debug ("%s new socket", socket->id);
 
@@ -135,14 +204,16 @@ cockpit_socket_destroy (CockpitSockets *sockets,
                         CockpitSocket *socket)
 {
   GHashTableIter iter;
-  const gchar *chan;
+  CockpitSocketChannel *chan;
 
   g_debug ("%s destroy socket", socket->id);
 
   g_hash_table_iter_init (&iter, socket->channels);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
-    g_hash_table_remove (sockets->by_channel, chan);
-  g_hash_table_remove_all (socket->channels);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&chan))
+    {
+      g_hash_table_iter_remove (&iter);
+      g_hash_table_remove (sockets->by_channel, chan->id);
+    }
 
   /* This owns the socket */
   g_hash_table_remove (sockets->by_connection, socket->connection);
@@ -587,6 +658,7 @@ process_transport_init (CockpitWebService *self,
   JsonObject *object;
   JsonObject *capabilities;
   gboolean explicit_superuser_capability = FALSE;
+  gboolean binary_framing_capability = FALSE;
   GBytes *payload;
   gint64 version;
 
@@ -607,8 +679,14 @@ process_transport_init (CockpitWebService *self,
         {
           if (!cockpit_json_get_bool (capabilities, "explicit-superuser", FALSE, &explicit_superuser_capability))
             g_warning ("invalued 'explicit-superuser' value in init message");
+          if (!cockpit_json_get_bool (capabilities, "binary-framing", FALSE, &binary_framing_capability))
+            g_warning ("invalid 'binary-framing' value in init message");
         }
 
+      /* Binary framing is only used over our own pipes */
+      if (!COCKPIT_IS_PIPE_TRANSPORT (transport))
+        binary_framing_capability = FALSE;
+
       /* If the bridge has the explicit-superuser capability, it will
          send a "superuser-init-done" message once any authorization
          is over.  We will poisen our credentials at that time.
@@ -643,10 +721,22 @@ process_transport_init (CockpitWebService *self,
             }
         }
 
+      /* Tell the bridge that we understand binary frames. It switches to them
+       * when it sees this, and we do so right after sending it. */
+      if (binary_framing_capability)
+        {
+          JsonObject *our_capabilities = json_object_new ();
+          json_object_set_boolean_member (our_capabilities, "binary-framing", TRUE);
+          json_object_set_object_member (object, "capabilities", our_capabilities);
+        }
+
       payload = cockpit_json_write_bytes (object);
       json_object_unref (object);
       cockpit_transport_send (transport, NULL, payload);
       g_bytes_unref (payload);
+
+      if (binary_framing_capability)
+        cockpit_pipe_transport_set_binary_framing (COCKPIT_PIPE_TRANSPORT (transport), TRUE);
     }
   else
     {
@@ -740,23 +830,16 @@ on_transport_recv (CockpitTransport *transport,
                    gpointer user_data)
 {
   CockpitWebService *self = user_data;
-  WebSocketDataType data_type;
-  CockpitSocket *socket;
-  gchar *string;
-  GBytes *prefix;
+  CockpitSocketChannel *chan;
 
   if (!channel)
     return FALSE;
 
   /* Forward the message to the right socket */
-  socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
-  if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
+  chan = cockpit_socket_lookup_channel (&self->sockets, channel);
+  if (chan && web_socket_connection_get_ready_state (chan->socket->connection) == WEB_SOCKET_STATE_OPEN)
     {
-      string = g_strdup_printf ("%s\n", channel);
-      prefix = g_bytes_new_take (string, strlen (string));
-      data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
-      g_bytes_unref (prefix);
+      web_socket_connection_send (chan->socket->connection, chan->data_type, chan->prefix, payload);
       return TRUE;
     }
 
@@ -1065,24 +1148,38 @@ on_web_socket_message (WebSocketConnection *connection,
                        CockpitWebService *self)
 {
   CockpitSocket *socket;
-  g_autofree gchar *channel = NULL;
+  CockpitSocketChannel *chan;
+  const gchar *data;
+  gsize channel_len;
+  gsize length;
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
-  g_autoptr(GBytes) payload = cockpit_transport_parse_frame (message, &channel);
-  if (!payload)
+  /* The channel is looked up in place instead of being copied out */
+  if (!cockpit_transport_parse_frame_span (message, &data, &channel_len))
     return;
 
+  length = g_bytes_get_size (message);
+  g_autoptr(GBytes) payload = g_bytes_new_from_bytes (message, channel_len + 1, length - channel_len - 1);
+
   /* A control channel command */
-  if (!channel)
+  if (channel_len == 0)
     dispatch_inbound_command (self, socket, payload);
 
   /* An actual payload message */
-  else if (!self->closing)
+  else if (!self->closing && !self->sent_done)
     {
-      if (!self->sent_done)
-        cockpit_transport_send (self->transport, channel, payload);
+      chan = cockpit_socket_lookup_channel_len (&self->sockets, data, channel_len);
+      if (chan)
+        {
+          cockpit_transport_send (self->transport, chan->id, payload);
+        }
+      else
+        {
+          g_autofree gchar *channel = g_strndup (data, channel_len);
+          cockpit_transport_send (self->transport, channel, payload);
+        }
     }
 }
 
@@ -1181,12 +1278,23 @@ on_web_socket_close (WebSocketConnection *connection,
                      CockpitWebService *self)
 {
   CockpitSocket *socket;
+  guint64 sent, sent_compressed;
+  guint64 received, received_compressed;
 
   if (cockpit_creds_get_rhost (self->creds))
     g_info ("Connection from %s to session %s closed", cockpit_creds_get_rhost (self->creds), self->id);
   else
     g_info ("Connection to session %s closed", self->id);
 
+  if (web_socket_connection_get_compression (connection, &sent, &sent_compressed,
+                                             &received, &received_compressed))
+    {
+      g_debug ("%s: compressed %" G_GUINT64_FORMAT " sent bytes to %" G_GUINT64_FORMAT
+               " (%.1f%%), inflated %" G_GUINT64_FORMAT " received bytes to %" G_GUINT64_FORMAT,
+               self->id, sent, sent_compressed, sent ? 100.0 * sent_compressed / sent : 100.0,
+               received_compressed, received);
+    }
+
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_open, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_closing, self);
   g_signal_handlers_disconnect_by_func (connection, on_web_socket_close, self);
@@ -1298,6 +1406,7 @@ WebSocketConnection *
 cockpit_web_service_create_socket (const gchar **protocols,
                                    CockpitWebRequest *request)
 {
+  const CockpitConfSnapshot *conf = cockpit_conf_snapshot ();
   WebSocketConnection *connection;
   const gchar * const *origins;
   gchar *allocated = NULL;
@@ -1307,7 +1416,7 @@ cockpit_web_service_create_socket (const gchar **protocols,
   const gchar *host = cockpit_web_request_get_host (request);
   const gchar *protocol = cockpit_web_request_get_protocol (request);
 
-  origins = cockpit_conf_strv ("WebService", "Origins", ' ');
+  origins = conf->origins;
   if (origins == NULL)
     {
       /* Origins are checked with fnmatch(), escape [..] in IPv6 addresses */
@@ -1323,6 +1432,15 @@ cockpit_web_service_create_socket (const gchar **protocols,
                                                  cockpit_web_request_get_io_stream (request),
                                                  cockpit_web_request_get_headers (request),
                                                  cockpit_web_request_get_buffer (request));
+
+  if (conf->websocket_compression)
+    {
+      g_object_set (connection,
+                    "deflate-window-bits", conf->websocket_compression_window_bits,
+                    "deflate-context-takeover", conf->websocket_compression_context_takeover,
+                    NULL);
+    }
+
   g_free (allocated);
   g_free (origin);
 
@@ -93,6 +93,14 @@ on_local_ready (GObject *object,
   g_object_unref (data);
 }
 
+static gboolean
+on_reload_conf (gpointer user_data)
+{
+  g_info ("Reloading configuration");
+  cockpit_conf_reload ();
+  return G_SOURCE_CONTINUE;
+}
+
 int
 main (int argc,
       char *argv[])
@@ -107,6 +115,7 @@ main (int argc,
   g_autoptr(CockpitWebServer) server = NULL;
   CockpitWebServerFlags server_flags = COCKPIT_WEB_SERVER_NONE;
   CockpitHandlerData data;
+  guint sig_hup = 0;
 
   signal (SIGPIPE, SIG_IGN);
   cockpit_setenv_check ("GSETTINGS_BACKEND", "memory", TRUE);
@@ -143,6 +152,7 @@ main (int argc,
   g_log_writer_default_set_use_stderr (TRUE);
 
   loop = g_main_loop_new (NULL, FALSE);
+  sig_hup = g_unix_signal_add (SIGHUP, on_reload_conf, NULL);
 
   data.os_release = cockpit_system_load_os_release ();
   data.auth = cockpit_auth_new (opt_local_ssh, opt_for_tls_proxy ? COCKPIT_AUTH_FOR_TLS_PROXY : COCKPIT_AUTH_NONE);
@@ -267,6 +277,8 @@ out:
     g_hash_table_unref (data.os_release);
   g_free (opt_address);
   g_free (opt_local_session);
+  if (sig_hup)
+    g_source_remove (sig_hup);
   cockpit_conf_cleanup ();
   return ret;
 }
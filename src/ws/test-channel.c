@@ -709,6 +709,41 @@ test_pressure_window (TestPairCase *tc,
     g_main_context_iteration (NULL, TRUE);
 }
 
+static void
+test_pressure_measure (TestPairCase *tc,
+                       gconstpointer data)
+{
+  gint64 window, min_rtt, rate;
+  gint throttle = -1;
+  GBytes *sent;
+  gint i;
+
+  cockpit_channel_ready (tc->channel_a, NULL);
+  cockpit_channel_ready (tc->channel_b, NULL);
+  g_signal_connect (tc->channel_a, "pressure", G_CALLBACK (on_pressure_set_throttle), &throttle);
+
+  /* Nothing measured yet, so the window starts out at its default */
+  g_assert (cockpit_channel_get_flow_statistics (tc->channel_a, &window, &min_rtt, &rate));
+  g_assert_cmpint (window, ==, 2 * 1024 * 1024);
+  g_assert_cmpint (min_rtt, ==, 0);
+  g_assert_cmpint (rate, ==, 0);
+
+  sent = g_bytes_new_take (g_strnfill (1000 * 1000, '?'), 1000 * 1000);
+  for (i = 0; i < 10; i++)
+    cockpit_channel_send (tc->channel_a, sent, TRUE);
+  g_bytes_unref (sent);
+
+  g_assert_cmpint (throttle, ==, 1);
+  while (throttle != 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* The pongs have been measured, and the window stays within its bounds */
+  g_assert (cockpit_channel_get_flow_statistics (tc->channel_a, &window, &min_rtt, &rate));
+  g_assert_cmpint (min_rtt, >, 0);
+  g_assert_cmpint (window, >=, 256 * 1024);
+  g_assert_cmpint (window, <=, 16 * 1024 * 1024);
+}
+
 static void
 test_pressure_throttle (TestPairCase *tc,
                         gconstpointer data)
@@ -786,6 +821,8 @@ main (int argc,
 
   g_test_add ("/channel/pressure/window", TestPairCase, NULL,
               setup_pair, test_pressure_window, teardown_pair);
+  g_test_add ("/channel/pressure/measure", TestPairCase, NULL,
+              setup_pair, test_pressure_measure, teardown_pair);
   g_test_add ("/channel/pressure/throttle", TestPairCase, NULL,
               setup_pair, test_pressure_throttle, teardown_pair);
 
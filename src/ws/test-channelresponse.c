@@ -0,0 +1,571 @@
+/*
+ * Copyright (C) 2015 Red Hat, Inc.
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "config.h"
+
+#include "cockpitchannelresponse.h"
+#include "cockpitcreds.h"
+#include "cockpitjson.h"
+#include "cockpitwebresponse.h"
+#include "cockpitwebserver.h"
+#include "cockpitwebservice.h"
+
+#include "common/cockpitconf.h"
+
+#include "testlib/cockpittest.h"
+#include "testlib/mock-transport.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+#include <unistd.h>
+
+extern const gchar *cockpit_config_file;
+
+#define CHECKSUM "abcdef0123456789"
+
+/* The sizes the resource cache in cockpitchannelresponse.c works with */
+#define CACHE_MAX_SIZE  (32 * 1024 * 1024)
+#define CACHE_MAX_ENTRY (CACHE_MAX_SIZE / 16)
+
+typedef struct {
+  MockTransport *transport;
+  CockpitCreds *creds;
+  CockpitWebService *service;
+
+  /* The request in flight */
+  CockpitWebResponse *response;
+  GOutputStream *output;
+  gboolean response_done;
+  gchar *scratch;
+} TestCase;
+
+/* A session of @user, whose bridge announced CHECKSUM for @host */
+static void
+start_session (TestCase *tc,
+               const gchar *user,
+               const gchar *host)
+{
+  tc->transport = mock_transport_new ();
+  tc->creds = cockpit_creds_new ("cockpit",
+                                 COCKPIT_CRED_USER, user,
+                                 COCKPIT_CRED_CSRF_TOKEN, "token",
+                                 NULL);
+  tc->service = cockpit_web_service_new (tc->creds, COCKPIT_TRANSPORT (tc->transport));
+  cockpit_web_service_set_host_checksum (tc->service, host, CHECKSUM);
+}
+
+static void
+finish_request (TestCase *tc)
+{
+  g_clear_object (&tc->response);
+  g_clear_object (&tc->output);
+  g_clear_pointer (&tc->scratch, g_free);
+}
+
+static void
+end_session (TestCase *tc)
+{
+  finish_request (tc);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_object_unref (tc->service);
+  g_object_unref (tc->transport);
+  cockpit_creds_unref (tc->creds);
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  start_session (tc, "admin", "localhost");
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  end_session (tc);
+  cockpit_assert_expected ();
+}
+
+static void
+on_response_done (CockpitWebResponse *response,
+                  gboolean reusable,
+                  gpointer user_data)
+{
+  gboolean *response_done = user_data;
+  *response_done = TRUE;
+}
+
+/*
+ * Serves @path of the checksummed package, as a request for @url_root
+ * (or no url root) with one extra request header. Returns the channel
+ * that was opened to the bridge, or NULL if it was served from cache.
+ */
+static gchar *
+serve_request (TestCase *tc,
+               const gchar *url_root,
+               const gchar *path,
+               const gchar *header,
+               const gchar *value)
+{
+  g_autoptr(GHashTable) headers = cockpit_web_server_new_table ();
+  g_autofree gchar *response_path = NULL;
+  g_autofree gchar *original_path = NULL;
+  const gchar *channel = NULL;
+  JsonObject *control;
+  GInputStream *input;
+  GIOStream *io;
+
+  finish_request (tc);
+
+  if (header)
+    g_hash_table_insert (headers, g_strdup (header), g_strdup (value));
+
+  input = g_memory_input_stream_new ();
+  tc->output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, tc->output);
+  g_object_unref (input);
+
+  response_path = g_strdup_printf ("/cockpit/$" CHECKSUM "%s", path);
+  original_path = g_strdup_printf ("%s%s", url_root ? url_root : "", response_path);
+  tc->response = cockpit_web_response_new (io, original_path, response_path, headers, "GET", "https");
+  g_object_unref (io);
+
+  tc->response_done = FALSE;
+  g_signal_connect (tc->response, "done", G_CALLBACK (on_response_done), &tc->response_done);
+
+  cockpit_channel_response_serve (tc->service, headers, tc->response, "$" CHECKSUM, path);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  while ((control = mock_transport_pop_control (tc->transport)))
+    {
+      const gchar *command = NULL;
+      g_assert (cockpit_json_get_string (control, "command", NULL, &command));
+      if (g_str_equal (command, "open"))
+        g_assert (cockpit_json_get_string (control, "channel", NULL, &channel));
+    }
+
+  return g_strdup (channel);
+}
+
+static void
+bridge_send (TestCase *tc,
+             const gchar *channel,
+             const gchar *data,
+             gsize length)
+{
+  g_autoptr(GBytes) payload = g_bytes_new (data, length);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), channel, payload);
+}
+
+static void
+bridge_control (TestCase *tc,
+                const gchar *channel,
+                const gchar *command)
+{
+  g_autoptr(JsonObject) object = cockpit_transport_build_json ("command", command, "channel", channel, NULL);
+  g_autoptr(GBytes) control = cockpit_json_write_bytes (object);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), NULL, control);
+}
+
+/* Sends @prefix as the http-stream1 response, then @body in @chunks pieces */
+static void
+bridge_reply (TestCase *tc,
+              const gchar *channel,
+              const gchar *prefix,
+              const gchar *body,
+              gsize length,
+              guint chunks)
+{
+  gsize offset = 0;
+
+  bridge_send (tc, channel, prefix, strlen (prefix));
+  for (guint i = 0; i < chunks; i++)
+    {
+      gsize size = (i == chunks - 1) ? length - offset : length / chunks;
+      bridge_send (tc, channel, body + offset, size);
+      offset += size;
+    }
+
+  bridge_control (tc, channel, "done");
+  bridge_control (tc, channel, "close");
+}
+
+static const gchar *
+output_as_string (TestCase *tc)
+{
+  while (!tc->response_done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_free (tc->scratch);
+  tc->scratch = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (tc->output)),
+                           g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (tc->output)));
+  return tc->scratch;
+}
+
+/* Returns the body, after checking that the headers announce its exact length */
+static const gchar *
+assert_content_length (const gchar *output)
+{
+  const gchar *body;
+  const gchar *header;
+
+  body = strstr (output, "\r\n\r\n");
+  g_assert (body != NULL);
+  body += 4;
+
+  g_assert (strstr (output, "Transfer-Encoding: chunked") == NULL);
+  header = strstr (output, "Content-Length: ");
+  g_assert (header != NULL && header < body);
+  g_assert_cmpuint (g_ascii_strtoull (header + strlen ("Content-Length: "), NULL, 10), ==, strlen (body));
+
+  return body;
+}
+
+static void
+serve_and_reply (TestCase *tc,
+                 const gchar *path,
+                 const gchar *prefix,
+                 const gchar *body)
+{
+  g_autofree gchar *channel = serve_request (tc, NULL, path, NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel, prefix, body, strlen (body), 1);
+  output_as_string (tc);
+}
+
+static void
+assert_cached (TestCase *tc,
+               const gchar *path)
+{
+  g_autofree gchar *channel = serve_request (tc, NULL, path, NULL, NULL);
+  g_assert_null (channel);
+  output_as_string (tc);
+}
+
+static void
+assert_not_cached (TestCase *tc,
+                   const gchar *path)
+{
+  g_autofree gchar *channel = serve_request (tc, NULL, path, NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_control (tc, channel, "close");
+  output_as_string (tc);
+}
+
+static const gchar *ok_prefix =
+  "{\"status\":200,\"reason\":\"OK\",\"headers\":{\"Content-Type\":\"text/plain\",\"X-Test\":\"yes\"}}";
+
+static void
+test_cache_hit (TestCase *tc,
+                gconstpointer data)
+{
+  const gchar *output;
+
+  serve_and_reply (tc, "/test/hit.txt", ok_prefix, "cached content");
+
+  /* The same resource comes from memory, with the same headers */
+  g_autofree gchar *channel = serve_request (tc, NULL, "/test/hit.txt", NULL, NULL);
+  g_assert_null (channel);
+  output = output_as_string (tc);
+  cockpit_assert_strmatch (output, "HTTP/1.1 200 OK\r\n*X-Test: yes\r\n*");
+  g_assert_cmpstr (assert_content_length (output), ==, "cached content");
+}
+
+static void
+test_cache_forwarded_host (TestCase *tc,
+                           gconstpointer data)
+{
+  const gchar *output;
+  g_autofree gchar *channel = NULL;
+
+  channel = serve_request (tc, NULL, "/test/csp.html", "Host", "one.example.com");
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel,
+                "{\"status\":200,\"reason\":\"OK\",\"headers\":{\"Content-Type\":\"text/html\","
+                "\"Content-Security-Policy\":\"connect-src 'self' wss://one.example.com\"}}",
+                "<html></html>", 13, 1);
+  output_as_string (tc);
+  g_free (channel);
+
+  /* The bridge builds the policy for the host, so another one is not served from cache */
+  channel = serve_request (tc, NULL, "/test/csp.html", "Host", "two.example.com");
+  g_assert (channel != NULL);
+  bridge_control (tc, channel, "close");
+  output_as_string (tc);
+  g_free (channel);
+
+  channel = serve_request (tc, NULL, "/test/csp.html", "Host", "one.example.com");
+  g_assert_null (channel);
+  output = output_as_string (tc);
+  cockpit_assert_strmatch (output, "*wss://one.example.com*");
+}
+
+static void
+test_cache_other_user (TestCase *tc,
+                       gconstpointer data)
+{
+  serve_and_reply (tc, "/test/user.txt", ok_prefix, "for admin");
+  assert_cached (tc, "/test/user.txt");
+
+  /* Checksums are whatever a bridge announces, so nothing is shared between users */
+  end_session (tc);
+  start_session (tc, "other", "localhost");
+  assert_not_cached (tc, "/test/user.txt");
+}
+
+static void
+test_cache_other_host (TestCase *tc,
+                       gconstpointer data)
+{
+  const gchar *old_config = cockpit_config_file;
+  g_autofree gchar *config = NULL;
+  GError *error = NULL;
+  gint fd;
+
+  /* Other hosts are only reachable with AllowMultiHost */
+  fd = g_file_open_tmp ("test-channelresponse-XXXXXX.conf", &config, &error);
+  g_assert_no_error (error);
+  close (fd);
+  g_file_set_contents (config, "[WebService]\nAllowMultiHost = yes\n", -1, &error);
+  g_assert_no_error (error);
+  cockpit_config_file = config;
+  cockpit_conf_cleanup ();
+
+  serve_and_reply (tc, "/test/host.txt", ok_prefix, "from localhost");
+  assert_cached (tc, "/test/host.txt");
+
+  /* The same user, but a bridge that claims the checksum for another host */
+  end_session (tc);
+  start_session (tc, "admin", "other.example.com");
+  assert_not_cached (tc, "/test/host.txt");
+
+  cockpit_config_file = old_config;
+  cockpit_conf_cleanup ();
+  g_unlink (config);
+}
+
+static void
+test_cache_language (TestCase *tc,
+                     gconstpointer data)
+{
+  g_autofree gchar *channel = NULL;
+
+  channel = serve_request (tc, NULL, "/test/po.js", "Accept-Language", "xx, de");
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel, ok_prefix, "german", 6, 1);
+  output_as_string (tc);
+  g_free (channel);
+
+  /* The same first language, but the bridge may have picked another translation */
+  channel = serve_request (tc, NULL, "/test/po.js", "Accept-Language", "xx, fr");
+  g_assert (channel != NULL);
+  bridge_control (tc, channel, "close");
+  output_as_string (tc);
+  g_free (channel);
+
+  channel = serve_request (tc, NULL, "/test/po.js", "Accept-Language", "xx, de");
+  g_assert_null (channel);
+  g_assert_cmpstr (assert_content_length (output_as_string (tc)), ==, "german");
+}
+
+static void
+test_cache_only_ok (TestCase *tc,
+                    gconstpointer data)
+{
+  serve_and_reply (tc, "/test/missing.txt",
+                   "{\"status\":404,\"reason\":\"Not Found\",\"headers\":{}}", "not here");
+  assert_not_cached (tc, "/test/missing.txt");
+}
+
+static void
+test_cache_entry_limit (TestCase *tc,
+                        gconstpointer data)
+{
+  g_autofree gchar *body = g_malloc (CACHE_MAX_ENTRY + 2);
+  g_autofree gchar *prefix = NULL;
+  g_autofree gchar *channel = NULL;
+
+  memset (body, 'x', CACHE_MAX_ENTRY + 1);
+  body[CACHE_MAX_ENTRY + 1] = '\0';
+
+  /* Announced as too large */
+  prefix = g_strdup_printf ("{\"status\":200,\"reason\":\"OK\",\"headers\":{\"Content-Length\":\"%d\"}}",
+                            CACHE_MAX_ENTRY + 1);
+  channel = serve_request (tc, NULL, "/test/large-length.txt", NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel, prefix, body, CACHE_MAX_ENTRY + 1, 1);
+  output_as_string (tc);
+  assert_not_cached (tc, "/test/large-length.txt");
+  g_free (channel);
+
+  /* Found to be too large while streaming */
+  channel = serve_request (tc, NULL, "/test/large-stream.txt", NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel, ok_prefix, body, CACHE_MAX_ENTRY + 1, 2);
+  output_as_string (tc);
+  assert_not_cached (tc, "/test/large-stream.txt");
+  g_free (channel);
+
+  /* Exactly at the limit is fine */
+  channel = serve_request (tc, NULL, "/test/large-limit.txt", NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel, ok_prefix, body, CACHE_MAX_ENTRY, 2);
+  output_as_string (tc);
+  assert_cached (tc, "/test/large-limit.txt");
+}
+
+static void
+test_cache_range (TestCase *tc,
+                  gconstpointer data)
+{
+  g_autofree gchar *channel = NULL;
+
+  serve_and_reply (tc, "/test/range.txt", ok_prefix, "0123456789");
+
+  /* Ranges always go to the bridge */
+  channel = serve_request (tc, NULL, "/test/range.txt", "Range", "bytes=2-4");
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel,
+                "{\"status\":206,\"reason\":\"Partial Content\",\"headers\":{\"Content-Range\":\"bytes 2-4/10\"}}",
+                "234", 3, 1);
+  cockpit_assert_strmatch (output_as_string (tc), "HTTP/1.1 206 Partial Content\r\n*234");
+  g_free (channel);
+
+  /* ... and don't replace the whole resource in the cache */
+  channel = serve_request (tc, NULL, "/test/range.txt", NULL, NULL);
+  g_assert_null (channel);
+  g_assert_cmpstr (assert_content_length (output_as_string (tc)), ==, "0123456789");
+}
+
+static const gchar *html_prefix =
+  "{\"status\":200,\"reason\":\"OK\",\"headers\":{\"Content-Type\":\"text/html\"}}";
+
+static void
+test_cache_inject (TestCase *tc,
+                   gconstpointer data)
+{
+  const gchar *body = "<html><head><title>Test</title></head><body></body></html>";
+  const gchar *output;
+  g_autofree gchar *channel = NULL;
+
+  channel = serve_request (tc, "/prefix", "/test/inject.html", NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel, html_prefix, body, strlen (body), 1);
+  cockpit_assert_strmatch (output_as_string (tc), "*<head>\n    <meta name=\"url-root\" content=\"/prefix\">*");
+
+  /* Twice from the cache, spliced in at the known offset */
+  for (gint i = 0; i < 2; i++)
+    {
+      g_free (channel);
+      channel = serve_request (tc, "/prefix", "/test/inject.html", NULL, NULL);
+      g_assert_null (channel);
+      output = assert_content_length (output_as_string (tc));
+      cockpit_assert_strmatch (output,
+                               "<html><head>\n    <meta name=\"url-root\" content=\"/prefix\">"
+                               "\n    <meta name=\"allow-multihost\" content=\"*\">"
+                               "<title>Test</title></head><body></body></html>");
+    }
+
+  /* Without a url root there's nothing to inject */
+  g_free (channel);
+  channel = serve_request (tc, NULL, "/test/inject.html", NULL, NULL);
+  g_assert_null (channel);
+  g_assert_cmpstr (assert_content_length (output_as_string (tc)), ==, body);
+}
+
+static void
+test_cache_inject_encoded (TestCase *tc,
+                           gconstpointer data)
+{
+  const gchar *body = "<head>not really compressed";
+  const gchar *output;
+  g_autofree gchar *channel = NULL;
+
+  channel = serve_request (tc, "/prefix", "/test/encoded.html", NULL, NULL);
+  g_assert (channel != NULL);
+  bridge_reply (tc, channel,
+                "{\"status\":200,\"reason\":\"OK\",\"headers\":{\"Content-Type\":\"text/html\","
+                "\"Content-Encoding\":\"gzip\"}}",
+                body, strlen (body), 1);
+  output_as_string (tc);
+
+  /* Encoded content is served as it is */
+  g_free (channel);
+  channel = serve_request (tc, "/prefix", "/test/encoded.html", NULL, NULL);
+  g_assert_null (channel);
+  output = output_as_string (tc);
+  cockpit_assert_strmatch (output, "*Content-Encoding: gzip\r\n*");
+  g_assert (strstr (output, body) != NULL);
+  g_assert (strstr (output, "url-root") == NULL);
+}
+
+static void
+test_cache_eviction (TestCase *tc,
+                     gconstpointer data)
+{
+  /* Big entries that leave a bit of room for small ones */
+  const gsize big_size = CACHE_MAX_ENTRY - 1024;
+  g_autofree gchar *big = g_malloc (big_size + 1);
+  g_autofree gchar *small = g_malloc (10 * 1024 + 1);
+
+  memset (big, 'b', big_size);
+  big[big_size] = '\0';
+  memset (small, 's', 10 * 1024);
+  small[10 * 1024] = '\0';
+
+  serve_and_reply (tc, "/test/evict-a.txt", ok_prefix, small);
+  serve_and_reply (tc, "/test/evict-b.txt", ok_prefix, small);
+
+  /* Now b is the least recently used one */
+  assert_cached (tc, "/test/evict-a.txt");
+
+  /*
+   * Fill the cache with big entries, which leaves room for only 16 KiB
+   * of small ones. Everything from earlier tests and b has to go.
+   */
+  for (gint i = 0; i < CACHE_MAX_SIZE / CACHE_MAX_ENTRY; i++)
+    {
+      g_autofree gchar *path = g_strdup_printf ("/test/evict-big-%d.txt", i);
+      serve_and_reply (tc, path, ok_prefix, big);
+    }
+
+  assert_cached (tc, "/test/evict-a.txt");
+  assert_not_cached (tc, "/test/evict-b.txt");
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/channelresponse/cache/hit", TestCase, NULL,
+              setup, test_cache_hit, teardown);
+  g_test_add ("/channelresponse/cache/forwarded-host", TestCase, NULL,
+              setup, test_cache_forwarded_host, teardown);
+  g_test_add ("/channelresponse/cache/other-user", TestCase, NULL,
+              setup, test_cache_other_user, teardown);
+  g_test_add ("/channelresponse/cache/other-host", TestCase, NULL,
+              setup, test_cache_other_host, teardown);
+  g_test_add ("/channelresponse/cache/language", TestCase, NULL,
+              setup, test_cache_language, teardown);
+  g_test_add ("/channelresponse/cache/only-ok", TestCase, NULL,
+              setup, test_cache_only_ok, teardown);
+  g_test_add ("/channelresponse/cache/entry-limit", TestCase, NULL,
+              setup, test_cache_entry_limit, teardown);
+  g_test_add ("/channelresponse/cache/range", TestCase, NULL,
+              setup, test_cache_range, teardown);
+  g_test_add ("/channelresponse/cache/inject", TestCase, NULL,
+              setup, test_cache_inject, teardown);
+  g_test_add ("/channelresponse/cache/inject-encoded", TestCase, NULL,
+              setup, test_cache_inject_encoded, teardown);
+  g_test_add ("/channelresponse/cache/eviction", TestCase, NULL,
+              setup, test_cache_eviction, teardown);
+
+  return g_test_run ();
+}
@@ -701,6 +701,54 @@ test_consume_skip (void)
   g_bytes_unref (bytes);
 }
 
+static void
+test_take_partial (void)
+{
+  GByteArray *buffer;
+  GBytes *bytes;
+  GBytes *view;
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (guint8 *)"Marmaalaaaade!", 15);
+
+  bytes = cockpit_pipe_take (buffer, 7);
+  g_assert_cmpuint (buffer->len, ==, 8);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "aaaade!");
+
+  /* Can still append to the remaining buffer */
+  g_byte_array_append (buffer, (guint8 *)"x", 1);
+  g_assert_cmpuint (buffer->len, ==, 9);
+  g_byte_array_free (buffer, TRUE);
+
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 7);
+  g_assert (memcmp (g_bytes_get_data (bytes, NULL), "Marmaal", 7) == 0);
+
+  /* Views share the same memory */
+  view = g_bytes_new_from_bytes (bytes, 4, 3);
+  g_assert (g_bytes_get_data (view, NULL) == (guint8 *)g_bytes_get_data (bytes, NULL) + 4);
+  g_bytes_unref (bytes);
+  g_assert (memcmp (g_bytes_get_data (view, NULL), "aal", 3) == 0);
+  g_bytes_unref (view);
+}
+
+static void
+test_take_entire (void)
+{
+  GByteArray *buffer;
+  GBytes *bytes;
+
+  buffer = g_byte_array_new ();
+  g_byte_array_append (buffer, (guint8 *)"Marmaalaaaade!", 15);
+
+  bytes = cockpit_pipe_take (buffer, 15);
+  g_assert_cmpuint (buffer->len, ==, 0);
+  g_byte_array_free (buffer, TRUE);
+
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 15);
+  g_assert_cmpstr (g_bytes_get_data (bytes, NULL), ==, "Marmaalaaaade!");
+  g_bytes_unref (bytes);
+}
+
 static void
 test_buffer_skip (void)
 {
@@ -1194,6 +1242,8 @@ main (int argc,
   g_test_add_func ("/pipe/buffer/consume-entire", test_consume_entire);
   g_test_add_func ("/pipe/buffer/consume-partial", test_consume_partial);
   g_test_add_func ("/pipe/buffer/consume-skip", test_consume_skip);
+  g_test_add_func ("/pipe/buffer/take-partial", test_take_partial);
+  g_test_add_func ("/pipe/buffer/take-entire", test_take_entire);
   g_test_add_func ("/pipe/buffer/skip", test_buffer_skip);
 
   g_test_add_func ("/pipe/properties", test_properties);
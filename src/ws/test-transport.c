@@ -588,6 +588,33 @@ test_parse_frame_bad (void)
   cockpit_assert_expected ();
 }
 
+static void
+test_parse_frame_span (void)
+{
+  GBytes *message;
+  const gchar *channel;
+  gsize channel_len;
+
+  message = g_bytes_new_static ("134\ntest", 8);
+  g_assert (cockpit_transport_parse_frame_span (message, &channel, &channel_len));
+  g_assert (channel == g_bytes_get_data (message, NULL));
+  g_assert_cmpuint (channel_len, ==, 3);
+  g_bytes_unref (message);
+
+  message = g_bytes_new_static ("\n{}", 3);
+  g_assert (cockpit_transport_parse_frame_span (message, &channel, &channel_len));
+  g_assert_cmpuint (channel_len, ==, 0);
+  g_bytes_unref (message);
+
+  g_test_expect_message ("cockpit-protocol", G_LOG_LEVEL_MESSAGE, "*invalid channel prefix");
+
+  message = g_bytes_new_static ("b\x00y\ntest", 8);
+  g_assert (!cockpit_transport_parse_frame_span (message, &channel, &channel_len));
+  g_bytes_unref (message);
+
+  cockpit_assert_expected ();
+}
+
 static void
 test_parse_command (void)
 {
@@ -697,6 +724,7 @@ main (int argc,
 
   g_test_add_func ("/transport/parse-frame/ok", test_parse_frame);
   g_test_add_func ("/transport/parse-frame/bad", test_parse_frame_bad);
+  g_test_add_func ("/transport/parse-frame/span", test_parse_frame_span);
 
   g_test_add_func ("/transport/parse-command/normal", test_parse_command);
   g_test_add_func ("/transport/parse-command/no-channel", test_parse_command_no_channel);
@@ -58,6 +58,102 @@ test_force_utf8 (gconstpointer data)
   g_bytes_unref (output);
 }
 
+static void
+test_scan_repair (gconstpointer data)
+{
+  const Fixture *fixture = data;
+  const gchar *expect;
+  GBytes *input;
+  GBytes *output;
+  gsize length;
+  gsize valid;
+  gsize tail;
+
+  g_assert (data != NULL);
+
+  length = strlen (fixture->input);
+  valid = cockpit_unicode_scan (fixture->input, length, &tail);
+  g_assert_cmpuint (valid, ==, cockpit_unicode_valid_length (fixture->input, length));
+  g_assert ((tail > 0) == fixture->incomplete);
+
+  input = g_bytes_new_static (fixture->input, length);
+  output = cockpit_unicode_repair (input, valid, tail);
+
+  expect = fixture->output ? fixture->output : fixture->input;
+  cockpit_assert_bytes_eq (output, expect, -1);
+
+  g_bytes_unref (input);
+  g_bytes_unref (output);
+}
+
+static void
+check_valid_length (const gchar *data,
+                    gsize length)
+{
+  const gchar *end;
+
+  g_utf8_validate (data, length, &end);
+  g_assert_cmpuint (cockpit_unicode_valid_length (data, length), ==, end - data);
+}
+
+static void
+test_valid_length (void)
+{
+  static const gchar *chars[] = {
+    "a", "\303\244", "\342\224\200", "\360\237\230\200", /* valid */
+    "\300\257", "\340\200\200", "\360\200\200\200",       /* overlong */
+    "\355\240\200", "\364\220\200\200",                 /* surrogate, too large */
+    "\303", "\342\224", "\200", "\377",                   /* truncated, stray */
+  };
+  gchar buffer[80];
+  gsize i, j, pos;
+
+  /* Each kind of character, at every offset around the block boundaries */
+  for (i = 0; i < G_N_ELEMENTS (chars); i++)
+    {
+      for (pos = 0; pos < 40; pos++)
+        {
+          memset (buffer, 'x', sizeof (buffer));
+          memcpy (buffer + pos, chars[i], strlen (chars[i]));
+          for (j = pos; j <= sizeof (buffer); j++)
+            check_valid_length (buffer, j);
+        }
+    }
+
+  /* NUL is invalid, as for g_utf8_validate() */
+  memset (buffer, 'x', sizeof (buffer));
+  buffer[37] = '\0';
+  g_assert_cmpuint (cockpit_unicode_valid_length (buffer, sizeof (buffer)), ==, 37);
+  check_valid_length (buffer, sizeof (buffer));
+}
+
+static void
+test_valid_length_perf (void)
+{
+  const gsize size = 16 * 1024 * 1024;
+  gchar *data;
+  gdouble glib, ours;
+  gsize i;
+
+  /* Mostly ASCII with some multibyte characters, like journal output */
+  data = g_malloc (size);
+  for (i = 0; i + 3 <= size; i += 3)
+    memcpy (data + i, (i % 300) ? "abc" : "\342\224\200", 3);
+  memset (data + i, 'x', size - i);
+
+  g_test_timer_start ();
+  g_assert (g_utf8_validate (data, size, NULL));
+  glib = g_test_timer_elapsed ();
+
+  g_test_timer_start ();
+  g_assert_cmpuint (cockpit_unicode_valid_length (data, size), ==, size);
+  ours = g_test_timer_elapsed ();
+
+  g_test_minimized_result (ours, "validated %" G_GSIZE_FORMAT " bytes in %f seconds, g_utf8_validate() took %f",
+                           size, ours, glib);
+  g_free (data);
+}
+
 static const Fixture fixtures[] = {
   { "this is a ascii", NULL, FALSE },
   { "this is \303\244 utf8", NULL, FALSE },
@@ -76,6 +172,7 @@ main (int argc,
   gchar *escaped;
   gchar *name;
   gchar *name2;
+  gchar *name3;
   gint i;
 
   cockpit_test_init (&argc, &argv);
@@ -86,13 +183,20 @@ main (int argc,
       escaped = g_strcanon (g_strdup (fixtures[i].input), COCKPIT_TEST_CHARS, '_');
       name = g_strdup_printf ("/unicode/force-utf8/%s", escaped);
       name2 = g_strdup_printf ("/unicode/incomplete-utf8/%s", escaped);
+      name3 = g_strdup_printf ("/unicode/scan-repair/%s", escaped);
       g_free (escaped);
 
       g_test_add_data_func (name, fixtures + i, test_force_utf8);
       g_test_add_data_func (name2, fixtures + i, test_incomplete_utf8);
+      g_test_add_data_func (name3, fixtures + i, test_scan_repair);
       g_free (name);
       g_free (name2);
+      g_free (name3);
     }
 
+  g_test_add_func ("/unicode/valid-length", test_valid_length);
+  if (g_test_perf ())
+    g_test_add_func ("/unicode/perf/valid-length", test_valid_length_perf);
+
   return g_test_run ();
 }
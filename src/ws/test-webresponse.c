@@ -421,10 +421,11 @@ test_cache (TestCase *tc,
   off = web_socket_util_parse_headers (resp + off, length - off, &headers);
   g_assert_cmpuint (off, >, 0);
 
+  /* index.html is compressible, so the response always varies with Accept-Encoding */
   if (fixture->cache == COCKPIT_WEB_RESPONSE_CACHE)
-    g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Cookie");
+    g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Cookie, Accept-Encoding");
   else
-    g_assert_null (g_hash_table_lookup (headers, "Vary"));
+    g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Accept-Encoding");
 
   if (fixture->cache == COCKPIT_WEB_RESPONSE_NO_CACHE)
     g_assert_cmpstr (g_hash_table_lookup (headers, "Cache-Control"), ==, "no-cache, no-store");
@@ -435,6 +436,223 @@ test_cache (TestCase *tc,
   g_hash_table_unref (headers);
 }
 
+static gchar *
+request_file (const gchar **roots,
+              const gchar *path,
+              const gchar *header,
+              const gchar *value)
+{
+  CockpitWebResponse *response;
+  GHashTable *headers = NULL;
+  GOutputStream *output;
+  GInputStream *input;
+  gboolean done = FALSE;
+  GIOStream *io;
+  gchar *resp;
+
+  input = g_memory_input_stream_new ();
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  io = g_simple_io_stream_new (input, output);
+  g_object_unref (input);
+
+  if (header)
+    {
+      headers = cockpit_web_server_new_table ();
+      g_hash_table_insert (headers, g_strdup (header), g_strdup (value));
+    }
+
+  response = cockpit_web_response_new (io, path, path, headers, "GET", "http");
+  g_signal_connect (response, "done", G_CALLBACK (on_response_done), &done);
+  cockpit_web_response_file (response, NULL, roots);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  resp = g_strndup (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+                    g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+
+  if (headers)
+    g_hash_table_unref (headers);
+  g_object_unref (response);
+  g_object_unref (output);
+  g_object_unref (io);
+  return resp;
+}
+
+static void
+test_file_cache_changes (void)
+{
+  g_autofree gchar *first = g_dir_make_tmp ("test-webresponse.XXXXXX", NULL);
+  g_autofree gchar *second = g_dir_make_tmp ("test-webresponse.XXXXXX", NULL);
+  g_autofree gchar *first_file = g_build_filename (first, "file.txt", NULL);
+  g_autofree gchar *second_file = g_build_filename (second, "file.txt", NULL);
+  const gchar *roots[] = { first, second, NULL };
+  gchar *resp;
+
+  g_assert (g_file_set_contents (second_file, "one", -1, NULL));
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\none");
+  g_free (resp);
+
+  /* Served again, this time from the cache */
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\none");
+  g_free (resp);
+
+  /* Changed contents are noticed */
+  g_assert (g_file_set_contents (second_file, "two", -1, NULL));
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\ntwo");
+  g_free (resp);
+
+  /* A file appearing in an earlier root takes precedence */
+  g_assert (g_file_set_contents (first_file, "three", -1, NULL));
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\nthree");
+  g_free (resp);
+
+  /* And removing files is noticed too */
+  g_assert_cmpint (g_unlink (first_file), ==, 0);
+  g_assert_cmpint (g_unlink (second_file), ==, 0);
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 404 Not Found*");
+  g_free (resp);
+
+  g_assert_cmpint (g_rmdir (first), ==, 0);
+  g_assert_cmpint (g_rmdir (second), ==, 0);
+}
+
+static void
+test_file_cache_gzip (void)
+{
+  g_autofree gchar *dir = g_dir_make_tmp ("test-webresponse.XXXXXX", NULL);
+  g_autofree gchar *file = g_build_filename (dir, "file.css", NULL);
+  const gchar *roots[] = { dir, NULL };
+  GString *contents;
+  gchar *resp;
+  gint i;
+
+  contents = g_string_new ("");
+  for (i = 0; i < 100; i++)
+    g_string_append_printf (contents, "#brand-%d { content: \"test\"; }\n", i);
+  g_assert (g_file_set_contents (file, contents->str, contents->len, NULL));
+
+  resp = request_file (roots, "/file.css", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*Vary: Accept-Encoding\r\n*#brand-99*");
+  g_assert (strstr (resp, "Content-Encoding") == NULL);
+  g_free (resp);
+
+  resp = request_file (roots, "/file.css", "Accept-Encoding", "deflate, gzip");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*Content-Encoding: gzip\r\n*Vary: Accept-Encoding\r\n*");
+  g_assert (strstr (resp, "#brand-99") == NULL);
+  g_free (resp);
+
+  resp = request_file (roots, "/file.css", "Accept-Encoding", "gzip;q=0");
+  g_assert (strstr (resp, "Content-Encoding") == NULL);
+  g_free (resp);
+
+  g_string_free (contents, TRUE);
+  g_assert_cmpint (g_unlink (file), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+static void
+test_file_conditional (void)
+{
+  g_autofree gchar *dir = g_dir_make_tmp ("test-webresponse.XXXXXX", NULL);
+  g_autofree gchar *file = g_build_filename (dir, "file.txt", NULL);
+  const gchar *roots[] = { dir, NULL };
+  GHashTable *headers;
+  gchar *etag;
+  gchar *last_modified;
+  gchar *resp;
+  gssize off;
+
+  g_assert (g_file_set_contents (file, "one", -1, NULL));
+
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  off = web_socket_util_parse_status_line (resp, strlen (resp), NULL, NULL, NULL);
+  g_assert_cmpint (off, >, 0);
+  g_assert_cmpint (web_socket_util_parse_headers (resp + off, strlen (resp + off), &headers), >, 0);
+  etag = g_strdup (g_hash_table_lookup (headers, "ETag"));
+  last_modified = g_strdup (g_hash_table_lookup (headers, "Last-Modified"));
+  g_assert (g_str_has_prefix (etag, "\""));
+  cockpit_assert_strmatch (last_modified, "*, * GMT");
+  g_hash_table_unref (headers);
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "If-None-Match", etag);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 304 Not Modified\r\n*ETag: *\r\n\r\n");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "If-Modified-Since", last_modified);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 304 Not Modified\r\n*");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "If-None-Match", "\"other\"");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\none");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "If-Modified-Since", "Thu, 01 Jan 1970 00:00:00 GMT");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\none");
+  g_free (resp);
+
+  /* Changing the contents changes the ETag */
+  g_assert (g_file_set_contents (file, "two", -1, NULL));
+  resp = request_file (roots, "/file.txt", "If-None-Match", etag);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*\r\n\r\ntwo");
+  g_free (resp);
+
+  g_free (etag);
+  g_free (last_modified);
+  g_assert_cmpint (g_unlink (file), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+static void
+test_file_range (void)
+{
+  g_autofree gchar *dir = g_dir_make_tmp ("test-webresponse.XXXXXX", NULL);
+  g_autofree gchar *file = g_build_filename (dir, "file.txt", NULL);
+  const gchar *roots[] = { dir, NULL };
+  gchar *resp;
+
+  g_assert (g_file_set_contents (file, "0123456789", -1, NULL));
+
+  resp = request_file (roots, "/file.txt", NULL, NULL);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*Accept-Ranges: bytes\r\n*\r\n\r\n0123456789");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "Range", "bytes=2-4");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 206 Partial Content\r\n*Content-Range: bytes 2-4/10\r\n*"
+                           "Content-Length: 3\r\n*\r\n\r\n234");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "Range", "bytes=-3");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 206 Partial Content\r\n*Content-Range: bytes 7-9/10\r\n*\r\n\r\n789");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "Range", "bytes=0-1, 8-");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 206 Partial Content\r\n*"
+                           "Content-Type: multipart/byteranges; boundary=*\r\n\r\n"
+                           "\r\n--*\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-1/10\r\n\r\n01"
+                           "\r\n--*\r\nContent-Type: text/plain\r\nContent-Range: bytes 8-9/10\r\n\r\n89"
+                           "\r\n--*--\r\n");
+  g_free (resp);
+
+  resp = request_file (roots, "/file.txt", "Range", "bytes=10-");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 416 Range Not Satisfiable\r\n*Content-Range: bytes */10\r\n*");
+  g_free (resp);
+
+  /* Invalid ranges are ignored */
+  resp = request_file (roots, "/file.txt", "Range", "bytes=4-2");
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK\r\n*\r\n\r\n0123456789");
+  g_free (resp);
+
+  g_assert_cmpint (g_unlink (file), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
 static void
 test_content_encoding (TestCase *tc,
                        gconstpointer data)
@@ -1459,6 +1677,11 @@ main (int argc,
   g_test_add ("/web-response/cache-unset", TestCase, &cache_unset_fixture,
               setup, test_cache, teardown);
 
+  g_test_add_func ("/web-response/file/cache-changes", test_file_cache_changes);
+  g_test_add_func ("/web-response/file/cache-gzip", test_file_cache_gzip);
+  g_test_add_func ("/web-response/file/conditional", test_file_conditional);
+  g_test_add_func ("/web-response/file/range", test_file_range);
+
   g_test_add ("/web-response/filter/simple", TestCase, NULL,
               setup, test_web_filter_simple, teardown);
   g_test_add ("/web-response/filter/multiple", TestCase, NULL,
@@ -502,6 +502,89 @@ test_webserver_not_found (Fixture *fixture,
 
 
 
+static guint
+count_responses (const gchar *resp)
+{
+  guint count = 0;
+
+  while ((resp = strstr (resp, "HTTP/1.1 ")))
+    {
+      count++;
+      resp++;
+    }
+
+  return count;
+}
+
+static void
+test_keep_alive_pipelined (Fixture *fixture,
+                           const TestCase *test_case)
+{
+  gchar *resp;
+  gsize length;
+
+  g_signal_connect (fixture->web_server, "handle-resource", G_CALLBACK (on_shell_index_html), NULL);
+
+  /* All written at once, and the second one has a body that is refused */
+  resp = perform_http_request (fixture->localport,
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n"
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\nContent-Length: 4\r\n\r\nbody"
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n", &length);
+  g_assert (resp != NULL);
+
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 *<!DOCTYPE html>*"
+                                 "HTTP/1.1 413 *"
+                                 "HTTP/1.1 200 *<!DOCTYPE html>*");
+  g_assert_cmpuint (count_responses (resp), ==, 3);
+  g_assert (strstr (resp, "Connection: close") == NULL);
+  g_free (resp);
+}
+
+static void
+test_keep_alive_large_body (Fixture *fixture,
+                            const TestCase *test_case)
+{
+  gchar *resp;
+  gsize length;
+
+  g_signal_connect (fixture->web_server, "handle-resource", G_CALLBACK (on_shell_index_html), NULL);
+
+  /* A length that would wrap around is refused, and nothing after it is read */
+  cockpit_expect_message ("received too large Content-Length");
+  resp = perform_http_request (fixture->localport,
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\nContent-Length: 18446744073709551615\r\n\r\n"
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n", &length);
+  g_assert (resp != NULL);
+
+  g_assert_cmpuint (count_responses (resp), ==, 1);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 413 *\r\nConnection: close\r\n*");
+  g_free (resp);
+}
+
+static void
+test_keep_alive_maximum (Fixture *fixture,
+                         const TestCase *test_case)
+{
+  guint maximum = cockpit_webserver_keep_alive_maximum;
+  gchar *resp;
+  gsize length;
+
+  g_signal_connect (fixture->web_server, "handle-resource", G_CALLBACK (on_shell_index_html), NULL);
+
+  /* The connection is closed after the second request */
+  cockpit_webserver_keep_alive_maximum = 2;
+  resp = perform_http_request (fixture->localport,
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n"
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n"
+                               "GET /shell/index.html HTTP/1.1\r\nHost:test\r\n\r\n", &length);
+  cockpit_webserver_keep_alive_maximum = maximum;
+  g_assert (resp != NULL);
+
+  g_assert_cmpuint (count_responses (resp), ==, 2);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 *HTTP/1.1 200 *\r\nConnection: close\r\n*");
+  g_free (resp);
+}
+
 static void
 test_webserver_redirect_notls (Fixture *fixture,
                                const TestCase *test_case)
@@ -725,6 +808,49 @@ test_webserver_host_header (Fixture *fixture,
   g_free (resp);
 }
 
+static gboolean
+on_handle_stream_headers (CockpitWebServer *server,
+                          CockpitWebRequest *request,
+                          gpointer user_data)
+{
+  GHashTable *headers;
+
+  /* Before and after the table of headers is made */
+  for (gint i = 0; i < 2; i++)
+    {
+      g_assert_cmpstr (cockpit_web_request_lookup_header (request, "host"), ==, "test");
+      g_assert_cmpstr (cockpit_web_request_lookup_header (request, "X-Dup"), ==, "two");
+      g_assert_cmpstr (cockpit_web_request_lookup_header (request, "X-Other"), ==, "value");
+      g_assert (cockpit_web_request_lookup_header (request, "Accept-Encoding") == NULL);
+      g_assert (cockpit_web_request_lookup_header (request, "X-Missing") == NULL);
+
+      g_autofree gchar *cookie = cockpit_web_request_parse_cookie (request, "c");
+      g_assert_cmpstr (cookie, ==, "v");
+
+      headers = cockpit_web_request_get_headers (request);
+      g_assert_cmpuint (g_hash_table_size (headers), ==, 4);
+    }
+
+  * (gboolean *)user_data = TRUE;
+  return FALSE;
+}
+
+static void
+test_webserver_lookup_header (Fixture *fixture,
+                              const TestCase *test_case)
+{
+  gboolean checked = FALSE;
+  gchar *resp;
+
+  g_signal_connect (fixture->web_server, "handle-stream", G_CALLBACK (on_handle_stream_headers), &checked);
+  resp = perform_http_request (fixture->localport,
+                               "GET /index.html HTTP/1.0\r\nHost: test\r\nX-Dup: one\r\n"
+                               "Cookie: a=b; c=v\r\nx-dup: two\r\nX-Other:value \r\n\r\n", NULL);
+  g_assert (resp != NULL);
+  g_assert (checked);
+  g_free (resp);
+}
+
 static void
 test_url_root (Fixture *fixture,
                const TestCase *test_case)
@@ -962,7 +1088,11 @@ main (int argc,
 
   cockpit_test_add ("/web-server/query-string", test_with_query_string);
   cockpit_test_add ("/web-server/host-header", test_webserver_host_header);
+  cockpit_test_add ("/web-server/lookup-header", test_webserver_lookup_header);
   cockpit_test_add ("/web-server/not-found", test_webserver_not_found);
+  cockpit_test_add ("/web-server/keep-alive/pipelined", test_keep_alive_pipelined);
+  cockpit_test_add ("/web-server/keep-alive/large-body", test_keep_alive_large_body);
+  cockpit_test_add ("/web-server/keep-alive/maximum", test_keep_alive_maximum);
 
   cockpit_test_add ("/web-server/redirect-notls", test_webserver_redirect_notls,
                     .server_flags=COCKPIT_WEB_SERVER_REDIRECT_TLS);
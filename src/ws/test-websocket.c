@@ -13,6 +13,7 @@
 #include "testlib/mock-pressure.h"
 
 #include <string.h>
+#include <zlib.h>
 
 typedef struct {
   WebSocketConnection *client;
@@ -373,6 +374,69 @@ test_parse_headers_bad (void)
     }
 }
 
+static void
+test_scan_headers (void)
+{
+  WebSocketHeaderSpan spans[4];
+  gsize n_spans = G_N_ELEMENTS (spans);
+  gssize ret;
+
+  const gchar *input =
+      "Header1: value3\r\n"
+      "  Head3:  Another \r\n"
+      "Empty:\r\n"
+      "header1:value4\n"
+      "\r\n"
+      "BODY  ";
+
+  ret = web_socket_util_scan_headers (input, strlen (input), spans, &n_spans);
+  g_assert_cmpint (ret, ==, strlen (input) - 6);
+  g_assert_cmpuint (n_spans, ==, 4);
+
+  g_assert_cmpint (spans[0].name_len, ==, 7);
+  g_assert (strncmp (spans[0].name, "Header1", 7) == 0);
+  g_assert_cmpint (spans[0].value_len, ==, 6);
+  g_assert (strncmp (spans[0].value, "value3", 6) == 0);
+  g_assert_cmpint (spans[1].name_len, ==, 5);
+  g_assert (strncmp (spans[1].name, "Head3", 5) == 0);
+  g_assert_cmpint (spans[1].value_len, ==, 7);
+  g_assert (strncmp (spans[1].value, "Another", 7) == 0);
+  g_assert_cmpint (spans[2].value_len, ==, 0);
+  g_assert (strncmp (spans[3].value, "value4", 6) == 0);
+
+  /* Everything points into the input */
+  g_assert (spans[3].value >= input && spans[3].value < input + ret);
+}
+
+static void
+test_scan_headers_limits (void)
+{
+  WebSocketHeaderSpan spans[2];
+  gsize n_spans;
+  gssize ret;
+
+  const gchar *input =
+      "One: 1\r\n"
+      "Two: 2\r\n"
+      "Three: 3\r\n"
+      "\r\n";
+
+  /* Not enough room */
+  n_spans = G_N_ELEMENTS (spans);
+  ret = web_socket_util_scan_headers (input, strlen (input), spans, &n_spans);
+  g_assert_cmpint (ret, ==, -1);
+
+  /* Not enough data */
+  n_spans = G_N_ELEMENTS (spans);
+  ret = web_socket_util_scan_headers (input, 14, spans, &n_spans);
+  g_assert_cmpint (ret, ==, 0);
+
+  /* Invalid */
+  n_spans = G_N_ELEMENTS (spans);
+  ret = web_socket_util_scan_headers ("Header1 value3\r\n\r\n", 18, spans, &n_spans);
+  g_assert_cmpint (ret, ==, -1);
+}
+
 static void
 test_header_equals (void)
 {
@@ -650,6 +714,69 @@ test_send_big_packets (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+on_message_collect (WebSocketConnection *ws,
+                    WebSocketDataType type,
+                    GBytes *message,
+                    gpointer user_data)
+{
+  GPtrArray *received = user_data;
+  g_ptr_array_add (received, g_bytes_ref (message));
+}
+
+static void
+test_receive_big_and_small (Test *test,
+                            gconstpointer data)
+{
+  const guint8 mask[4] = { 0xa1, 0xb2, 0xc3, 0xd4 };
+  GPtrArray *received;
+  GByteArray *frames;
+  GBytes *expect;
+  GIOStream *io;
+  guint8 header[8];
+  gchar *big;
+  gsize i;
+
+  received = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_signal_connect (test->server, "message", G_CALLBACK (on_message_collect), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (test->client) != WEB_SOCKET_STATE_CONNECTING);
+  io = web_socket_connection_get_io_stream (test->client);
+
+  /* A large unfragmented frame immediately followed by a small one */
+  big = g_strnfill (20000, 'x');
+  frames = g_byte_array_new ();
+  header[0] = 0x81;
+  header[1] = 0x80 | 126;
+  header[2] = 20000 >> 8;
+  header[3] = 20000 & 0xff;
+  memcpy (header + 4, mask, 4);
+  g_byte_array_append (frames, header, 8);
+  for (i = 0; i < 20000; i++)
+    big[i] ^= mask[i & 3];
+  g_byte_array_append (frames, (guint8 *)big, 20000);
+  g_byte_array_append (frames, (guint8 *)"\x81\x84\0\0\0\0tail", 10);
+
+  g_assert (g_output_stream_write_all (g_io_stream_get_output_stream (io), frames->data, frames->len,
+                                       NULL, NULL, NULL));
+  g_byte_array_unref (frames);
+  g_free (big);
+
+  WAIT_UNTIL (received->len == 2);
+
+  big = g_strnfill (20000, 'x');
+  expect = g_bytes_new_take (big, 20000);
+  g_assert (g_bytes_equal (received->pdata[0], expect));
+  g_assert_cmpint (((const gchar *)g_bytes_get_data (received->pdata[0], NULL))[20000], ==, '\0');
+  g_bytes_unref (expect);
+
+  expect = g_bytes_new_static ("tail", 4);
+  g_assert (g_bytes_equal (received->pdata[1], expect));
+  g_bytes_unref (expect);
+
+  g_ptr_array_unref (received);
+}
+
 static void
 on_pressure_set_throttle (WebSocketConnection *socket,
                           gboolean throttle,
@@ -782,6 +909,59 @@ test_send_prefixed (Test *test,
   g_bytes_unref (received);
 }
 
+static void
+send_many_prefixed (WebSocketConnection *sender,
+                    WebSocketConnection *receiver)
+{
+  GByteArray *received = NULL;
+  GString *expected = NULL;
+  GBytes *prefix = NULL;
+  GBytes *payload = NULL;
+  gchar *message;
+  gint i;
+
+  received = g_byte_array_new ();
+  g_signal_connect (receiver, "message", G_CALLBACK (on_message_append), received);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (sender) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (sender), ==, WEB_SOCKET_STATE_OPEN);
+
+  /* Lots of small messages, which get coalesced when written out */
+  prefix = g_bytes_new_static ("channel\n", 8);
+  expected = g_string_new ("");
+  for (i = 0; i < 1000; i++)
+    {
+      message = g_strdup_printf ("message %d;", i);
+      g_string_append_printf (expected, "channel\n%s", message);
+      payload = g_bytes_new_take (message, strlen (message));
+      web_socket_connection_send (sender, WEB_SOCKET_DATA_TEXT, prefix, payload);
+      g_bytes_unref (payload);
+    }
+
+  WAIT_UNTIL (received->len >= expected->len);
+  g_assert_cmpint (received->len, ==, expected->len);
+  g_assert (memcmp (received->data, expected->str, expected->len) == 0);
+  g_assert_cmpuint (web_socket_connection_get_buffered_amount (sender), ==, 0);
+
+  g_string_free (expected, TRUE);
+  g_byte_array_free (received, TRUE);
+  g_bytes_unref (prefix);
+}
+
+static void
+test_send_many_server_to_client (Test *test,
+                                 gconstpointer data)
+{
+  send_many_prefixed (test->server, test->client);
+}
+
+static void
+test_send_many_client_to_server (Test *test,
+                                 gconstpointer data)
+{
+  send_many_prefixed (test->client, test->server);
+}
+
 static void
 test_send_bad_data (Test *test,
                     gconstpointer unused)
@@ -1241,6 +1421,297 @@ test_handshake_with_buffer_and_headers (void)
   g_object_unref (ios);
 }
 
+static WebSocketConnection *
+setup_deflate_server (GIOStream *ios,
+                      const gchar *extensions,
+                      guint window_bits)
+{
+  WebSocketConnection *server;
+  GHashTable *headers;
+
+  headers = web_socket_util_new_headers ();
+  g_hash_table_insert (headers, g_strdup ("Upgrade"), g_strdup ("websocket"));
+  g_hash_table_insert (headers, g_strdup ("Connection"), g_strdup ("Upgrade"));
+  g_hash_table_insert (headers, g_strdup ("Sec-WebSocket-Version"), g_strdup ("13"));
+  g_hash_table_insert (headers, g_strdup ("Sec-WebSocket-Key"), g_strdup ("dGhlIHNhbXBsZSBub25jZQ=="));
+  g_hash_table_insert (headers, g_strdup ("Host"), g_strdup ("localhost"));
+  if (extensions)
+    g_hash_table_insert (headers, g_strdup ("Sec-WebSocket-Extensions"), g_strdup (extensions));
+
+  server = web_socket_server_new_for_stream (NULL, NULL, ios, headers, NULL);
+  g_object_set (server, "deflate-window-bits", window_bits, NULL);
+  g_signal_connect (server, "error", G_CALLBACK (on_error_not_reached), NULL);
+  g_hash_table_unref (headers);
+
+  WAIT_UNTIL (web_socket_connection_get_ready_state (server) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpint (web_socket_connection_get_ready_state (server), ==, WEB_SOCKET_STATE_OPEN);
+
+  return server;
+}
+
+/* Reads from @io while running the main loop, until at least @want bytes are available */
+static void
+read_raw_until (GIOStream *io,
+                GByteArray *buffer,
+                gsize want)
+{
+  GPollableInputStream *input = G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (io));
+  GError *error = NULL;
+  guint8 data[4096];
+  gssize count;
+
+  while (buffer->len < want)
+    {
+      g_main_context_iteration (NULL, FALSE);
+      count = g_pollable_input_stream_read_nonblocking (input, data, sizeof (data), NULL, &error);
+      if (count < 0)
+        {
+          g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+          g_clear_error (&error);
+        }
+      else
+        {
+          g_assert_cmpint (count, >, 0);
+          g_byte_array_append (buffer, data, count);
+        }
+    }
+}
+
+static gchar *
+read_raw_handshake (GIOStream *io,
+                    GByteArray *buffer)
+{
+  const gchar *end;
+  gchar *response;
+  gsize len;
+
+  for (;;)
+    {
+      end = g_strstr_len ((gchar *)buffer->data, buffer->len, "\r\n\r\n");
+      if (end)
+        break;
+      read_raw_until (io, buffer, buffer->len + 1);
+    }
+
+  len = (end + 4) - (gchar *)buffer->data;
+  response = g_strndup ((gchar *)buffer->data, len);
+  g_byte_array_remove_range (buffer, 0, len);
+  return response;
+}
+
+static void
+test_deflate_negotiate (void)
+{
+  struct {
+    const gchar *offer;
+    guint window_bits;
+    const gchar *response;
+  } fixtures[] = {
+    { NULL, 15, NULL },
+    { "permessage-deflate", 0, NULL },
+    { "permessage-deflate", 15, "permessage-deflate" },
+    { "x-webkit-deflate-frame", 15, NULL },
+    { "permessage-deflate; client_max_window_bits", 15, "permessage-deflate" },
+    { "permessage-deflate; client_max_window_bits", 10,
+      "permessage-deflate; server_max_window_bits=10; client_max_window_bits=10" },
+    { "permessage-deflate; server_max_window_bits=12", 15,
+      "permessage-deflate; server_max_window_bits=12" },
+    { "permessage-deflate; server_max_window_bits=\"11\"; client_max_window_bits=9", 15,
+      "permessage-deflate; server_max_window_bits=11; client_max_window_bits=9" },
+    { "permessage-deflate; server_no_context_takeover; client_no_context_takeover", 15,
+      "permessage-deflate; server_no_context_takeover; client_no_context_takeover" },
+    { "permessage-deflate; server_max_window_bits=8, permessage-deflate", 15, "permessage-deflate" },
+    { "permessage-deflate; server_max_window_bits=16", 15, NULL },
+    { "permessage-deflate; server_max_window_bits", 15, NULL },
+    { "permessage-deflate; unknown_parameter", 15, NULL },
+    { "permessage-deflate; server_no_context_takeover; server_no_context_takeover", 15, NULL },
+  };
+
+  WebSocketConnection *server;
+  g_autofree gchar *expected = NULL;
+  GByteArray *buffer;
+  gchar *response;
+  GIOStream *ioc;
+  GIOStream *ios;
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (fixtures); i++)
+    {
+      cockpit_socket_streampair (&ioc, &ios);
+      server = setup_deflate_server (ios, fixtures[i].offer, fixtures[i].window_bits);
+
+      buffer = g_byte_array_new ();
+      response = read_raw_handshake (ioc, buffer);
+
+      if (fixtures[i].response)
+        {
+          g_free (expected);
+          expected = g_strdup_printf ("\r\nSec-WebSocket-Extensions: %s\r\n", fixtures[i].response);
+          g_assert (strstr (response, expected) != NULL);
+          g_assert (web_socket_connection_get_compression (server, NULL, NULL, NULL, NULL));
+        }
+      else
+        {
+          g_assert (strstr (response, "Sec-WebSocket-Extensions") == NULL);
+          g_assert (!web_socket_connection_get_compression (server, NULL, NULL, NULL, NULL));
+        }
+
+      g_free (response);
+      g_byte_array_unref (buffer);
+      g_object_unref (server);
+      g_object_unref (ioc);
+      g_object_unref (ios);
+    }
+}
+
+static void
+test_deflate_messages (void)
+{
+  WebSocketConnection *server;
+  GBytes *received = NULL;
+  GByteArray *buffer;
+  GByteArray *frame;
+  GBytes *message;
+  gchar *response;
+  gchar *contents;
+  GIOStream *ioc;
+  GIOStream *ios;
+  guint8 output[8192];
+  guint8 mask[4] = { 0x11, 0x22, 0x33, 0x44 };
+  guint8 header[6];
+  guint64 sent, sent_compressed;
+  guint64 recvd, recvd_compressed;
+  z_stream zs = { 0, };
+  gsize len;
+  gsize i;
+
+  cockpit_socket_streampair (&ioc, &ios);
+  server = setup_deflate_server (ios, "permessage-deflate; client_max_window_bits", 10);
+  g_signal_connect (server, "message", G_CALLBACK (on_text_message), &received);
+
+  buffer = g_byte_array_new ();
+  response = read_raw_handshake (ioc, buffer);
+  g_assert (strstr (response, "\r\nSec-WebSocket-Extensions: permessage-deflate; "
+                              "server_max_window_bits=10; client_max_window_bits=10\r\n"));
+  g_free (response);
+
+  /* A compressible message from the server gets the RSV1 bit */
+  contents = g_strnfill (1000, 'x');
+  message = g_bytes_new_take (contents, 1000);
+  web_socket_connection_send (server, WEB_SOCKET_DATA_TEXT, NULL, message);
+
+  read_raw_until (ioc, buffer, 2);
+  g_assert_cmpint (buffer->data[0], ==, 0xC1);
+  len = buffer->data[1];
+  g_assert_cmpuint (len, <, 126);
+  read_raw_until (ioc, buffer, 2 + len);
+
+  g_assert_cmpint (inflateInit2 (&zs, -10), ==, Z_OK);
+  g_byte_array_append (buffer, (guint8 *)"\x00\x00\xff\xff", 4);
+  zs.next_in = buffer->data + 2;
+  zs.avail_in = len + 4;
+  zs.next_out = output;
+  zs.avail_out = sizeof (output);
+  g_assert_cmpint (inflate (&zs, Z_SYNC_FLUSH), ==, Z_OK);
+  g_assert_cmpuint (sizeof (output) - zs.avail_out, ==, 1000);
+  g_assert (memcmp (output, contents, 1000) == 0);
+  inflateEnd (&zs);
+
+  /* And the server inflates a compressed and masked message from the client */
+  memset (&zs, 0, sizeof (zs));
+  g_assert_cmpint (deflateInit2 (&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -10, 8, Z_DEFAULT_STRATEGY), ==, Z_OK);
+  zs.next_in = (guint8 *)contents;
+  zs.avail_in = 1000;
+  zs.next_out = output;
+  zs.avail_out = sizeof (output);
+  g_assert_cmpint (deflate (&zs, Z_SYNC_FLUSH), ==, Z_OK);
+  len = sizeof (output) - zs.avail_out - 4;
+  g_assert_cmpuint (len, <, 126);
+  deflateEnd (&zs);
+
+  header[0] = 0xC1;
+  header[1] = 0x80 | len;
+  memcpy (header + 2, mask, 4);
+
+  frame = g_byte_array_new ();
+  g_byte_array_append (frame, header, sizeof (header));
+  for (i = 0; i < len; i++)
+    output[i] ^= mask[i & 3];
+  g_byte_array_append (frame, output, len);
+  g_assert (g_output_stream_write_all (g_io_stream_get_output_stream (ioc), frame->data, frame->len,
+                                       NULL, NULL, NULL));
+  g_byte_array_unref (frame);
+
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, message));
+
+  g_assert (web_socket_connection_get_compression (server, &sent, &sent_compressed,
+                                                   &recvd, &recvd_compressed));
+  g_assert_cmpuint (sent, ==, 1000);
+  g_assert_cmpuint (sent_compressed, <, 100);
+  g_assert_cmpuint (recvd, ==, 1000);
+  g_assert_cmpuint (recvd_compressed, ==, len);
+
+  g_bytes_unref (received);
+  g_bytes_unref (message);
+  g_byte_array_unref (buffer);
+  g_object_unref (server);
+  g_object_unref (ioc);
+  g_object_unref (ios);
+}
+
+static void
+test_xor_mask (void)
+{
+  const guint8 mask[4] = { 0x9a, 0x01, 0xff, 0x5c };
+  guint8 data[128];
+  guint8 expect[128];
+  gsize offset;
+  gsize len;
+  gsize i;
+
+  /* All the tails and unaligned starts of the block-at-a-time loop */
+  for (offset = 0; offset < 16; offset++)
+    {
+      for (len = 0; len + offset <= sizeof (data); len++)
+        {
+          for (i = 0; i < sizeof (data); i++)
+            data[i] = expect[i] = (i * 31 + len) & 0xff;
+          for (i = 0; i < len; i++)
+            expect[offset + i] ^= mask[i & 3];
+
+          _web_socket_xor_mask_rfc6455 (mask, data + offset, len);
+          g_assert (memcmp (data, expect, sizeof (data)) == 0);
+        }
+    }
+}
+
+static void
+test_xor_mask_perf (void)
+{
+  const guint8 mask[4] = { 0x11, 0x22, 0x33, 0x44 };
+  const gsize sizes[] = { 125, 4096, 128 * 1024 };
+  const gsize total = 256 * 1024 * 1024;
+  guint8 *data;
+  gdouble elapsed;
+  gsize i, j, count;
+
+  data = g_malloc0 (sizes[G_N_ELEMENTS (sizes) - 1]);
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      count = total / sizes[i];
+      g_test_timer_start ();
+      for (j = 0; j < count; j++)
+        _web_socket_xor_mask_rfc6455 (mask, data, sizes[i]);
+      elapsed = g_test_timer_elapsed ();
+
+      g_test_minimized_result (elapsed, "unmasked %" G_GSIZE_FORMAT " frames of %" G_GSIZE_FORMAT
+                               " bytes in %f seconds, %.0f MiB/s",
+                               count, sizes[i], elapsed, (count * sizes[i]) / elapsed / (1024 * 1024));
+    }
+  g_free (data);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1256,7 +1727,10 @@ main (int argc,
       { test_send_client_to_server, "send-client-to-server" },
       { test_send_server_to_client, "send-server-to-client" },
       { test_send_big_packets, "send-big-packets" },
+      { test_receive_big_and_small, "receive-big-and-small" },
       { test_send_prefixed, "send-prefixed" },
+      { test_send_many_server_to_client, "send-many-server-to-client" },
+      { test_send_many_client_to_server, "send-many-client-to-server" },
       { test_send_bad_data, "send-bad-data" },
       { test_pressure_queue, "pressure-queue" },
       { test_pressure_throttle, "pressure-throttle" },
@@ -1296,6 +1770,8 @@ main (int argc,
   g_test_add_func ("/web-socket/parse-headers-no-out", test_parse_headers_no_out);
   g_test_add_func ("/web-socket/parse-headers-bad", test_parse_headers_bad);
   g_test_add_func ("/web-socket/parse-headers-not-enough", test_parse_headers_not_enough);
+  g_test_add_func ("/web-socket/scan-headers", test_scan_headers);
+  g_test_add_func ("/web-socket/scan-headers-limits", test_scan_headers_limits);
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
   g_test_add_func ("/web-socket/header-empty", test_header_empty);
@@ -1312,6 +1788,11 @@ main (int argc,
     g_test_add_func ("/web-socket/close-after-timeout", test_close_after_timeout);
   g_test_add_func ("/web-socket/receive-fragmented", test_receive_fragmented);
   g_test_add_func ("/web-socket/handshake-with-buffer-headers", test_handshake_with_buffer_and_headers);
+  g_test_add_func ("/web-socket/deflate-negotiate", test_deflate_negotiate);
+  g_test_add_func ("/web-socket/deflate-messages", test_deflate_messages);
+  g_test_add_func ("/web-socket/xor-mask", test_xor_mask);
+  if (g_test_perf ())
+    g_test_add_func ("/web-socket/perf/xor-mask", test_xor_mask_perf);
 
   g_test_add ("/web-socket/message-after-closing", Test, NULL, setup_pair, test_message_after_closing, teardown);
 
@@ -283,6 +283,73 @@ web_socket_util_new_headers (void)
   return g_hash_table_new_full (str_case_hash, str_case_equal, g_free, g_free);
 }
 
+/*
+ * Finds the name and value of a single header line without copying
+ * anything, and with surrounding whitespace trimmed. Neither is null
+ * terminated, but the character just past the end of either belongs to
+ * the same line. An empty line, which ends the headers, has a %NULL name.
+ *
+ * Returns the length of the line, zero if truncated, or negative if invalid.
+ */
+static gssize
+scan_header_line (const gchar *data,
+                  gsize length,
+                  WebSocketHeaderSpan *span)
+{
+  const gchar *line;
+  const gchar *colon;
+  const gchar *name;
+  const gchar *name_end;
+  const gchar *value;
+  const gchar *value_end;
+
+  line = memchr (data, '\n', length);
+
+  /* No line ending: need more data */
+  if (line == NULL)
+    return 0;
+
+  /* An empty line, all done */
+  if ((data[0] == '\r' && data[1] == '\n') || data[0] == '\n')
+    {
+      span->name = NULL;
+      return (line - data) + 1;
+    }
+
+  colon = memchr (data, ':', line - data);
+  if (!colon)
+    {
+      g_debug ("received invalid header line: %.*s", (gint)(line - data) + 1, data);
+      return -1;
+    }
+
+  name = data;
+  name_end = colon;
+  while (name < name_end && g_ascii_isspace (name[0]))
+    name++;
+  while (name_end > name && g_ascii_isspace (name_end[-1]))
+    name_end--;
+
+  value = colon + 1;
+  value_end = line;
+  while (value < value_end && g_ascii_isspace (value[0]))
+    value++;
+  while (value_end > value && g_ascii_isspace (value_end[-1]))
+    value_end--;
+
+  if (!is_valid_line (name, name_end - name) || !g_utf8_validate (value, value_end - value, NULL))
+    {
+      g_debug ("received invalid header");
+      return -1;
+    }
+
+  span->name = name;
+  span->name_len = name_end - name;
+  span->value = value;
+  span->value_len = value_end - value;
+  return (line - data) + 1;
+}
+
 /**
  * web_socket_util_parse_headers:
  * @data: (array length=length): the input data
@@ -309,63 +376,28 @@ web_socket_util_parse_headers (const gchar *data,
                                gsize length,
                                GHashTable **headers)
 {
+  WebSocketHeaderSpan span;
   GHashTable *parsed_headers;
-  const gchar *line;
-  const gchar *colon;
-  gsize consumed = 0;
-  gboolean end = FALSE;
-  gsize line_len;
+  gssize consumed = 0;
+  gssize ret;
 
   parsed_headers = web_socket_util_new_headers ();
 
-  while (!end)
+  for (;;)
     {
-      line = memchr (data, '\n', length);
-
-      /* No line ending: need more data */
-      if (line == NULL)
+      ret = scan_header_line (data + consumed, length - consumed, &span);
+      if (ret <= 0)
         {
-          consumed = 0;
+          consumed = ret;
           break;
         }
 
-      line++;
-      line_len = (line - data);
-
-      /* An empty line, all done */
-      if ((data[0] == '\r' && data[1] == '\n') || data[0] == '\n')
-        {
-          end = TRUE;
-        }
+      consumed += ret;
+      if (span.name == NULL)
+        break;
 
-      /* A header line */
-      else
-        {
-          colon = memchr (data, ':', length);
-          if (!colon || colon >= line)
-            {
-              g_debug ("received invalid header line: %.*s", (gint)line_len, data);
-              consumed = -1;
-              break;
-            }
-
-          g_autofree gchar *name = g_strndup (data, colon - data);
-          g_strstrip (name);
-          g_autofree gchar *value = g_strndup (colon + 1, line - (colon + 1));
-          g_strstrip (value);
-
-          if (!is_valid_line (name, -1) || !g_utf8_validate (value, -1, NULL))
-            {
-              g_debug ("received invalid header");
-              consumed = -1;
-              break;
-            }
-          g_hash_table_insert (parsed_headers, g_steal_pointer (&name), g_steal_pointer (&value));
-        }
-
-      consumed += line_len;
-      data += line_len;
-      length -= line_len;
+      g_hash_table_insert (parsed_headers, g_strndup (span.name, span.name_len),
+                           g_strndup (span.value, span.value_len));
     }
 
   if (consumed > 0)
@@ -379,6 +411,58 @@ web_socket_util_parse_headers (const gchar *data,
   return consumed;
 }
 
+/**
+ * web_socket_util_scan_headers:
+ * @data: (array length=length): the input data
+ * @length: length of data
+ * @spans: (array length=n_spans): location to place the headers
+ * @n_spans: (inout): the number of @spans available, set to the number found
+ *
+ * Parse HTTP headers like web_socket_util_parse_headers() does, but
+ * without allocating anything. Each header is described by a span of
+ * @data, which is not null terminated. The same name may appear more
+ * than once, in which case the last one wins.
+ *
+ * Having more headers than @spans fails the parse.
+ *
+ * Return value: zero if truncated, negative if fails, or number of
+ *               characters parsed
+ */
+gssize
+web_socket_util_scan_headers (const gchar *data,
+                              gsize length,
+                              WebSocketHeaderSpan *spans,
+                              gsize *n_spans)
+{
+  WebSocketHeaderSpan span;
+  gsize consumed = 0;
+  gsize n = 0;
+  gssize ret;
+
+  g_return_val_if_fail (n_spans != NULL, -1);
+
+  for (;;)
+    {
+      ret = scan_header_line (data + consumed, length - consumed, &span);
+      if (ret <= 0)
+        return ret;
+
+      consumed += ret;
+      if (span.name == NULL)
+        break;
+
+      if (n == *n_spans)
+        {
+          g_debug ("received too many headers");
+          return -1;
+        }
+      spans[n++] = span;
+    }
+
+  *n_spans = n;
+  return consumed;
+}
+
 gboolean
 _web_socket_util_header_equals (GHashTable *headers,
                                 const gchar *name,
@@ -20,6 +20,18 @@ gssize          web_socket_util_parse_headers  (const gchar *data,
                                                 gsize length,
                                                 GHashTable **headers);
 
+typedef struct {
+  const gchar *name;
+  gsize name_len;
+  const gchar *value;
+  gsize value_len;
+} WebSocketHeaderSpan;
+
+gssize          web_socket_util_scan_headers   (const gchar *data,
+                                                gsize length,
+                                                WebSocketHeaderSpan *spans,
+                                                gsize *n_spans);
+
 gssize          web_socket_util_parse_req_line (const gchar *data,
                                                 gsize length,
                                                 gchar **method,
@@ -14,8 +14,14 @@
 #include "websocketprivate.h"
 
 #include "cockpitflow.h"
+#include "cockpitunicode.h"
 
 #include <string.h>
+#include <zlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /*
  * SECTION:websocketconnection
@@ -89,9 +95,20 @@ enum {
 
 static guint signals[NUM_SIGNALS] = { 0, };
 
+/*
+ * A queued frame is the frame header followed by up to two chunks of
+ * payload. On the server side the chunks reference the caller's prefix
+ * and message directly, so they are never copied before being written.
+ */
+#define FRAME_MAX_CHUNKS  2
+
 typedef struct {
-  GBytes *data;
+  guint8 header[14];
+  gsize header_len;
+  GBytes *chunks[FRAME_MAX_CHUNKS];
+  guint n_chunks;
   gboolean last;
+  gsize len;
   gsize sent;
   gsize amount;
 } Frame;
@@ -135,8 +152,19 @@ typedef struct
 
   /* Current message being assembled */
   guint8 message_opcode;
+  gboolean message_compressed;
   GByteArray *message_data;
 
+  /* permessage-deflate state, when negotiated */
+  z_stream *deflate;
+  z_stream *inflate;
+  gboolean deflate_reset;
+  gboolean inflate_reset;
+  guint64 deflate_in;
+  guint64 deflate_out;
+  guint64 inflate_in;
+  guint64 inflate_out;
+
   /* Pressure which throttles input on this web socket */
   CockpitFlow *pressure;
   gulong pressure_sig;
@@ -144,11 +172,27 @@ typedef struct
 
 #define MAX_PAYLOAD   128 * 1024
 
+/* Largest message we are willing to inflate */
+#define MAX_INFLATED  16 * 1024 * 1024
+
+/* Smaller messages are not worth compressing */
+#define DEFLATE_MIN_SIZE  128
+
+/* Smaller messages are copied rather than pinning the whole receive buffer */
+#define SLICE_MIN_SIZE    4096
+
 /* The queue size above which we consider applying back pressure */
 #define QUEUE_PRESSURE       1UL * 1024UL * 1024UL /* 1 megabyte */
 
+/* Maximum number of buffers handed to a single vectored write */
+#define MAX_OUTPUT_VECTORS   64
+
 static void    web_socket_connection_flow_iface_init        (CockpitFlowInterface *iface);
 
+static void    queue_frame                                  (WebSocketConnection *self,
+                                                             WebSocketQueueFlags flags,
+                                                             Frame *frame);
+
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (WebSocketConnection, web_socket_connection, G_TYPE_OBJECT,
                                   G_ADD_PRIVATE(WebSocketConnection)
                                   G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, web_socket_connection_flow_iface_init));
@@ -161,11 +205,68 @@ frame_free (gpointer data)
   Frame *frame = data;
   if (frame)
     {
-      g_bytes_unref (frame->data);
+      for (guint i = 0; i < frame->n_chunks; i++)
+        g_bytes_unref (frame->chunks[i]);
       g_slice_free (Frame, frame);
     }
 }
 
+static void
+frame_add_chunk (Frame *frame,
+                 GBytes *bytes)
+{
+  gsize len = g_bytes_get_size (bytes);
+
+  g_assert (frame->n_chunks < FRAME_MAX_CHUNKS);
+
+  if (len == 0)
+    return;
+
+  frame->chunks[frame->n_chunks++] = g_bytes_ref (bytes);
+  frame->len += len;
+}
+
+/*
+ * Fills in @vectors with the unsent parts of @frame, and returns the
+ * number of vectors used. Will not use more than @n_vectors.
+ */
+static guint
+frame_get_vectors (Frame *frame,
+                   GOutputVector *vectors,
+                   guint n_vectors)
+{
+  gsize skip = frame->sent;
+  const guint8 *data;
+  guint n = 0;
+  gsize len;
+
+  for (guint i = 0; i <= frame->n_chunks && n < n_vectors; i++)
+    {
+      if (i == 0)
+        {
+          data = frame->header;
+          len = frame->header_len;
+        }
+      else
+        {
+          data = g_bytes_get_data (frame->chunks[i - 1], &len);
+        }
+
+      if (skip >= len)
+        {
+          skip -= len;
+          continue;
+        }
+
+      vectors[n].buffer = data + skip;
+      vectors[n].size = len - skip;
+      skip = 0;
+      n++;
+    }
+
+  return n;
+}
+
 static void
 web_socket_connection_init (WebSocketConnection *self)
 {
@@ -335,44 +436,237 @@ close_io_after_timeout (WebSocketConnection *self)
   g_source_attach (pv->close_timeout, pv->main_context);
 }
 
-static void
-xor_with_mask_rfc6455 (const guint8 *mask,
-                       guint8 *data,
-                       gsize len)
+/*
+ * The mask repeats every four bytes, so it is applied to a whole block
+ * or word at a time. Blocks are a multiple of four bytes, so the mask
+ * lines up again for the bytes at the end.
+ */
+void
+_web_socket_xor_mask_rfc6455 (const guint8 *mask,
+                              guint8 *data,
+                              gsize len)
 {
+  guint32 mask32;
+  guint64 mask64;
+  guint64 word;
+  gsize n = 0;
+
   g_assert (mask != NULL);
   g_assert (data != NULL);
 
-  /* Do the masking */
-  for (gsize n = 0; n < len; n++)
+  memcpy (&mask32, mask, sizeof (mask32));
+  mask64 = ((guint64)mask32 << 32) | mask32;
+
+#if defined(__SSE2__)
+  const __m128i mask128 = _mm_set1_epi32 (mask32);
+  for (; n + 16 <= len; n += 16)
+    {
+      __m128i block = _mm_loadu_si128 ((const __m128i *)(data + n));
+      _mm_storeu_si128 ((__m128i *)(data + n), _mm_xor_si128 (block, mask128));
+    }
+#endif
+
+  for (; n + 8 <= len; n += 8)
+    {
+      memcpy (&word, data + n, sizeof (word));
+      word ^= mask64;
+      memcpy (data + n, &word, sizeof (word));
+    }
+
+  for (; n < len; n++)
     data[n] ^= mask[n & 3];
 }
 
+/*
+ * Compresses a message for permessage-deflate as described in RFC 7692,
+ * including the removal of the trailing empty block.
+ */
+static GBytes *
+deflate_message (WebSocketConnection *self,
+                 GBytes *prefix,
+                 GBytes *payload)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GBytes *inputs[] = { prefix, payload };
+  z_stream *zs = pv->deflate;
+  GByteArray *output;
+  gconstpointer data;
+  gsize used = 0;
+  gsize len;
+  int flush;
+  int ret;
+
+  output = g_byte_array_new ();
+  g_byte_array_set_size (output, 1024);
+
+  for (guint i = 0; i < G_N_ELEMENTS (inputs); i++)
+    {
+      data = NULL;
+      len = 0;
+      if (inputs[i])
+        data = g_bytes_get_data (inputs[i], &len);
+      pv->deflate_in += len;
+
+      flush = (i == G_N_ELEMENTS (inputs) - 1) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+      zs->next_in = (Bytef *)data;
+      zs->avail_in = len;
+
+      do
+        {
+          if (used == output->len)
+            g_byte_array_set_size (output, output->len * 2);
+          zs->next_out = output->data + used;
+          zs->avail_out = output->len - used;
+          ret = deflate (zs, flush);
+          used = output->len - zs->avail_out;
+          if (ret == Z_STREAM_ERROR)
+            {
+              g_critical ("couldn't compress WebSocket message");
+              g_byte_array_unref (output);
+              return NULL;
+            }
+        }
+      while (zs->avail_out == 0);
+    }
+
+  /* A sync flush always ends with 0x00 0x00 0xff 0xff, which the peer adds back */
+  g_assert (used >= 4);
+  g_byte_array_set_size (output, used - 4);
+  pv->deflate_out += output->len;
+
+  if (pv->deflate_reset)
+    deflateReset (zs);
+
+  return g_byte_array_free_to_bytes (output);
+}
+
+/*
+ * Replaces the compressed message data with its inflated contents.
+ * Returns FALSE if it couldn't be inflated.
+ */
+static gboolean
+inflate_message (WebSocketConnection *self)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  static const guint8 tail[] = { 0x00, 0x00, 0xff, 0xff };
+  GByteArray *input = pv->message_data;
+  z_stream *zs = pv->inflate;
+  gboolean ok = FALSE;
+  GByteArray *output;
+  gsize used = 0;
+  int ret;
+
+  pv->inflate_in += input->len;
+  g_byte_array_append (input, tail, sizeof (tail));
+
+  output = g_byte_array_new ();
+  g_byte_array_set_size (output, CLAMP (input->len * 4, 1024, MAX_INFLATED));
+
+  zs->next_in = input->data;
+  zs->avail_in = input->len;
+
+  for (;;)
+    {
+      if (used == output->len)
+        {
+          if (output->len >= MAX_INFLATED)
+            {
+              g_message ("received compressed message which inflates to more than %d bytes", MAX_INFLATED);
+              break;
+            }
+          g_byte_array_set_size (output, MIN (output->len * 2, MAX_INFLATED));
+        }
+
+      zs->next_out = output->data + used;
+      zs->avail_out = output->len - used;
+      ret = inflate (zs, Z_SYNC_FLUSH);
+      used = output->len - zs->avail_out;
+
+      if (ret == Z_STREAM_END)
+        {
+          /* The peer may finish the stream, but it must start afresh for the next message */
+          inflateReset (zs);
+          ok = TRUE;
+          break;
+        }
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          g_message ("received invalid compressed data: %s", zs->msg ? zs->msg : "unknown error");
+          break;
+        }
+      else if (zs->avail_out > 0)
+        {
+          /* All input is consumed */
+          ok = TRUE;
+          break;
+        }
+    }
+
+  if (!ok)
+    {
+      g_byte_array_unref (output);
+      inflateReset (zs);
+      return FALSE;
+    }
+
+  if (pv->inflate_reset)
+    inflateReset (zs);
+
+  g_byte_array_set_size (output, used);
+  pv->inflate_out += output->len;
+
+  g_byte_array_unref (pv->message_data);
+  pv->message_data = output;
+  return TRUE;
+}
+
 static void
 send_prefixed_message_rfc6455 (WebSocketConnection *self,
                                WebSocketQueueFlags flags,
                                guint8 opcode,
-                               const guint8 *prefix,
-                               gsize prefix_len,
-                               const guint8 *payload,
-                               gsize payload_len)
+                               GBytes *prefix,
+                               GBytes *payload)
 {
-  gsize amount;
-  GByteArray *bytes;
-  gsize frame_len;
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GBytes *compressed = NULL;
+  GBytes *truncated = NULL;
+  GByteArray *masked;
+  GBytes *bytes;
+  gsize prefix_len;
+  gsize payload_len;
   guint8 *outer;
   guint8 *mask = 0;
-  guint8 *at;
+  Frame *frame;
   gsize len;
   guint64 size;
 
+  g_return_if_fail (pv->close_sent == FALSE);
+
+  prefix_len = prefix ? g_bytes_get_size (prefix) : 0;
+  payload_len = g_bytes_get_size (payload);
   len = payload_len + prefix_len;
-  amount = len;
 
-  bytes = g_byte_array_sized_new (14 + len);
-  outer = bytes->data;
+  frame = g_slice_new0 (Frame);
+  frame->amount = len;
+  frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
+
+  outer = frame->header;
   outer[0] = 0x80 | opcode;
 
+  /* Compress data messages, which sets the RSV1 bit */
+  if (pv->deflate && !(opcode & 0x08) && len >= DEFLATE_MIN_SIZE)
+    {
+      compressed = deflate_message (self, prefix, payload);
+      if (compressed)
+        {
+          outer[0] |= 0x40;
+          prefix = NULL;
+          prefix_len = 0;
+          payload = compressed;
+          len = g_bytes_get_size (compressed);
+        }
+    }
+
   /* If control message, truncate payload */
   if (opcode & 0x08)
     {
@@ -380,27 +674,34 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
         {
           g_warning ("Truncating WebSocket control message payload");
           if (prefix_len > 125)
+            {
+              prefix = truncated = g_bytes_new_from_bytes (prefix, 0, 125);
               prefix_len = 125;
-          payload_len = 125 - prefix_len;
+              payload = NULL;
+            }
+          else
+            {
+              payload = truncated = g_bytes_new_from_bytes (payload, 0, 125 - prefix_len);
+            }
           len = 125;
         }
 
       /* Buffered amount of bytes is zero for control messages */
-      amount = 0;
+      frame->amount = 0;
     }
 
   size = len;
   if (size < 126)
     {
       outer[1] = (0xFF & size); /* mask | 7-bit-len */
-      bytes->len = 2;
+      frame->header_len = 2;
     }
   else if (size < 65536)
     {
       outer[1] = 126; /* mask | 16-bit-len */
       outer[2] = (size >> 8) & 0xFF;
       outer[3] = (size >> 0) & 0xFF;
-      bytes->len = 4;
+      frame->header_len = 4;
     }
   else
     {
@@ -413,44 +714,62 @@ send_prefixed_message_rfc6455 (WebSocketConnection *self,
       outer[7] = (size >> 16) & 0xFF;
       outer[8] = (size >> 8) & 0xFF;
       outer[9] = (size >> 0) & 0xFF;
-      bytes->len = 10;
+      frame->header_len = 10;
     }
+  frame->len = frame->header_len;
 
   /*
    * The server side doesn't need to mask, so we don't. There's
    * probably a client somewhere that's not expecting it.
+   *
+   * Masking modifies the payload, so only the client side has to
+   * copy it. The server side just references the caller's data.
    */
-  const gboolean is_client_side = !GET_PRIV(self)->server_side;
+  const gboolean is_client_side = !pv->server_side;
   if (is_client_side)
     {
       guint32 rand = g_random_int ();
       outer[1] |= 0x80;
-      mask = outer + bytes->len;
+      mask = outer + frame->header_len;
       memcpy (mask, &rand, sizeof (guint32));
-      bytes->len += 4;
+      frame->header_len += 4;
+      frame->len += 4;
+
+      masked = g_byte_array_sized_new (len);
+      if (prefix)
+        g_byte_array_append (masked, g_bytes_get_data (prefix, NULL), prefix_len);
+      if (payload)
+        g_byte_array_append (masked, g_bytes_get_data (payload, NULL), len - prefix_len);
+      _web_socket_xor_mask_rfc6455 (mask, masked->data, masked->len);
+
+      bytes = g_byte_array_free_to_bytes (masked);
+      frame_add_chunk (frame, bytes);
+      g_bytes_unref (bytes);
+    }
+  else
+    {
+      if (prefix)
+        frame_add_chunk (frame, prefix);
+      if (payload)
+        frame_add_chunk (frame, payload);
     }
 
-  at = bytes->data + bytes->len;
-  g_byte_array_append (bytes, prefix, prefix_len);
-  g_byte_array_append (bytes, payload, payload_len);
-
-  if (is_client_side)
-    xor_with_mask_rfc6455 (mask, at, len);
+  if (truncated)
+    g_bytes_unref (truncated);
+  if (compressed)
+    g_bytes_unref (compressed);
 
-  frame_len = bytes->len;
-  _web_socket_connection_queue (self, flags, g_byte_array_free (bytes, FALSE),
-                                frame_len, amount);
-  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame_len);
+  g_debug ("queued rfc6455 %d frame of len %u", (gint)opcode, (guint)frame->len);
+  queue_frame (self, flags, frame);
 }
 
 static void
 send_message_rfc6455 (WebSocketConnection *self,
                       WebSocketQueueFlags flags,
                       guint8 opcode,
-                      const guint8 *payload,
-                      gsize payload_len)
+                      GBytes *payload)
 {
-  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, 0, payload, payload_len);
+  return send_prefixed_message_rfc6455 (self, flags, opcode, NULL, payload);
 }
 
 static void
@@ -461,6 +780,7 @@ send_close_rfc6455 (WebSocketConnection *self,
 {
   /* Note that send_message truncates as expected */
   gchar buffer[128];
+  GBytes *payload;
   gsize len = 0;
 
   if (code != 0)
@@ -471,7 +791,9 @@ send_close_rfc6455 (WebSocketConnection *self,
         len += g_strlcpy (buffer + len, reason, sizeof (buffer) - len);
     }
 
-  send_message_rfc6455 (self, flags, 0x08, (guint8 *)buffer, len);
+  payload = g_bytes_new (buffer, len);
+  send_message_rfc6455 (self, flags, 0x08, payload);
+  g_bytes_unref (payload);
   GET_PRIV(self)->close_sent = TRUE;
 }
 
@@ -669,21 +991,75 @@ receive_ping_rfc6455 (WebSocketConnection *self,
                       const guint8 *data,
                       gsize len)
 {
+  GBytes *payload;
+
   /* Send back a pong with same data */
   g_debug ("received ping, responding");
-  send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, data, len);
+  payload = g_bytes_new (data, len);
+  send_message_rfc6455 (self, WEB_SOCKET_QUEUE_URGENT, 0x0A, payload);
+  g_bytes_unref (payload);
 }
 
-static void
+/*
+ * Hands out an unfragmented message as a slice of the receive buffer
+ * instead of copying it. The receive buffer is frozen into the slice,
+ * and anything after the message moves into a fresh one. That is no
+ * more copying than removing the frame from the buffer used to be.
+ */
+static GBytes *
+slice_incoming_rfc6455 (WebSocketConnection *self,
+                        gconstpointer payload,
+                        gsize payload_len)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+  GByteArray *incoming = pv->incoming;
+  GBytes *buffer;
+  GBytes *message;
+  gsize offset;
+  gsize end;
+
+  offset = (const guint8 *)payload - incoming->data;
+  end = offset + payload_len;
+  g_assert (end <= incoming->len);
+
+  pv->incoming = g_byte_array_sized_new (incoming->len);
+  g_byte_array_append (pv->incoming, incoming->data + end, incoming->len - end);
+
+  /* Always null terminate, as a convenience, now that the rest has moved */
+  g_byte_array_set_size (incoming, end + 1);
+  incoming->data[end] = '\0';
+
+  buffer = g_byte_array_free_to_bytes (incoming);
+  message = g_bytes_new_from_bytes (buffer, offset, payload_len);
+  g_bytes_unref (buffer);
+
+  return message;
+}
+
+/*
+ * Returns TRUE if the frame was consumed from the receive buffer along
+ * with the message.
+ */
+static gboolean
 process_contents_rfc6455 (WebSocketConnection *self,
                           gboolean control,
                           gboolean fin,
+                          gboolean compressed,
                           guint8 opcode,
                           gconstpointer payload,
                           gsize payload_len)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   GBytes *message;
+  gboolean sliced = FALSE;
+
+  /* Only the first frame of a message may be marked as compressed */
+  if (compressed && (!pv->inflate || control || !opcode))
+    {
+      g_message ("received unexpected compressed frame");
+      protocol_error_and_close (self);
+      return FALSE;
+    }
 
   if (control)
     {
@@ -692,7 +1068,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
         {
           g_message ("received fragmented control frame");
           protocol_error_and_close (self);
-          return;
+          return FALSE;
         }
 
       g_debug ("received control frame %d with %d payload", (int)opcode, (int)payload_len);
@@ -728,7 +1104,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
             {
               g_message ("received out of order initial message fragment");
               protocol_error_and_close (self);
-              return;
+              return FALSE;
             }
           g_debug ("received initial fragment frame %d with %d payload", (int)opcode, (int)payload_len);
         }
@@ -740,7 +1116,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
             {
               g_message ("received out of order middle message fragment");
               protocol_error_and_close (self);
-              return;
+              return FALSE;
             }
           g_debug ("received middle fragment frame with %d payload", (int)payload_len);
         }
@@ -752,7 +1128,7 @@ process_contents_rfc6455 (WebSocketConnection *self,
             {
               g_message ("received out of order ending message fragment");
               protocol_error_and_close (self);
-              return;
+              return FALSE;
             }
           g_debug ("received last fragment frame with %d payload", (int)payload_len);
         }
@@ -765,35 +1141,43 @@ process_contents_rfc6455 (WebSocketConnection *self,
             {
               g_message ("received unfragmented message when fragment was expected");
               protocol_error_and_close (self);
-              return;
+              return FALSE;
             }
           g_debug ("received frame %d with %d payload", (int)opcode, (int)payload_len);
         }
 
+      /* An unfragmented message doesn't need to be collected */
+      sliced = fin && !compressed && (opcode == 0x01 || opcode == 0x02) &&
+               payload_len >= SLICE_MIN_SIZE;
+
       if (opcode)
         {
           pv->message_opcode = opcode;
-          pv->message_data = g_byte_array_sized_new (payload_len);
+          pv->message_compressed = compressed;
+          if (!sliced)
+            pv->message_data = g_byte_array_sized_new (payload_len);
         }
 
       switch (pv->message_opcode)
         {
         case 0x01:
-          if (!g_utf8_validate ((gchar *)payload, payload_len, NULL))
+          /* Compressed text is validated once inflated */
+          if (!pv->message_compressed &&
+              cockpit_unicode_valid_length ((gchar *)payload, payload_len) != payload_len)
             {
               g_message ("received invalid non-UTF8 text data");
 
               /* Discard the entire message */
-              g_byte_array_unref (pv->message_data);
-              pv->message_data = NULL;
+              g_clear_pointer (&pv->message_data, g_byte_array_unref);
               pv->message_opcode = 0;
 
               bad_data_error_and_close (self);
-              return;
+              return FALSE;
             }
           /* fall through */
         case 0x02:
-          g_byte_array_append (pv->message_data, payload, payload_len);
+          if (!sliced)
+            g_byte_array_append (pv->message_data, payload, payload_len);
           break;
         default:
           g_debug ("received unknown data frame: %d", (gint)opcode);
@@ -803,22 +1187,49 @@ process_contents_rfc6455 (WebSocketConnection *self,
       /* Actually deliver the message? */
       if (fin)
         {
-          /* Always null terminate, as a convenience */
-          g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
+          if (pv->message_compressed &&
+              (!inflate_message (self) ||
+               (pv->message_opcode == 0x01 &&
+                cockpit_unicode_valid_length ((gchar *)pv->message_data->data,
+                                              pv->message_data->len) != pv->message_data->len)))
+            {
+              g_message ("received invalid compressed message");
+
+              /* Discard the entire message */
+              g_byte_array_unref (pv->message_data);
+              pv->message_data = NULL;
+              pv->message_opcode = 0;
+              pv->message_compressed = FALSE;
+
+              bad_data_error_and_close (self);
+              return FALSE;
+            }
+
+          if (sliced)
+            message = slice_incoming_rfc6455 (self, payload, payload_len);
+          else
+            {
+              /* Always null terminate, as a convenience */
+              g_byte_array_append (pv->message_data, (guchar *)"\0", 1);
 
-          /* But don't include the null terminator in the byte count */
-          pv->message_data->len--;
+              /* But don't include the null terminator in the byte count */
+              pv->message_data->len--;
+
+              message = g_byte_array_free_to_bytes (pv->message_data);
+            }
 
           opcode = pv->message_opcode;
-          message = g_byte_array_free_to_bytes (pv->message_data);
           pv->message_data = NULL;
           pv->message_opcode = 0;
+          pv->message_compressed = FALSE;
           g_debug ("message: delivering %d with %d length",
                    (int)opcode, (int)g_bytes_get_size (message));
           g_signal_emit (self, signals[MESSAGE], 0, (int)opcode, message);
           g_bytes_unref (message);
         }
     }
+
+  return sliced;
 }
 
 static gboolean
@@ -830,6 +1241,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
   guint8 *mask;
   gboolean fin;
   gboolean control;
+  gboolean compressed;
   gboolean masked;
   guint8 opcode;
   gsize len;
@@ -841,6 +1253,7 @@ process_frame_rfc6455 (WebSocketConnection *self)
 
   header = GET_PRIV(self)->incoming->data;
   fin = ((header[0] & 0x80) != 0);
+  compressed = ((header[0] & 0x40) != 0);
   control = header[0] & 0x08;
   opcode = header[0] & 0x0f;
   masked = ((header[1] & 0x80) != 0);
@@ -894,17 +1307,18 @@ process_frame_rfc6455 (WebSocketConnection *self)
       if (len < at + payload_len)
         return FALSE; /* need more data */
 
-      xor_with_mask_rfc6455 (mask, payload, payload_len);
+      _web_socket_xor_mask_rfc6455 (mask, payload, payload_len);
     }
 
   /*
    * Note that now that we've unmasked, we've modified the buffer, we can
    * only return below via discarding or processing the message
    */
-  process_contents_rfc6455 (self, control, fin, opcode, payload, payload_len);
-
-  /* Move past the parsed frame */
-  g_byte_array_remove_range (GET_PRIV(self)->incoming, 0, at + payload_len);
+  if (!process_contents_rfc6455 (self, control, fin, compressed, opcode, payload, payload_len))
+    {
+      /* Move past the parsed frame */
+      g_byte_array_remove_range (GET_PRIV(self)->incoming, 0, at + payload_len);
+    }
   return TRUE;
 }
 
@@ -1016,57 +1430,69 @@ on_web_socket_output (GObject *pollable_stream,
 {
   WebSocketConnection *self = WEB_SOCKET_CONNECTION (user_data);
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
-  const guint8 *data;
+  GOutputVector vectors[MAX_OUTPUT_VECTORS];
+  GPollableReturn ret;
   GError *error = NULL;
+  guint n_vectors = 0;
+  gsize remaining;
   gsize before;
   Frame *frame;
-  gssize count;
-  gsize len;
-
-  frame = g_queue_peek_head (&pv->outgoing);
+  gsize count;
+  GList *l;
 
   /* No more frames to send */
-  if (frame == NULL)
+  if (g_queue_is_empty (&pv->outgoing))
     {
       stop_output (self);
       return TRUE;
     }
 
-  data = g_bytes_get_data (frame->data, &len);
-  g_assert (len > 0);
-  g_assert (len > frame->sent);
+  /*
+   * Coalesce as many queued frames as we can into a single write.
+   * Nothing gets sent after the last frame, so stop there.
+   */
+  for (l = pv->outgoing.head; l != NULL && n_vectors < MAX_OUTPUT_VECTORS; l = g_list_next (l))
+    {
+      frame = l->data;
+      g_assert (frame->len > frame->sent);
+      n_vectors += frame_get_vectors (frame, vectors + n_vectors, MAX_OUTPUT_VECTORS - n_vectors);
+      if (frame->last)
+        break;
+    }
 
-  count = g_pollable_output_stream_write_nonblocking (pv->output,
-                                                      data + frame->sent,
-                                                      len - frame->sent,
-                                                      NULL, &error);
+  ret = g_pollable_output_stream_writev_nonblocking (pv->output, vectors, n_vectors,
+                                                     &count, NULL, &error);
 
-  if (count < 0)
+  if (ret == G_POLLABLE_RETURN_WOULD_BLOCK)
     {
-      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
-        {
-          g_clear_error (&error);
-          count = 0;
-        }
-      else
-        {
-          _web_socket_connection_error_and_close (self, error, TRUE);
-          return FALSE;
-        }
+      count = 0;
+    }
+  else if (ret == G_POLLABLE_RETURN_FAILED)
+    {
+      _web_socket_connection_error_and_close (self, error, TRUE);
+      return FALSE;
     }
 
   before = pv->output_queued;
 
-  frame->sent += count;
-  if (frame->sent >= len)
+  while ((frame = g_queue_peek_head (&pv->outgoing)) != NULL)
     {
+      remaining = frame->len - frame->sent;
+      if (count < remaining)
+        {
+          frame->sent += count;
+          break;
+        }
+
+      count -= remaining;
       g_debug ("sent frame");
       g_queue_pop_head (&pv->outgoing);
-      g_assert (len <= pv->output_queued);
-      pv->output_queued -= len;
+      g_assert (frame->len <= pv->output_queued);
+      pv->output_queued -= frame->len;
 
       if (frame->last)
         {
+          frame_free (frame);
           if (pv->server_side)
             {
               close_io_stream (self);
@@ -1076,7 +1502,9 @@ on_web_socket_output (GObject *pollable_stream,
               shutdown_wr_io_stream (self);
               close_io_after_timeout (self);
             }
+          break;
         }
+
       frame_free (frame);
     }
 
@@ -1104,28 +1532,15 @@ start_output (WebSocketConnection *self)
   g_source_attach (pv->output_source, pv->main_context);
 }
 
-void
-_web_socket_connection_queue (WebSocketConnection *self,
-                              WebSocketQueueFlags flags,
-                              gpointer data,
-                              gsize len,
-                              gsize amount)
+static void
+queue_frame (WebSocketConnection *self,
+             WebSocketQueueFlags flags,
+             Frame *frame)
 {
   WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
   gsize before;
-  Frame *frame;
   Frame *prev;
 
-  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
-  g_return_if_fail (pv->close_sent == FALSE);
-  g_return_if_fail (data != NULL);
-  g_return_if_fail (len > 0);
-
-  frame = g_slice_new0 (Frame);
-  frame->data = g_bytes_new_take (data, len);
-  frame->amount = amount;
-  frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
-
   /* If urgent put at front of queue */
   if (flags & WEB_SOCKET_QUEUE_URGENT)
     {
@@ -1152,8 +1567,8 @@ _web_socket_connection_queue (WebSocketConnection *self,
     }
 
   before = pv->output_queued;
-  g_return_if_fail (G_MAXSIZE - len > pv->output_queued);
-  pv->output_queued += len;
+  g_return_if_fail (G_MAXSIZE - frame->len > pv->output_queued);
+  pv->output_queued += frame->len;
 
   /*
    * If we have two much data queued, and are controlling another flow
@@ -1165,6 +1580,32 @@ _web_socket_connection_queue (WebSocketConnection *self,
   start_output (self);
 }
 
+void
+_web_socket_connection_queue (WebSocketConnection *self,
+                              WebSocketQueueFlags flags,
+                              gpointer data,
+                              gsize len,
+                              gsize amount)
+{
+  GBytes *bytes;
+  Frame *frame;
+
+  g_return_if_fail (WEB_SOCKET_IS_CONNECTION (self));
+  g_return_if_fail (GET_PRIV(self)->close_sent == FALSE);
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (len > 0);
+
+  frame = g_slice_new0 (Frame);
+  frame->amount = amount;
+  frame->last = (flags & WEB_SOCKET_QUEUE_LAST) ? TRUE : FALSE;
+
+  bytes = g_bytes_new_take (data, len);
+  frame_add_chunk (frame, bytes);
+  g_bytes_unref (bytes);
+
+  queue_frame (self, flags, frame);
+}
+
 static gboolean
 check_streams (WebSocketConnection *self)
 {
@@ -1376,6 +1817,17 @@ web_socket_connection_finalize (GObject *object)
   if (pv->message_data)
     g_byte_array_free (pv->message_data, TRUE);
 
+  if (pv->deflate)
+    {
+      deflateEnd (pv->deflate);
+      g_free (pv->deflate);
+    }
+  if (pv->inflate)
+    {
+      inflateEnd (pv->inflate);
+      g_free (pv->inflate);
+    }
+
   G_OBJECT_CLASS (web_socket_connection_parent_class)->finalize (object);
 }
 
@@ -1642,6 +2094,44 @@ web_socket_connection_get_io_stream (WebSocketConnection *self)
   return GET_PRIV(self)->io_stream;
 }
 
+/**
+ * web_socket_connection_get_compression:
+ * @self: the WebSocket
+ * @sent: (out) (allow-none): message bytes sent before compression
+ * @sent_compressed: (out) (allow-none): compressed bytes that were sent
+ * @received: (out) (allow-none): message bytes received after inflating
+ * @received_compressed: (out) (allow-none): compressed bytes that were received
+ *
+ * Get statistics about permessage-deflate compression on this
+ * WebSocket. Only messages which were actually compressed are
+ * counted.
+ *
+ * Returns: %TRUE if compression was negotiated with the peer
+ */
+gboolean
+web_socket_connection_get_compression (WebSocketConnection *self,
+                                       guint64 *sent,
+                                       guint64 *sent_compressed,
+                                       guint64 *received,
+                                       guint64 *received_compressed)
+{
+  WebSocketConnectionPrivate *pv;
+
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), FALSE);
+
+  pv = web_socket_connection_get_instance_private (self);
+  if (sent)
+    *sent = pv->deflate_in;
+  if (sent_compressed)
+    *sent_compressed = pv->deflate_out;
+  if (received)
+    *received = pv->inflate_out;
+  if (received_compressed)
+    *received_compressed = pv->inflate_in;
+
+  return pv->deflate != NULL;
+}
+
 /**
  * web_socket_connection_get_close_code:
  * @self: the WebSocket
@@ -1697,7 +2187,8 @@ web_socket_connection_get_close_data (WebSocketConnection *self)
  * is run.
  *
  * The optional @prefix can be a canned header to be prefixed to the message.
- * It can be specified as a separate argument for efficiency.
+ * It can be specified as a separate argument for efficiency. Neither the
+ * @prefix nor @message are copied, they are referenced until written out.
  */
 void
 web_socket_connection_send (WebSocketConnection *self,
@@ -1728,8 +2219,8 @@ web_socket_connection_send (WebSocketConnection *self,
     {
     case WEB_SOCKET_DATA_TEXT:
       opcode = 0x01;
-      if (!g_utf8_validate (pref, prefix_len, NULL) ||
-          !g_utf8_validate (payload, payload_len, NULL))
+      if (cockpit_unicode_valid_length (pref, prefix_len) != prefix_len ||
+          cockpit_unicode_valid_length (payload, payload_len) != payload_len)
         {
           g_critical ("invalid non-UTF8 @data passed as text to web_socket_connection_send()");
           return;
@@ -1743,8 +2234,7 @@ web_socket_connection_send (WebSocketConnection *self,
       return;
     }
 
-  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode,
-                                 pref, prefix_len, payload, payload_len);
+  send_prefixed_message_rfc6455 (self, WEB_SOCKET_QUEUE_NORMAL, opcode, prefix, message);
 
   g_object_notify (G_OBJECT (self), "buffered-amount");
 }
@@ -1919,3 +2409,46 @@ web_socket_connection_flow_iface_init (CockpitFlowInterface *iface)
   iface->throttle = web_socket_connection_throttle;
 }
 
+
+gboolean
+_web_socket_connection_enable_deflate (WebSocketConnection *self,
+                                       guint deflate_window_bits,
+                                       gboolean deflate_no_context_takeover,
+                                       guint inflate_window_bits,
+                                       gboolean inflate_no_context_takeover)
+{
+  WebSocketConnectionPrivate *pv = web_socket_connection_get_instance_private (self);
+
+  g_return_val_if_fail (WEB_SOCKET_IS_CONNECTION (self), FALSE);
+  g_return_val_if_fail (pv->deflate == NULL, FALSE);
+  g_return_val_if_fail (pv->inflate == NULL, FALSE);
+
+  /* Negative window bits are zlib's way of asking for a raw deflate stream */
+  pv->deflate = g_new0 (z_stream, 1);
+  if (deflateInit2 (pv->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    -(gint)deflate_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      g_message ("couldn't setup WebSocket compression: %s", pv->deflate->msg ? pv->deflate->msg : "unknown error");
+      g_clear_pointer (&pv->deflate, g_free);
+      return FALSE;
+    }
+
+  pv->inflate = g_new0 (z_stream, 1);
+  if (inflateInit2 (pv->inflate, -(gint)inflate_window_bits) != Z_OK)
+    {
+      g_message ("couldn't setup WebSocket decompression: %s", pv->inflate->msg ? pv->inflate->msg : "unknown error");
+      g_clear_pointer (&pv->inflate, g_free);
+      deflateEnd (pv->deflate);
+      g_clear_pointer (&pv->deflate, g_free);
+      return FALSE;
+    }
+
+  pv->deflate_reset = deflate_no_context_takeover;
+  pv->inflate_reset = inflate_no_context_takeover;
+
+  g_debug ("enabled permessage-deflate: deflate window %u%s, inflate window %u%s",
+           deflate_window_bits, deflate_no_context_takeover ? " without context takeover" : "",
+           inflate_window_bits, inflate_no_context_takeover ? " without context takeover" : "");
+  return TRUE;
+}
+
@@ -56,6 +56,12 @@ const gchar *   web_socket_connection_get_close_data      (WebSocketConnection *
 
 GIOStream *     web_socket_connection_get_io_stream       (WebSocketConnection *self);
 
+gboolean        web_socket_connection_get_compression     (WebSocketConnection *self,
+                                                           guint64 *sent,
+                                                           guint64 *sent_compressed,
+                                                           guint64 *received,
+                                                           guint64 *received_compressed);
+
 void            web_socket_connection_send                (WebSocketConnection *self,
                                                            WebSocketDataType type,
                                                            GBytes *prefix,
@@ -58,8 +58,18 @@ gboolean         _web_socket_connection_choose_protocol   (WebSocketConnection *
                                                            const gchar **protocols,
                                                            const gchar *value);
 
+gboolean         _web_socket_connection_enable_deflate    (WebSocketConnection *self,
+                                                           guint deflate_window_bits,
+                                                           gboolean deflate_no_context_takeover,
+                                                           guint inflate_window_bits,
+                                                           gboolean inflate_no_context_takeover);
+
 gchar *          _web_socket_complete_accept_key_rfc6455  (const gchar *key);
 
+void             _web_socket_xor_mask_rfc6455             (const guint8 *mask,
+                                                           guint8 *data,
+                                                           gsize len);
+
 G_END_DECLS
 
 #endif /* __WEB_SOCKET_PRIVATE_H__ */
@@ -22,6 +22,8 @@ enum {
   PROP_PROTOCOLS,
   PROP_REQUEST_HEADERS,
   PROP_INPUT_BUFFER,
+  PROP_DEFLATE_WINDOW_BITS,
+  PROP_DEFLATE_CONTEXT_TAKEOVER,
 };
 
 struct _WebSocketServer
@@ -32,8 +34,20 @@ struct _WebSocketServer
   gchar **allowed_origins;
   gchar **allowed_protocols;
   GHashTable *request_headers;
+
+  /* permessage-deflate, disabled when zero */
+  guint deflate_window_bits;
+  gboolean deflate_context_takeover;
 };
 
+/* Parameters of a permessage-deflate offer, zero window bits when not present */
+typedef struct {
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  guint server_max_window_bits;
+  guint client_max_window_bits;
+} DeflateOffer;
+
 struct _WebSocketServerClass
 {
   WebSocketConnectionClass parent;
@@ -44,7 +58,7 @@ G_DEFINE_TYPE (WebSocketServer, web_socket_server, WEB_SOCKET_TYPE_CONNECTION);
 static void
 web_socket_server_init (WebSocketServer *self)
 {
-
+  self->deflate_context_takeover = TRUE;
 }
 
 static void
@@ -128,11 +142,164 @@ validate_rfc6455_websocket_key (const gchar *key)
   return length == 16;
 }
 
+static gboolean
+parse_window_bits (const gchar *value,
+                   guint *bits)
+{
+  gchar *end = NULL;
+  guint64 num;
+
+  if (!g_ascii_isdigit (value[0]))
+    return FALSE;
+
+  num = g_ascii_strtoull (value, &end, 10);
+  if (!end || end[0] != '\0' || num < 8 || num > 15)
+    return FALSE;
+
+  *bits = num;
+  return TRUE;
+}
+
+/*
+ * Parses one offer from a Sec-WebSocket-Extensions header as described
+ * in RFC 7692. Returns FALSE if it isn't a valid permessage-deflate offer.
+ */
+static gboolean
+parse_deflate_offer (gchar *offer,
+                     DeflateOffer *result)
+{
+  g_auto(GStrv) params = NULL;
+  gboolean client_window_bits = FALSE;
+  gchar *value;
+  gchar *name;
+  gint i;
+
+  memset (result, 0, sizeof (DeflateOffer));
+
+  params = g_strsplit (offer, ";", -1);
+  if (!params[0] || !g_str_equal (g_strstrip (params[0]), "permessage-deflate"))
+    return FALSE;
+
+  for (i = 1; params[i] != NULL; i++)
+    {
+      name = g_strstrip (params[i]);
+      value = strchr (name, '=');
+      if (value)
+        {
+          *(value++) = '\0';
+          g_strchomp (name);
+          value = g_strstrip (value);
+
+          /* Values may be sent as a quoted-string */
+          if (value[0] == '"' && strlen (value) >= 2 && value[strlen (value) - 1] == '"')
+            {
+              value[strlen (value) - 1] = '\0';
+              value++;
+            }
+        }
+
+      if (g_str_equal (name, "server_no_context_takeover"))
+        {
+          if (value || result->server_no_context_takeover)
+            return FALSE;
+          result->server_no_context_takeover = TRUE;
+        }
+      else if (g_str_equal (name, "client_no_context_takeover"))
+        {
+          if (value || result->client_no_context_takeover)
+            return FALSE;
+          result->client_no_context_takeover = TRUE;
+        }
+      else if (g_str_equal (name, "server_max_window_bits"))
+        {
+          if (!value || result->server_max_window_bits ||
+              !parse_window_bits (value, &result->server_max_window_bits))
+            return FALSE;
+        }
+      else if (g_str_equal (name, "client_max_window_bits"))
+        {
+          /* Without a value the client just says it supports the parameter */
+          if (client_window_bits)
+            return FALSE;
+          client_window_bits = TRUE;
+          if (!value)
+            result->client_max_window_bits = 15;
+          else if (!parse_window_bits (value, &result->client_max_window_bits))
+            return FALSE;
+        }
+      else
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static void
+respond_deflate_offer (WebSocketServer *self,
+                       WebSocketConnection *conn,
+                       const gchar *extensions,
+                       GString *handshake)
+{
+  g_auto(GStrv) offers = NULL;
+  gboolean server_no_context_takeover;
+  gboolean client_no_context_takeover;
+  guint server_window_bits;
+  guint client_window_bits;
+  DeflateOffer offer;
+  gint i;
+
+  offers = g_strsplit (extensions, ",", -1);
+  for (i = 0; offers[i] != NULL; i++)
+    {
+      if (!parse_deflate_offer (offers[i], &offer))
+        continue;
+
+      server_window_bits = self->deflate_window_bits;
+      if (offer.server_max_window_bits)
+        server_window_bits = MIN (server_window_bits, offer.server_max_window_bits);
+
+      /* zlib can't produce raw deflate data with a 256 byte window */
+      if (server_window_bits < 9)
+        continue;
+
+      /* We can only limit the client's window when it says it supports that */
+      client_window_bits = 15;
+      if (offer.client_max_window_bits)
+        client_window_bits = MIN (offer.client_max_window_bits, self->deflate_window_bits);
+
+      server_no_context_takeover = offer.server_no_context_takeover || !self->deflate_context_takeover;
+      client_no_context_takeover = offer.client_no_context_takeover || !self->deflate_context_takeover;
+
+      if (!_web_socket_connection_enable_deflate (conn, server_window_bits, server_no_context_takeover,
+                                                  client_window_bits, client_no_context_takeover))
+        return;
+
+      g_string_append (handshake, "Sec-WebSocket-Extensions: permessage-deflate");
+      if (server_no_context_takeover)
+        g_string_append (handshake, "; server_no_context_takeover");
+      if (client_no_context_takeover)
+        g_string_append (handshake, "; client_no_context_takeover");
+      if (offer.server_max_window_bits || server_window_bits < 15)
+        g_string_append_printf (handshake, "; server_max_window_bits=%u", server_window_bits);
+      if (offer.client_max_window_bits && client_window_bits < 15)
+        g_string_append_printf (handshake, "; client_max_window_bits=%u", client_window_bits);
+      g_string_append (handshake, "\r\n");
+
+      g_debug ("negotiated permessage-deflate");
+      return;
+    }
+
+  g_debug ("no acceptable permessage-deflate offer in: %s", extensions);
+}
+
 static gboolean
 respond_handshake_rfc6455 (WebSocketServer *self,
                            WebSocketConnection *conn,
                            GHashTable *headers)
 {
+  const gchar *extensions;
   const gchar *protocol;
   const gchar *origin;
   const gchar *host;
@@ -213,6 +380,10 @@ respond_handshake_rfc6455 (WebSocketServer *self,
   if (protocol)
     g_string_append_printf (handshake, "Sec-WebSocket-Protocol: %s\r\n", protocol);
 
+  extensions = g_hash_table_lookup (headers, "Sec-WebSocket-Extensions");
+  if (extensions && self->deflate_window_bits)
+    respond_deflate_offer (self, conn, extensions, handshake);
+
   g_string_append (handshake, "\r\n");
 
   len = handshake->len;
@@ -353,6 +524,16 @@ web_socket_server_set_property (GObject *object,
                                             g_value_dup_boxed (value));
       break;
 
+    case PROP_DEFLATE_WINDOW_BITS:
+      g_return_if_fail (self->protocol_chosen == FALSE);
+      self->deflate_window_bits = g_value_get_uint (value);
+      break;
+
+    case PROP_DEFLATE_CONTEXT_TAKEOVER:
+      g_return_if_fail (self->protocol_chosen == FALSE);
+      self->deflate_context_takeover = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -427,6 +608,27 @@ web_socket_server_class_init (WebSocketServerClass *klass)
                                    g_param_spec_boxed ("input-buffer", "Input buffer", "Input buffer with seed data", G_TYPE_BYTE_ARRAY,
                                                        G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * WebSocketServer:deflate-window-bits:
+   *
+   * Accept permessage-deflate compression (RFC 7692) offered by the
+   * client, using a window of up to this many bits. Zero disables
+   * compression. Must be set before the handshake happens.
+   */
+  g_object_class_install_property (object_class, PROP_DEFLATE_WINDOW_BITS,
+                                   g_param_spec_uint ("deflate-window-bits", "Deflate window bits", "Maximum permessage-deflate window bits",
+                                                      0, 15, 0, G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * WebSocketServer:deflate-context-takeover:
+   *
+   * Whether permessage-deflate compression may reuse its state across
+   * messages. Turning this off saves memory at the cost of worse
+   * compression.
+   */
+  g_object_class_install_property (object_class, PROP_DEFLATE_CONTEXT_TAKEOVER,
+                                   g_param_spec_boolean ("deflate-context-takeover", "Deflate context takeover", "Reuse permessage-deflate state",
+                                                         TRUE, G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS));
 }
 
 /**
@@ -11,6 +11,8 @@ MOCK_HOSTNAME = 'mockbox'
 class MockTransport(asyncio.Transport):
     queue: 'asyncio.Queue[Tuple[str, bytes]]'
     next_id: int = 0
+    binary_framing: bool = False
+    binary_frames_received: int = 0
     close_future: Optional[asyncio.Future] = None
 
     async def assert_empty(self):
@@ -24,7 +26,10 @@ class MockTransport(asyncio.Transport):
 
     def send_data(self, channel: str, data: bytes) -> None:
         msg = channel.encode('ascii') + b'\n' + data
-        msg = str(len(msg)).encode('ascii') + b'\n' + msg
+        if self.binary_framing:
+            msg = b'\0' + len(msg).to_bytes(4, 'big') + msg
+        else:
+            msg = str(len(msg)).encode('ascii') + b'\n' + msg
         self.protocol.data_received(msg)
 
     def send_init(self, version: int = 1, host:  str = MOCK_HOSTNAME, **kwargs: JsonValue) -> None:
@@ -89,7 +94,11 @@ class MockTransport(asyncio.Transport):
     def write(self, data: bytes) -> None:
         # We know that the bridge only ever writes full frames at once, so we
         # can disassemble them immediately.
-        _, channel, data = data.split(b'\n', 2)
+        if data[:1] == b'\0':
+            self.binary_frames_received += 1
+            channel, _, data = data[5:].partition(b'\n')
+        else:
+            _, channel, data = data.split(b'\n', 2)
         self.queue.put_nowait((channel.decode('ascii'), data))
 
     async def stop(self) -> None:
@@ -24,9 +24,11 @@ from cockpit.bridge import Bridge
 from cockpit.channel import AsyncChannel, Channel, ChannelRoutingRule
 from cockpit.channels import CHANNEL_TYPES
 from cockpit.channels.filesystem import tag_from_path
+from cockpit.channels.metrics import SampleSchedule
 from cockpit.jsonutil import JsonDict, JsonObject, JsonValue, get_bool, get_dict, get_int, get_str, json_merge_patch
 from cockpit.packages import BridgeConfig
 from cockpit.peer import ConfiguredPeer
+from cockpit.samples import Sampler, Samples
 from cockpit.superuser import is_valid_superuser_config
 
 from .mocktransport import MOCK_HOSTNAME, MockTransport
@@ -109,6 +111,23 @@ async def test_echo_invalid_utf8(transport: MockTransport) -> None:
     await transport.assert_msg('', command='close', channel=echo, problem='protocol-error')
 
 
+@pytest.mark.asyncio
+async def test_binary_framing(no_init_transport: MockTransport) -> None:
+    transport = no_init_transport
+    init = transport.init(capabilities={'binary-framing': True})
+    assert init['capabilities']['binary-framing'] is True
+
+    # the bridge still understands text frames...
+    echo = await transport.check_open('echo')
+    assert transport.binary_frames_received > 0
+
+    # ...and binary ones, including lengths with a newline byte in them
+    transport.binary_framing = True
+    data = b'x' * 0x0a0a
+    transport.send_data(echo, data)
+    await transport.assert_data(echo, data)
+
+
 @pytest.mark.asyncio
 async def test_host(transport: MockTransport) -> None:
     # try to open a null channel, explicitly naming our host
@@ -428,6 +447,115 @@ async def test_internal_metrics(transport: MockTransport) -> None:
     assert all(d is not False for d in data[0][0])
 
 
+@pytest.mark.asyncio
+async def test_internal_metrics_compress(transport: MockTransport) -> None:
+    metrics = [
+        {"name": "memory.used"},
+        {"name": "mount.total"},
+    ]
+
+    await transport.check_open('metrics1', source='internal', interval=100, metrics=metrics, compress=True)
+    _, data = await transport.next_frame()
+    meta = json.loads(data)
+    instances = len(meta['metrics'][1]['instances'])
+
+    # the first point after meta is sent in full
+    _, data = await transport.next_frame()
+    data = json.loads(data)
+    assert isinstance(data[0][0], int)
+    assert len(data[0][1]) == instances
+
+    # the size of the mounts does not change, so nothing is sent for them
+    _, data = await transport.next_frame()
+    data = json.loads(data)
+    assert data[0][0] is None or isinstance(data[0][0], int)
+    assert data[0][1] == []
+
+
+@pytest.mark.asyncio
+async def test_internal_metrics_aggregate(transport: MockTransport) -> None:
+    metrics = [{"name": "memory.used"}]
+
+    await transport.check_open('metrics1', source='internal', interval=50, metrics=metrics,
+                               aggregate='max', **{'aggregate-samples': 3})
+    _, data = await transport.next_frame()
+    meta = json.loads(data)
+    assert meta['interval'] == 150
+
+    _, data = await transport.next_frame()
+    data = json.loads(data)
+    assert isinstance(data[0][0], int)
+
+    await transport.check_open('metrics1', source='internal', metrics=metrics, aggregate='sum',
+                               problem='protocol-error')
+
+
+@pytest.mark.asyncio
+async def test_internal_metrics_schedule() -> None:
+    reads = 0
+
+    class CountingSampler(Sampler):
+        descriptions = []
+
+        def sample(self, samples: Samples) -> None:
+            nonlocal reads
+            reads += 1
+            samples['count'] = reads
+
+    first: 'asyncio.Queue[Samples | Exception]' = asyncio.Queue()
+    second: 'asyncio.Queue[Samples | Exception]' = asyncio.Queue()
+
+    # Channels with the same interval share the schedule, and the samples of each tick
+    schedule = SampleSchedule.subscribe(10, [CountingSampler], first)
+    assert SampleSchedule.subscribe(10, [CountingSampler], second) is schedule
+    samples = await first.get()
+    assert samples is await second.get()
+    assert reads == 1
+
+    schedule.unsubscribe(first)
+    assert await second.get() is not samples
+    assert reads == 2
+
+    schedule.unsubscribe(second)
+    assert 10 not in SampleSchedule.schedules
+
+
+@pytest.mark.asyncio
+async def test_internal_metrics_schedule_failure() -> None:
+    class GoodSampler(Sampler):
+        descriptions = []
+
+        def sample(self, samples: Samples) -> None:
+            samples['good'] = 1
+
+    class FailingSampler(Sampler):
+        descriptions = []
+
+        def sample(self, samples: Samples) -> None:
+            raise OSError('broken')
+
+    good: 'asyncio.Queue[Samples | Exception]' = asyncio.Queue()
+    failing: 'asyncio.Queue[Samples | Exception]' = asyncio.Queue()
+
+    # Only the channel using the failing sampler gets the exception
+    schedule = SampleSchedule.subscribe(20, [GoodSampler], good)
+    SampleSchedule.subscribe(20, [GoodSampler, FailingSampler], failing)
+    samples = await good.get()
+    assert not isinstance(samples, Exception)
+    assert samples['good'] == 1
+    exc = await failing.get()
+    assert isinstance(exc, OSError)
+
+    # ... and once it is gone, the others carry on
+    schedule.unsubscribe(failing)
+    assert FailingSampler not in schedule.samplers
+    samples = await good.get()
+    assert not isinstance(samples, Exception)
+
+    schedule.unsubscribe(good)
+    assert 20 not in SampleSchedule.schedules
+
+
 @pytest.mark.asyncio
 async def test_fsread1_errors(transport: MockTransport, tmp_path: Path) -> None:
     if os.geteuid() != 0:
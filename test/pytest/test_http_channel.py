@@ -4,6 +4,7 @@
 
 import argparse
 import asyncio
+import json
 import ssl
 from pathlib import Path
 from typing import Any, AsyncGenerator
@@ -135,3 +136,177 @@ async def test_tls_no_validate(transport: MockTransport, tls_server: int) -> Non
                                     tls={'validate': False})
     transport.send_done(ch)
     await assert_http_response(transport, ch, tls=True)
+
+
+@pytest_asyncio.fixture
+async def keepalive_server() -> AsyncGenerator[dict[str, Any], None]:
+    # Answers with the size of the request body, and counts connections
+    state: dict[str, Any] = {'connections': 0}
+
+    async def serve(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        state['connections'] += 1
+        while await reader.readline():
+            headers = {}
+            while (line := await reader.readline()).strip():
+                name, _, value = line.decode().partition(':')
+                headers[name.lower()] = value.strip()
+
+            size = 0
+            if 'content-length' in headers:
+                size = len(await reader.readexactly(int(headers['content-length'])))
+            elif headers.get('transfer-encoding') == 'chunked':
+                while (chunk := int(await reader.readline(), 16)) != 0:
+                    size += len(await reader.readexactly(chunk + 2)) - 2
+                await reader.readline()
+
+            body = f'{size}'.encode()
+            writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s' % (len(body), body))
+            await writer.drain()
+        writer.close()
+
+    server = await asyncio.start_server(serve, '127.0.0.1', 0)
+    state['port'] = server.sockets[0].getsockname()[1]
+    yield state
+    server.close()
+
+
+async def assert_body(transport: MockTransport, ch: str, body: bytes) -> None:
+    await transport.assert_msg('', command='response', channel=ch, status=200, reason='OK')
+    channel, data = await transport.next_frame()
+    assert channel == ch
+    assert data == body
+    await transport.assert_msg('', command='done', channel=ch)
+    await transport.assert_msg('', command='close', channel=ch)
+
+
+@pytest.mark.asyncio
+async def test_keepalive(transport: MockTransport, keepalive_server: dict[str, Any]) -> None:
+    port = keepalive_server['port']
+
+    for _ in range(3):
+        ch = await transport.check_open('http-stream2', method='GET', path='/', port=port, connection='a')
+        transport.send_done(ch)
+        await assert_body(transport, ch, b'0')
+    assert keepalive_server['connections'] == 1
+
+    # a different "connection" does not share
+    ch = await transport.check_open('http-stream2', method='GET', path='/', port=port, connection='b')
+    transport.send_done(ch)
+    await assert_body(transport, ch, b'0')
+    assert keepalive_server['connections'] == 2
+
+
+@pytest.mark.asyncio
+async def test_request_body(transport: MockTransport, keepalive_server: dict[str, Any]) -> None:
+    port = keepalive_server['port']
+
+    # small bodies get a Content-Length, large ones are streamed
+    for size in [10, 1000000]:
+        ch = await transport.check_open('http-stream2', method='POST', path='/', port=port)
+        for offset in range(0, size, 10000):
+            transport.send_data(ch, b'x' * min(10000, size - offset))
+        transport.send_done(ch)
+        await assert_body(transport, ch, str(size).encode())
+
+
+@pytest.mark.asyncio
+async def test_keepalive_needs_connection(transport: MockTransport, keepalive_server: dict[str, Any]) -> None:
+    port = keepalive_server['port']
+
+    # without a "connection" option, every request gets its own connection
+    for _ in range(2):
+        ch = await transport.check_open('http-stream2', method='GET', path='/', port=port)
+        transport.send_done(ch)
+        await assert_body(transport, ch, b'0')
+    assert keepalive_server['connections'] == 2
+
+
+@pytest.mark.asyncio
+async def test_keepalive_stale(transport: MockTransport) -> None:
+    # Answers the first request on each connection.  Later ones are acted on, but then the
+    # connection gets dropped without a response, like a server which timed it out.
+    requests: list[str] = []
+
+    async def serve(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        first = True
+        while line := await reader.readline():
+            requests.append(line.decode().split(' ')[0])
+            while (await reader.readline()).strip():
+                pass
+            if not first:
+                break
+            writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok')
+            await writer.drain()
+            first = False
+        writer.close()
+
+    server = await asyncio.start_server(serve, '127.0.0.1', 0)
+    port = server.sockets[0].getsockname()[1]
+
+    try:
+        ch = await transport.check_open('http-stream2', method='GET', path='/', port=port, connection='stale')
+        transport.send_done(ch)
+        await assert_body(transport, ch, b'ok')
+
+        # a POST never goes over an idle connection, so it can't end up being sent twice
+        ch = await transport.check_open('http-stream2', method='POST', path='/', port=port, connection='stale')
+        transport.send_done(ch)
+        await assert_body(transport, ch, b'ok')
+        assert requests == ['GET', 'POST']
+
+        # a GET is sent again on a new connection
+        ch = await transport.check_open('http-stream2', method='GET', path='/', port=port, connection='stale')
+        transport.send_done(ch)
+        await assert_body(transport, ch, b'ok')
+        assert requests == ['GET', 'POST', 'GET', 'GET']
+    finally:
+        server.close()
+
+
+@pytest.mark.asyncio
+@pytest.mark.parametrize(('framing', 'body'), [
+    (b'Content-Length: -5', b'ok'),
+    (b'Content-Length: +2', b'ok'),
+    (b'Content-Length: 0_2', b'ok'),
+    (b'Content-Length: 2\r\nContent-Length: 3', b'ok'),
+    (b'Transfer-Encoding: chunked', b'+2\r\nok\r\n0\r\n\r\n'),
+    (b'Transfer-Encoding: chunked', b'2\r\nokay\r\n0\r\n\r\n'),
+])
+async def test_keepalive_framing_error(transport: MockTransport, framing: bytes, body: bytes) -> None:
+    # The first response on each connection has broken framing, later ones are fine
+    connections = 0
+
+    async def serve(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        nonlocal connections
+        connections += 1
+        first = True
+        while await reader.readline():
+            while (await reader.readline()).strip():
+                pass
+            if first:
+                writer.write(b'HTTP/1.1 200 OK\r\n' + framing + b'\r\n\r\n' + body)
+            else:
+                writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok')
+            await writer.drain()
+            first = False
+        writer.close()
+
+    server = await asyncio.start_server(serve, '127.0.0.1', 0)
+    port = server.sockets[0].getsockname()[1]
+
+    try:
+        ch = await transport.check_open('http-stream2', method='GET', path='/', port=port, connection='framing')
+        transport.send_done(ch)
+        while True:
+            channel, data = await transport.next_frame()
+            if channel == '' and json.loads(data).get('command') == 'close':
+                break
+        assert json.loads(data) == dict(json.loads(data), channel=ch, problem='terminated')
+
+        # the broken connection is not used again
+        ch = await transport.check_open('http-stream2', method='GET', path='/', port=port, connection='framing')
+        transport.send_done(ch)
+        await assert_body(transport, ch, b'ok')
+        assert connections == 2
+    finally:
+        server.close()
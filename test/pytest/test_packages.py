@@ -9,7 +9,7 @@ from pathlib import Path
 import pytest
 
 from cockpit.jsonutil import JsonValue
-from cockpit.packages import Packages, PackagesLoader, parse_accept_language
+from cockpit.packages import Packages, PackagesLoader, parse_accept_language, parse_byte_ranges
 
 
 @pytest.mark.parametrize(("test_input", "expected"), [
@@ -35,6 +35,30 @@ def test_parse_accept_language(test_input: str, expected: 'tuple[str]') -> None:
     assert parse_accept_language(test_input) == expected
 
 
+@pytest.mark.parametrize(("test_input", "expected"), [
+    # simple, open ended, and suffix ranges
+    ('bytes=0-9', [(0, 9)]),
+    ('bytes=90-', [(90, 99)]),
+    ('bytes=-10', [(90, 99)]),
+    ('bytes=-1000', [(0, 99)]),
+    ('bytes=50-1000', [(50, 99)]),
+    ('bytes=0-0, 10-19 ,-5', [(0, 0), (10, 19), (95, 99)]),
+    # unsatisfiable ranges are dropped
+    ('bytes=100-200', []),
+    ('bytes=-0', []),
+    ('bytes=0-9,200-', [(0, 9)]),
+    # invalid headers get ignored
+    ('items=0-9', None),
+    ('bytes=9-0', None),
+    ('bytes=a-b', None),
+    ('bytes=-', None),
+    ('bytes=5', None),
+    ('bytes=' + ','.join(['0-1'] * 17), None),
+])
+def test_parse_byte_ranges(test_input: str, expected: 'list[tuple[int, int]] | None') -> None:
+    assert parse_byte_ranges(test_input, 100) == expected
+
+
 @pytest.fixture
 def pkgdir(tmp_path: Path, monkeypatch: pytest.MonkeyPatch) -> Path:
     monkeypatch.setenv('XDG_DATA_DIRS', str(tmp_path))